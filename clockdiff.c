@@ -56,6 +56,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 #include <linux/types.h>
 #include <math.h>
 #include <netdb.h>
@@ -69,6 +71,7 @@
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/timex.h>
 #include <sys/types.h>
 #include <time.h>
@@ -81,9 +84,11 @@
 #include "iputils_common.h"
 
 enum {
-	RANGE = 1,		/* best expected round-trip time, ms */
 	MSGS = 50,
+	MAX_MSGS = 10000,
 	TRIALS = 10,
+	PIPELINE = 4,		/* requests in flight per host */
+	RING = 16,		/* requests remembered per host, > PIPELINE */
 
 	GOOD = 0,
 	UNREACHABLE = 2,
@@ -97,7 +102,12 @@ enum {
 	MODULO =  86400000,
 	PROCESSING_TIME	= 0,	/* ms. to reduce error in measurement */
 
-	PACKET_IN = 1024
+	PACKET_IN = 1024,
+	DEFAULT_PARALLEL = 64,	/* hosts measured at once */
+	MIN_TIMEOUT = 10,	/* ms, requests are not given up sooner */
+	MIN_SKEW_SPAN = 1000,	/* ms covered by the samples to estimate skew */
+	WINDOW = 32,		/* rounds kept per host in monitor mode */
+	DEFAULT_BUDGET = 100,	/* requests per second in monitor mode */
 };
 
 enum {
@@ -109,32 +119,78 @@ struct run_state {
 	int interactive;
 	uint16_t id;
 	int sock_raw;
-	struct sockaddr_in server;
 	int ip_opt_len;
-	int measure_delta;
-	int measure_delta1;
-	unsigned short seqno;
-	unsigned short seqno0;
-	unsigned short acked;
-	long rtt;
-	long min_rtt;
-	long rtt_sigma;
-	char *hisname;
 	int time_format;
+	unsigned char packet[PACKET_IN];
+	struct measure_vars *hosts;
+	int nhosts;
+	int parallel;
+	int survey;
+	int count;		/* samples per host */
+	int interval;		/* ms between requests to a host */
+	int rx_tstamp;		/* replies are timed by the kernel */
+	int tx_tstamp;		/* requests are timed by the kernel */
+	uint32_t txkey;		/* SOF_TIMESTAMPING_OPT_ID of the next request */
+	struct request **tx;	/* requests by txkey % ntx */
+	int ntx;
+	int monitor;		/* s between the rounds of a host, 0 for one round */
+	int budget;		/* requests per second, 0 for no limit */
+	double tokens;
+	struct timespec tokens_at;
+	struct timespec start;	/* CLOCK_REALTIME */
+	int json;
+	int max_offset;		/* ms, 0 for no alert */
+	int max_drift;		/* ppm, 0 for no alert */
+};
+
+/* One exchange, times in ms. */
+struct sample {
+	double t;		/* received, since the start of the measurement */
+	double offset;
+	double delay;
+};
+
+struct request {
+	struct timespec sent;		/* CLOCK_REALTIME */
+	struct timespec deadline;	/* CLOCK_MONOTONIC */
+	uint32_t txkey;
+	unsigned short seq;
+	unsigned int
+		pending:1;
 };
 
+/* Measurement state of one host. */
 struct measure_vars {
 	struct timespec ts1;
-	struct timespec tout;
-	int count;
-	int cc;
-	unsigned char packet[PACKET_IN];
-	socklen_t length;
+	struct timespec start;
 	struct icmphdr *icp;
 	struct iphdr *ip;
 	int msgcount;
-	long min1;
-	long min2;
+	struct sample *samples;
+	struct request req[RING];
+	int inflight;
+	struct timespec next_send;
+	struct sockaddr_in server;
+	char *hisname;
+	uint16_t id;
+	unsigned short seqno;
+	unsigned short seqno0;
+	unsigned short acked;
+	long rtt;
+	long min_rtt;
+	long rtt_sigma;
+	int measure_delta;
+	int measure_delta1;
+	double offset;		/* ms, unrounded delta */
+	double delay;		/* ms, of the fastest exchange */
+	double skew;		/* ppm, NAN when not estimated */
+	double skew_err;
+	int status;
+	struct timespec next_round;
+	struct sample window[WINDOW];	/* offsets of the last rounds */
+	int rounds;
+	unsigned int
+		active:1;
 };
 
 /*
@@ -196,45 +252,138 @@ static int in_cksum(unsigned short *addr, int len)
 	return (~sum & 0xffff);
 }
 
-static int measure_inner_loop(struct run_state *ctl, struct measure_vars *mv)
+static double ms_of_day(struct timespec const *ts)
 {
-	long delta1;
-	long delta2;
-	long diff;
-	long histime = 0;
-	long histime1 = 0;
-	long recvtime;
-	long sendtime;
-	struct pollfd p = { .fd = ctl->sock_raw, .events = POLLIN | POLLHUP };
-
-	{
-		long tmo = ctl->rtt + ctl->rtt_sigma;
+	return (ts->tv_sec % (24 * 60 * 60)) * 1000.0 + ts->tv_nsec / 1000000.0;
+}
 
-		mv->tout.tv_sec = tmo / 1000;
-		mv->tout.tv_nsec = (tmo - (tmo / 1000) * 1000) * 1000000;
+static void timespec_add_ms(struct timespec *ts, long ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
 	}
+}
 
-	if ((mv->count = ppoll(&p, 1, &mv->tout, NULL)) <= 0)
-		return BREAK;
+static int timespec_before(struct timespec const *a, struct timespec const *b)
+{
+	return a->tv_sec < b->tv_sec ||
+	       (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void earliest(struct timespec *wake, struct timespec const *when)
+{
+	if (timespec_before(when, wake))
+		*wake = *when;
+}
+
+/*
+ * Have the kernel time the requests when they leave and the replies when
+ * they arrive, so that neither the scheduling of clockdiff nor the system
+ * calls around them add to the measured delays.
+ */
+static void enable_timestamps(struct run_state *ctl)
+{
+	int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE |
+		    SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+		    SOF_TIMESTAMPING_OPT_TSONLY;
+	int on = 1;
+
+	if (!setsockopt(ctl->sock_raw, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)))
+		ctl->rx_tstamp = ctl->tx_tstamp = 1;
+	else if (!setsockopt(ctl->sock_raw, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)))
+		ctl->rx_tstamp = 1;
+}
 
-	clock_gettime(CLOCK_REALTIME, &mv->ts1);
-	mv->cc = recvfrom(ctl->sock_raw, (char *)mv->packet, PACKET_IN, 0, NULL, &mv->length);
+/* The kernel timestamp of a received message, 0 if there is none. */
+static int msg_time(struct msghdr *msg, struct timespec *ts)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    (cmsg->cmsg_type != SCM_TIMESTAMPING &&
+		     cmsg->cmsg_type != SCM_TIMESTAMPNS))
+			continue;
+		/* The software time is first in struct scm_timestamping. */
+		memcpy(ts, CMSG_DATA(cmsg), sizeof(*ts));
+		return ts->tv_sec != 0;
+	}
+	return 0;
+}
 
-	if (mv->cc < 0)
-		return (-1);
+/*
+ * Replace the send times of the requests with their transmit timestamps
+ * from the error queue, and clear any error pending on the socket.
+ */
+static void sock_errors(struct run_state *ctl)
+{
+	char cbuf[512];
+	int err;
+	socklen_t len = sizeof(err);
+
+	for (;;) {
+		struct msghdr msg = { .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+		struct sock_extended_err *ee = NULL;
+		struct cmsghdr *cmsg;
+		struct request *req;
+		struct timespec ts;
+
+		if (recvmsg(ctl->sock_raw, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+			if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+				ee = (struct sock_extended_err *)CMSG_DATA(cmsg);
+		if (!ctl->tx || !ee || ee->ee_origin != SO_EE_ORIGIN_TIMESTAMPING ||
+		    !msg_time(&msg, &ts))
+			continue;
+		req = ctl->tx[ee->ee_data % ctl->ntx];
+		if (req && req->txkey == ee->ee_data)
+			req->sent = ts;
+	}
+	getsockopt(ctl->sock_raw, SOL_SOCKET, SO_ERROR, &err, &len);
+}
 
-	mv->icp = (struct icmphdr *)(mv->packet + (mv->ip->ihl << 2));
+/*
+ * Process the packet in ctl->packet received at mv->ts1 as a possible reply
+ * to one of the requests of mv.
+ */
+static int measure_reply(struct run_state *ctl, struct measure_vars *mv)
+{
+	double delta1;
+	double delta2;
+	double diff;
+	double histime = 0;
+	double histime1 = 0;
+	double recvtime;
+	double sendtime;
+	uint32_t ts[4];		/* send, his, his1 and receive, from the option */
+	struct request *req;
+	struct sample *s;
+
+	mv->ip = (struct iphdr *)ctl->packet;
+	mv->icp = (struct icmphdr *)(ctl->packet + (mv->ip->ihl << 2));
 
 	if (((ctl->ip_opt_len && mv->icp->type == ICMP_ECHOREPLY
-	      && mv->packet[20] == IPOPT_TIMESTAMP)
+	      && ctl->packet[20] == IPOPT_TIMESTAMP)
 	     || mv->icp->type == ICMP_TIMESTAMPREPLY)
-	    && mv->icp->un.echo.id == ctl->id && mv->icp->un.echo.sequence >= ctl->seqno0
-	    && mv->icp->un.echo.sequence <= ctl->seqno) {
+	    && mv->icp->un.echo.id == mv->id && mv->icp->un.echo.sequence >= mv->seqno0
+	    && mv->icp->un.echo.sequence <= mv->seqno) {
+		unsigned short seq = mv->icp->un.echo.sequence;
 		int i;
-		uint8_t *opt = mv->packet + 20;
-
-		if (ctl->acked < mv->icp->un.echo.sequence)
-			ctl->acked = mv->icp->un.echo.sequence;
+		uint8_t *opt = ctl->packet + 20;
+
+		req = &mv->req[seq % RING];
+		if (req->seq != seq)
+			req = NULL;
+		else if (req->pending) {
+			req->pending = 0;
+			mv->inflight--;
+		}
+		if (mv->acked < seq)
+			mv->acked = seq;
 		if (ctl->ip_opt_len) {
 			if ((opt[3] & 0xF) != IPOPT_TS_PRESPEC) {
 				fprintf(stderr, _("Wrong timestamp %d\n"), opt[3] & 0xF);
@@ -244,7 +393,7 @@ static int measure_inner_loop(struct run_state *ctl, struct measure_vars *mv)
 				if ((opt[3] >> 4) != 1 || ctl->ip_opt_len != 4 + 3 * 8)
 					fprintf(stderr, _("Overflow %d hops\n"), opt[3] >> 4);
 			}
-			sendtime = recvtime = histime = histime1 = 0;
+			ts[0] = ts[1] = ts[2] = ts[3] = 0;
 			for (i = 0; i < (opt[2] - 5) / 8; i++) {
 				uint32_t *timep = (uint32_t *) (opt + 4 + i * 8 + 4);
 				uint32_t t = ntohl(*timep);
@@ -253,46 +402,63 @@ static int measure_inner_loop(struct run_state *ctl, struct measure_vars *mv)
 					return NONSTDTIME;
 
 				if (i == 0)
-					sendtime = t;
+					ts[0] = t;
 				if (i == 1)
-					histime = histime1 = t;
+					ts[1] = ts[2] = t;
 				if (i == 2) {
 					if (ctl->ip_opt_len == 4 + 4 * 8)
-						histime1 = t;
+						ts[2] = t;
 					else
-						recvtime = t;
+						ts[3] = t;
 				}
 				if (i == 3)
-					recvtime = t;
+					ts[3] = t;
 			}
 
-			if (!(sendtime & histime & histime1 & recvtime)) {
+			if (!(ts[0] & ts[1] & ts[2] & ts[3])) {
 				fprintf(stderr, _("wrong timestamps\n"));
 				return -1;
 			}
+			sendtime = ts[0];
+			histime = ts[1];
+			histime1 = ts[2];
+			recvtime = ts[3];
+			/* Our own times are known better than the option holds. */
+			if (req) {
+				sendtime = ms_of_day(&req->sent);
+				recvtime = ms_of_day(&mv->ts1);
+				histime += 0.5;
+				histime1 += 0.5;
+			}
 		} else {
-			recvtime = (mv->ts1.tv_sec % (24 * 60 * 60)) * 1000 +
-					mv->ts1.tv_nsec / 1000000;
-			sendtime = ntohl(*(uint32_t *) (mv->icp + 1));
+			recvtime = ms_of_day(&mv->ts1);
+			if (req)
+				sendtime = ms_of_day(&req->sent);
+			else
+				sendtime = ntohl(*(uint32_t *) (mv->icp + 1));
 		}
 		diff = recvtime - sendtime;
 		/* diff can be less than 0 around midnight */
 		if (diff < 0)
 			return CONTINUE;
-		ctl->rtt = (ctl->rtt * 3 + diff) / 4;
-		ctl->rtt_sigma = (ctl->rtt_sigma * 3 + labs(diff - ctl->rtt)) / 4;
-		mv->msgcount++;
+		mv->rtt = (mv->rtt * 3 + lround(diff)) / 4;
+		mv->rtt_sigma = (mv->rtt_sigma * 3 + labs(lround(diff) - mv->rtt)) / 4;
 		if (!ctl->ip_opt_len) {
-			histime = ntohl(((uint32_t *) (mv->icp + 1))[1]);
+			uint32_t t = ntohl(((uint32_t *) (mv->icp + 1))[1]);
+
 			/*
 			 * a hosts using a time format different from ms.  since midnight
 			 * UT (as per RFC792) should set the high order bit of the 32-bit
 			 * time value it transmits.
 			 */
-			if ((histime & 0x80000000) != 0)
+			if ((t & 0x80000000) != 0)
 				return NONSTDTIME;
+			/* The remote clock is read in whole ms, take the middle. */
+			histime = t + 0.5;
 		}
-		if (ctl->interactive) {
+		if (mv->msgcount >= ctl->count)
+			return CONTINUE;
+		if (ctl->interactive && !ctl->survey) {
 			printf(".");
 			fflush(stdout);
 		}
@@ -317,118 +483,583 @@ static int measure_inner_loop(struct run_state *ctl, struct measure_vars *mv)
 		else if (delta2 > BIASP)
 			delta2 -= MODULO;
 
-		if (delta1 < mv->min1)
-			mv->min1 = delta1;
-		if (delta2 < mv->min2)
-			mv->min2 = delta2;
-		if (delta1 + delta2 < ctl->min_rtt) {
-			ctl->min_rtt = delta1 + delta2;
-			ctl->measure_delta1 = (delta1 - delta2) / 2 + PROCESSING_TIME;
-		}
-		if (diff < RANGE) {
-			mv->min1 = delta1;
-			mv->min2 = delta2;
-			return BREAK;
-		}
+		s = &mv->samples[mv->msgcount++];
+		s->t = (mv->ts1.tv_sec - mv->start.tv_sec) * 1000.0 +
+		       (mv->ts1.tv_nsec - mv->start.tv_nsec) / 1000000.0;
+		s->offset = (delta1 - delta2) / 2;
+		s->delay = delta1 + delta2;
+		return BREAK;
 	}
 	return CONTINUE;
 }
 
+static void measure_init(struct run_state *ctl, struct measure_vars *mv)
+{
+	mv->msgcount = 0;
+	mv->samples = calloc(ctl->count, sizeof(*mv->samples));
+	if (!mv->samples)
+		error(1, errno, "calloc");
+	memset(mv->req, 0, sizeof(mv->req));
+	mv->inflight = 0;
+	mv->next_send.tv_sec = mv->next_send.tv_nsec = 0;
+	mv->min_rtt = 0x7fffffff;
+	mv->measure_delta = HOSTDOWN;
+	mv->measure_delta1 = HOSTDOWN;
+	mv->skew = mv->skew_err = NAN;
+	mv->acked = mv->seqno = mv->seqno0 = 0;
+	clock_gettime(CLOCK_REALTIME, &mv->start);
+}
+
+static int cmp_delay(void const *a, void const *b)
+{
+	double d = ((struct sample const *)a)->delay - ((struct sample const *)b)->delay;
+
+	return (d > 0) - (d < 0);
+}
+
+static int cmp_offset(void const *a, void const *b)
+{
+	double d = ((struct sample const *)a)->offset - ((struct sample const *)b)->offset;
+
+	return (d > 0) - (d < 0);
+}
+
 /*
- * Measures the differences between machines' clocks using ICMP timestamp messages.
+ * Fit a least squares line through the offsets of s[0..n) over time, its
+ * slope and standard error go to 'skew' and 'err' in ppm.  Left alone unless
+ * there are three samples at least MIN_SKEW_SPAN apart.
  */
-static int measure(struct run_state *ctl)
+static void fit_skew(struct sample const *s, int n, double *skew, double *err)
 {
-	struct measure_vars mv = {
-		.min1 = 0x7fffffff,
-		.min2 = 0x7fffffff
-	};
-	unsigned char opacket[64] = { 0 };
-	struct icmphdr *oicp = (struct icmphdr *)opacket;
-	struct pollfd p = { .fd = ctl->sock_raw, .events = POLLIN | POLLHUP };
+	double tmin = INFINITY;
+	double tmax = -INFINITY;
+	double mt = 0;
+	double mo = 0;
+	double sxx = 0;
+	double sxy = 0;
+	double ssr = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		mt += s[i].t / n;
+		mo += s[i].offset / n;
+		tmin = MIN(tmin, s[i].t);
+		tmax = MAX(tmax, s[i].t);
+	}
+	if (n < 3 || tmax - tmin < MIN_SKEW_SPAN)
+		return;
+	for (i = 0; i < n; i++) {
+		sxx += (s[i].t - mt) * (s[i].t - mt);
+		sxy += (s[i].t - mt) * (s[i].offset - mo);
+	}
+	for (i = 0; i < n; i++) {
+		double r = s[i].offset - mo - sxy / sxx * (s[i].t - mt);
 
-	mv.ip = (struct iphdr *)mv.packet;
-	ctl->min_rtt = 0x7fffffff;
-	ctl->measure_delta = HOSTDOWN;
-	ctl->measure_delta1 = HOSTDOWN;
+		ssr += r * r;
+	}
+	/* ms per ms is 1e6 ppm */
+	*skew = sxy / sxx * 1e6;
+	*err = sqrt(ssr / (n - 2) / sxx) * 1e6;
+}
 
-	/* empties the icmp input queue */
- empty:
-	if (ppoll(&p, 1, &mv.tout, NULL)) {
-		mv.length = sizeof(struct sockaddr_in);
-		mv.cc = recvfrom(ctl->sock_raw, (char *)mv.packet, PACKET_IN, 0,
-			      NULL, &mv.length);
-		if (mv.cc < 0)
-			return -1;
-		goto empty;
+/*
+ * Reduce the samples of mv to the reported values, in the manner of the NTP
+ * clock filter: only the quarter of the exchanges with the lowest delay is
+ * trusted, the fastest one gives delta1, the median of the selection weighted
+ * by how close each delay is to the minimum gives delta.  A least squares
+ * line through the selection gives the frequency skew, provided the samples
+ * span long enough for the ms resolution of the timestamps to matter little.
+ */
+static void measure_finish(struct measure_vars *mv)
+{
+	struct sample *sel = mv->samples;
+	int n = MAX(mv->msgcount / 4, MIN(mv->msgcount, 2));
+	double total = 0;
+	double sum = 0;
+	double dmin;
+	int i;
+
+	qsort(sel, mv->msgcount, sizeof(*sel), cmp_delay);
+	dmin = sel[0].delay;
+	mv->min_rtt = lround(dmin);
+	mv->measure_delta1 = lround(sel[0].offset) + PROCESSING_TIME;
+
+	qsort(sel, n, sizeof(*sel), cmp_offset);
+	for (i = 0; i < n; i++)
+		total += 1 / (sel[i].delay - dmin + 1);
+	for (i = 0; i < n; i++) {
+		sum += 1 / (sel[i].delay - dmin + 1);
+		if (sum >= total / 2)
+			break;
 	}
+	mv->measure_delta = lround(sel[i].offset) + PROCESSING_TIME;
+	mv->offset = sel[i].offset;
+	mv->delay = dmin;
+	fit_skew(sel, n, &mv->skew, &mv->skew_err);
+}
 
-	/*
-	 * To measure the difference, select MSGS messages whose round-trip time is
-	 * smaller than RANGE if ckrange is 1, otherwise simply select MSGS messages
-	 * regardless of round-trip transmission time.  Choose the smallest transmission
-	 * time in each of the two directions.  Use these two latter quantities to
-	 * compute the delta between the two clocks.
-	 */
+/* Send the next request of mv, stamped with the current time. */
+static int send_request(struct run_state *ctl, struct measure_vars *mv,
+			struct timespec *now)
+{
+	unsigned char opacket[64] = { 0 };
+	struct icmphdr *oicp = (struct icmphdr *)opacket;
+	struct request *req;
 
-	mv.length = sizeof(struct sockaddr_in);
 	if (ctl->ip_opt_len)
 		oicp->type = ICMP_ECHO;
 	else
 		oicp->type = ICMP_TIMESTAMP;
 	oicp->code = 0;
-	oicp->checksum = 0;
-	oicp->un.echo.id = ctl->id;
-	((uint32_t *) (oicp + 1))[0] = 0;
-	((uint32_t *) (oicp + 1))[1] = 0;
-	((uint32_t *) (oicp + 1))[2] = 0;
+	oicp->un.echo.id = mv->id;
+	oicp->un.echo.sequence = ++mv->seqno;
 
-	ctl->acked = ctl->seqno = ctl->seqno0 = 0;
+	req = &mv->req[mv->seqno % RING];
+	if (req->pending) {
+		req->pending = 0;
+		mv->inflight--;
+	}
+	clock_gettime(CLOCK_REALTIME, &req->sent);
+	*(uint32_t *) (oicp + 1) = htonl(lround(floor(ms_of_day(&req->sent))));
+	oicp->checksum = in_cksum((unsigned short *)oicp, sizeof(*oicp) + 12);
+
+	if (sendto(ctl->sock_raw, (char *)opacket, sizeof(*oicp) + 12, 0,
+		   (struct sockaddr *)&mv->server, sizeof(struct sockaddr_in)) < 0)
+		return -1;
+	if (ctl->tx_tstamp) {
+		req->txkey = ctl->txkey++;
+		ctl->tx[req->txkey % ctl->ntx] = req;
+	}
+	req->seq = mv->seqno;
+	req->pending = 1;
+	req->deadline = *now;
+	timespec_add_ms(&req->deadline, MAX(mv->rtt + mv->rtt_sigma, MIN_TIMEOUT));
+	mv->inflight++;
+	mv->next_send = *now;
+	timespec_add_ms(&mv->next_send, ctl->interval);
+	return 0;
+}
 
-	for (mv.msgcount = 0; mv.msgcount < MSGS;) {
-		char escape = 0;
+/*
+ * Take a request from the token bucket of ctl->budget per second, or lower
+ * 'wake' to when the next one is available.
+ */
+static int budget_take(struct run_state *ctl, struct timespec *now, struct timespec *wake)
+{
+	struct timespec when = *now;
+	struct timespec dt;
+
+	if (!ctl->budget)
+		return 1;
+	timespecsub(now, &ctl->tokens_at, &dt);
+	ctl->tokens = MIN(ctl->tokens + (dt.tv_sec + dt.tv_nsec / 1e9) * ctl->budget,
+			  ctl->budget);
+	ctl->tokens_at = *now;
+	if (ctl->tokens >= 1) {
+		ctl->tokens--;
+		return 1;
+	}
+	timespec_add_ms(&when, (long)ceil((1 - ctl->tokens) * 1000 / ctl->budget));
+	earliest(wake, &when);
+	return 0;
+}
 
-		/*
-		 * If no answer is received for TRIALS consecutive times, the machine is
-		 * assumed to be down
-		 */
-		if (ctl->seqno - ctl->acked > TRIALS) {
-			errno = EHOSTDOWN;
-			return HOSTDOWN;
-		}
+/*
+ * Expire the requests of mv, and send new ones while fewer than PIPELINE are
+ * in flight and the interval and budget allow.  'wake' is lowered to the next event of
+ * the host.  Returns 0 when the host is finished.
+ */
+static int measure_service(struct run_state *ctl, struct measure_vars *mv,
+			   struct timespec *now, struct timespec *wake)
+{
+	int i;
 
-		oicp->un.echo.sequence = ++ctl->seqno;
-		oicp->checksum = 0;
+	for (i = 0; i < RING; i++) {
+		struct request *req = &mv->req[i];
 
-		clock_gettime(CLOCK_REALTIME, &mv.ts1);
-		*(uint32_t *) (oicp + 1) =
-		    htonl((mv.ts1.tv_sec % (24 * 60 * 60)) * 1000 + mv.ts1.tv_nsec / 1000000);
-		oicp->checksum = in_cksum((unsigned short *)oicp, sizeof(*oicp) + 12);
+		if (req->pending && !timespec_before(now, &req->deadline)) {
+			req->pending = 0;
+			mv->inflight--;
+		}
+	}
 
-		mv.count = sendto(ctl->sock_raw, (char *)opacket, sizeof(*oicp) + 12, 0,
-			       (struct sockaddr *)&ctl->server, sizeof(struct sockaddr_in));
+	if (mv->msgcount >= ctl->count) {
+		measure_finish(mv);
+		mv->status = GOOD;
+		goto done;
+	}
+	/*
+	 * If no answer is received for TRIALS consecutive times, the machine is
+	 * assumed to be down
+	 */
+	if (mv->seqno - mv->acked > TRIALS && !mv->inflight) {
+		errno = EHOSTDOWN;
+		mv->status = HOSTDOWN;
+		goto done;
+	}
 
-		if (mv.count < 0) {
+	while (mv->inflight < PIPELINE && mv->msgcount + mv->inflight < ctl->count &&
+	       mv->seqno - mv->acked <= TRIALS && !timespec_before(now, &mv->next_send)) {
+		if (!budget_take(ctl, now, wake))
+			break;
+		if (send_request(ctl, mv, now) < 0) {
 			errno = EHOSTUNREACH;
-			return UNREACHABLE;
+			mv->status = UNREACHABLE;
+			goto done;
+		}
+	}
+
+	for (i = 0; i < RING; i++)
+		if (mv->req[i].pending)
+			earliest(wake, &mv->req[i].deadline);
+	if (mv->inflight < PIPELINE && mv->msgcount + mv->inflight < ctl->count &&
+	    mv->seqno - mv->acked <= TRIALS && timespec_before(now, &mv->next_send))
+		earliest(wake, &mv->next_send);
+	return 1;
+ done:
+	free(mv->samples);
+	mv->samples = NULL;
+	mv->active = 0;
+	return 0;
+}
+
+/* Print 's' as a JSON string, host names come from the command line or DNS. */
+static void json_string(char const *s)
+{
+	unsigned char const *p;
+
+	putchar('"');
+	for (p = (unsigned char const *)s; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			printf("\\%c", *p);
+		else if (*p < 0x20)
+			printf("\\u%04x", *p);
+		else
+			putchar(*p);
+	}
+	putchar('"');
+}
+
+/*
+ * Print the result of the last round of mv as one line of the monitor
+ * stream, with the drift fitted through the offsets of the last WINDOW rounds.
+ */
+static void monitor_report(struct run_state *ctl, struct measure_vars *mv)
+{
+	char const *st;
+	double drift = NAN;
+	double drift_err;
+	int alert = 0;
+
+	switch (mv->status) {
+	case GOOD:
+		st = "ok";
+		break;
+	case HOSTDOWN:
+		st = "down";
+		break;
+	case UNREACHABLE:
+		st = "unreachable";
+		break;
+	case NONSTDTIME:
+		st = "nonstandard";
+		break;
+	default:
+		st = "error";
+	}
+
+	if (mv->status == GOOD) {
+		struct sample *w = &mv->window[mv->rounds++ % WINDOW];
+
+		w->t = (mv->start.tv_sec - ctl->start.tv_sec) * 1000.0 +
+		       (mv->start.tv_nsec - ctl->start.tv_nsec) / 1000000.0;
+		w->offset = mv->offset;
+		w->delay = mv->delay;
+		fit_skew(mv->window, MIN(mv->rounds, WINDOW), &drift, &drift_err);
+		alert = (ctl->max_offset && fabs(mv->offset) > ctl->max_offset) ||
+			(ctl->max_drift && fabs(drift) > ctl->max_drift);
+	}
+
+	if (ctl->json) {
+		printf("{\"time\":%ld,\"host\":", (long)time(NULL));
+		json_string(mv->hisname);
+		printf(",\"status\":\"%s\"", st);
+		if (mv->status == GOOD) {
+			printf(",\"rtt\":%.3f,\"offset\":%.3f,\"error\":%.3f",
+			       mv->delay, mv->offset, mv->delay / 2 + 0.5);
+			if (isnan(mv->skew))
+				printf(",\"skew\":null");
+			else
+				printf(",\"skew\":%.1f", mv->skew);
+			if (isnan(drift))
+				printf(",\"drift\":null");
+			else
+				printf(",\"drift\":%.3f", drift);
+		}
+		printf(",\"alert\":%s}\n", alert ? "true" : "false");
+	} else {
+		printf("%ld %s %s", (long)time(NULL), mv->hisname, st);
+		if (mv->status == GOOD) {
+			printf(" %.3f %.3f %.3f", mv->delay, mv->offset, mv->delay / 2 + 0.5);
+			if (isnan(drift))
+				printf(" -");
+			else
+				printf(" %.3f", drift);
+			if (alert)
+				printf(" alert");
+		}
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
+/*
+ * Measure all ctl->hosts over the one raw socket, ctl->parallel of them at
+ * once, each with up to PIPELINE requests in flight.  Replies are told apart
+ * by their icmp id, which is ctl->id plus the index of the host, and checked
+ * against its address.  In monitor mode this never returns, every host starts
+ * a new round ctl->monitor seconds after the start of the previous one.
+ *
+ * All timers go through one timerfd armed at the earliest of them, 'wake',
+ * and the hosts are only walked when it expires.
+ */
+static void survey(struct run_state *ctl)
+{
+	struct pollfd p[2] = {
+		{ .fd = ctl->sock_raw, .events = POLLIN },
+		{ .events = POLLIN }
+	};
+	struct timespec wake = { 0, 0 };
+	struct itimerspec armed = { { 0, 0 }, { 0, 0 } };
+	char cbuf[512];
+	int first = 0;
+	int next = ctl->monitor ? ctl->nhosts : 0;
+	int active = 0;
+	int i;
+
+	p[1].fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (p[1].fd < 0)
+		error(1, errno, "timerfd_create");
+	if (ctl->tx_tstamp) {
+		ctl->ntx = MIN(ctl->nhosts, ctl->parallel) * RING;
+		ctl->tx = calloc(ctl->ntx, sizeof(*ctl->tx));
+		if (!ctl->tx)
+			error(1, errno, "calloc");
+	}
+	clock_gettime(CLOCK_REALTIME, &ctl->start);
+	clock_gettime(CLOCK_MONOTONIC, &ctl->tokens_at);
+	ctl->tokens = ctl->budget;
+
+	while (ctl->monitor || next < ctl->nhosts || active) {
+		struct iovec iov = { .iov_base = ctl->packet, .iov_len = PACKET_IN };
+		struct msghdr msg = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = cbuf,
+			.msg_controllen = sizeof(cbuf)
+		};
+		struct timespec now;
+		struct measure_vars *mv;
+		uint64_t expirations;
+		uint16_t idx;
+		int ret;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		while (active < ctl->parallel && next < ctl->nhosts) {
+			mv = &ctl->hosts[next++];
+			measure_init(ctl, mv);
+			mv->active = 1;
+			active += measure_service(ctl, mv, &now, &wake);
 		}
 
-		while (!escape) {
-			int ret = measure_inner_loop(ctl, &mv);
-
-			switch (ret) {
-				case BREAK:
-					escape = 1;
-					break;
-				case CONTINUE:
-					continue;
-				default:
-					return ret;
+		/* Walk all hosts only when a timer of one of them is due. */
+		if (!timespec_before(&now, &wake)) {
+			wake = now;
+			wake.tv_sec++;
+			while (!ctl->monitor && first < next && !ctl->hosts[first].active)
+				first++;
+			for (i = first; i < next; i++) {
+				mv = &ctl->hosts[i];
+				if (!mv->active && ctl->monitor) {
+					if (timespec_before(&now, &mv->next_round)) {
+						earliest(&wake, &mv->next_round);
+						continue;
+					}
+					if (active == ctl->parallel)
+						continue;
+					measure_init(ctl, mv);
+					mv->active = 1;
+					mv->next_round = now;
+					timespec_add_ms(&mv->next_round, ctl->monitor * 1000L);
+					active++;
+				}
+				if (mv->active && !measure_service(ctl, mv, &now, &wake)) {
+					active--;
+					if (ctl->monitor)
+						monitor_report(ctl, mv);
+				}
 			}
 		}
+		if (!ctl->monitor && !active && next == ctl->nhosts)
+			break;
+		if (active < ctl->parallel && next < ctl->nhosts)
+			continue;
+
+		if (wake.tv_sec != armed.it_value.tv_sec ||
+		    wake.tv_nsec != armed.it_value.tv_nsec) {
+			armed.it_value = wake;
+			if (timerfd_settime(p[1].fd, TFD_TIMER_ABSTIME, &armed, NULL) < 0)
+				error(1, errno, "timerfd_settime");
+		}
+		if (ppoll(p, 2, NULL, NULL) <= 0)
+			continue;
+		if (p[1].revents & POLLIN &&
+		    read(p[1].fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+			error(1, errno, "timerfd");
+		if (p[0].revents & POLLERR)
+			sock_errors(ctl);
+		if (!(p[0].revents & POLLIN))
+			continue;
+		if (recvmsg(ctl->sock_raw, &msg, 0) <
+		    (int)(sizeof(struct iphdr) + sizeof(struct icmphdr) + 12))
+			continue;
+
+		idx = ((struct icmphdr *)(ctl->packet +
+			(((struct iphdr *)ctl->packet)->ihl << 2)))->un.echo.id - ctl->id;
+		if (idx >= next)
+			continue;
+		mv = &ctl->hosts[idx];
+		if (!mv->active ||
+		    ((struct iphdr *)ctl->packet)->saddr != mv->server.sin_addr.s_addr)
+			continue;
+
+		if (!msg_time(&msg, &mv->ts1))
+			clock_gettime(CLOCK_REALTIME, &mv->ts1);
+		/* The transmit time of the request is queued before the reply. */
+		if (ctl->tx_tstamp)
+			sock_errors(ctl);
+		ret = measure_reply(ctl, mv);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (ret != BREAK && ret != CONTINUE) {
+			mv->status = ret;
+			free(mv->samples);
+			mv->samples = NULL;
+			mv->active = 0;
+		} else if (measure_service(ctl, mv, &now, &wake))
+			continue;
+		active--;
+		if (ctl->monitor) {
+			monitor_report(ctl, mv);
+			/* Let a waiting host have the place. */
+			wake = now;
+		}
+	}
+	free(ctl->tx);
+	ctl->tx = NULL;
+	close(p[1].fd);
+}
+
+/*
+ * Measures the differences between machines' clocks using ICMP timestamp messages.
+ */
+static int measure(struct run_state *ctl, struct measure_vars *mv)
+{
+	struct pollfd p = { .fd = ctl->sock_raw, .events = POLLIN | POLLHUP };
+	struct timespec tout = { 0, 0 };
+
+	/* empties the icmp input queue */
+	while (ppoll(&p, 1, &tout, NULL) > 0)
+		if (recv(ctl->sock_raw, ctl->packet, PACKET_IN, 0) < 0)
+			return -1;
+
+	ctl->hosts = mv;
+	ctl->nhosts = 1;
+	survey(ctl);
+	return mv->status;
+}
+
+static void survey_print(struct run_state *ctl)
+{
+	int i;
+
+	printf("%-32s %8s %8s %8s %8s %8s %8s %8s\n", _("host"), _("rtt"), _("sigma"),
+	       _("min_rtt"), _("delta"), _("delta1"), _("error"), _("skew"));
+	for (i = 0; i < ctl->nhosts; i++) {
+		struct measure_vars *mv = &ctl->hosts[i];
+
+		printf("%-32s ", mv->hisname);
+		switch (mv->status) {
+		case GOOD:
+			/* The offset of the fastest exchange is known within half its rtt. */
+			printf("%8ld %8ld %8ld %8d %8d %8ld", mv->rtt, mv->rtt_sigma,
+			       mv->min_rtt, mv->measure_delta, mv->measure_delta1,
+			       (mv->min_rtt + 1) / 2);
+			if (isnan(mv->skew))
+				printf(" %8s\n", "-");
+			else
+				printf(" %8.1f\n", mv->skew);
+			break;
+		case HOSTDOWN:
+			printf(_("is down\n"));
+			break;
+		case NONSTDTIME:
+			printf(_("time transmitted in a non-standard format\n"));
+			break;
+		default:
+			printf(_("is unreachable\n"));
+		}
+	}
+}
+
+/* Add the host 'name' to the survey, returns -1 if it cannot be resolved. */
+static int survey_add(struct run_state *ctl, char const *name, int *size)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_INET,
+		.ai_socktype = SOCK_RAW,
+		.ai_flags = AI_CANONNAME
+	};
+	struct addrinfo *result;
+	struct measure_vars *mv;
+	int status;
+
+	status = getaddrinfo(name, NULL, &hints, &result);
+	if (status) {
+		error(0, 0, "%s: %s", name, gai_strerror(status));
+		return -1;
+	}
+	if (ctl->nhosts == UINT16_MAX)
+		error(1, 0, _("too many hosts"));
+	if (ctl->nhosts == *size) {
+		*size = *size ? *size * 2 : 64;
+		ctl->hosts = realloc(ctl->hosts, *size * sizeof(*ctl->hosts));
+		if (!ctl->hosts)
+			error(1, errno, "realloc");
+	}
+	mv = &ctl->hosts[ctl->nhosts];
+	memset(mv, 0, sizeof(*mv));
+	mv->hisname = strdup(name);
+	memcpy(&mv->server, result->ai_addr, sizeof(mv->server));
+	mv->id = ctl->id + ctl->nhosts;
+	mv->rtt = 1000;
+	freeaddrinfo(result);
+	ctl->nhosts++;
+	return 0;
+}
+
+static void survey_read(struct run_state *ctl, FILE *in, int *size)
+{
+	char *line = NULL;
+	size_t len = 0;
+
+	while (getline(&line, &len, in) != -1) {
+		char *p = line + strspn(line, " \t");
+
+		p[strcspn(p, " \t\r\n#")] = '\0';
+		if (*p)
+			survey_add(ctl, p, size);
 	}
-	ctl->measure_delta = (mv.min1 - mv.min2) / 2 + PROCESSING_TIME;
-	return GOOD;
+	free(line);
 }
 
 static void drop_rights(void)
@@ -449,7 +1080,7 @@ static void usage(int exit_status)
 	drop_rights();
 	fprintf(stderr, _(
 		"\nUsage:\n"
-		"  clockdiff [options] <destination>\n"
+		"  clockdiff [options] <destination>...\n"
 		"\nOptions:\n"
 		"                without -o, use icmp timestamp only (see RFC0792, page 16)\n"
 		"  -o            use ip timestamp and icmp echo\n"
@@ -457,6 +1088,23 @@ static void usage(int exit_status)
 		"  -T, --time-format <ctime|iso>\n"
 		"                  specify display time format, ctime is the default\n"
 		"  -I            alias of --time-format=iso\n"
+		"  -f, --file <file>\n"
+		"                measure the hosts listed in <file>, - for stdin\n"
+		"  -p, --parallel <num>\n"
+		"                hosts measured at once with several destinations\n"
+		"  -c, --count <num>\n"
+		"                samples taken from each host\n"
+		"  -i, --interval <ms>\n"
+		"                wait between requests to a host\n"
+		"  -m, --monitor <sec>\n"
+		"                measure the hosts again every <sec> and stream the results\n"
+		"  -b, --budget <num>\n"
+		"                requests sent per second at most\n"
+		"  -j, --json    stream the results of -m as json\n"
+		"  -O, --max-offset <ms>\n"
+		"                flag results of -m with a larger offset\n"
+		"  -D, --max-drift <ppm>\n"
+		"                flag results of -m with a larger drift\n"
 		"  -h, --help    display this help\n"
 		"  -V, --version print version and exit\n"
 		"  <destination> dns name or ip address\n"
@@ -464,18 +1112,54 @@ static void usage(int exit_status)
 	exit(exit_status);
 }
 
-static void parse_opts(struct run_state *ctl, int argc, char **argv)
+static void parse_opts(struct run_state *ctl, int argc, char **argv, char **file)
 {
 	static const struct option longopts[] = {
 		{"time-format", required_argument, NULL, 'T'},
+		{"file", required_argument, NULL, 'f'},
+		{"parallel", required_argument, NULL, 'p'},
+		{"count", required_argument, NULL, 'c'},
+		{"interval", required_argument, NULL, 'i'},
+		{"monitor", required_argument, NULL, 'm'},
+		{"budget", required_argument, NULL, 'b'},
+		{"json", no_argument, NULL, 'j'},
+		{"max-offset", required_argument, NULL, 'O'},
+		{"max-drift", required_argument, NULL, 'D'},
 		{"version", no_argument, NULL, 'V'},
 		{"help", no_argument, NULL, 'h'},
 		{NULL, 0, NULL, 0}
 	};
 	int c;
 
-	while ((c = getopt_long(argc, argv, "o1T:IVh", longopts, NULL)) != -1)
+	while ((c = getopt_long(argc, argv, "o1T:IVhf:p:c:i:m:b:jO:D:", longopts, NULL)) != -1)
 		switch (c) {
+		case 'f':
+			*file = optarg;
+			break;
+		case 'p':
+			ctl->parallel = strtol_or_err(optarg, _("invalid argument"), 1, UINT16_MAX);
+			break;
+		case 'c':
+			ctl->count = strtol_or_err(optarg, _("invalid argument"), 2, MAX_MSGS);
+			break;
+		case 'i':
+			ctl->interval = strtol_or_err(optarg, _("invalid argument"), 0, 3600000);
+			break;
+		case 'm':
+			ctl->monitor = strtol_or_err(optarg, _("invalid argument"), 1, 86400);
+			break;
+		case 'b':
+			ctl->budget = strtol_or_err(optarg, _("invalid argument"), 1, 1000000);
+			break;
+		case 'j':
+			ctl->json = 1;
+			break;
+		case 'O':
+			ctl->max_offset = strtol_or_err(optarg, _("invalid argument"), 1, MODULO);
+			break;
+		case 'D':
+			ctl->max_drift = strtol_or_err(optarg, _("invalid argument"), 1, 1000000);
+			break;
 		case 'o':
 			ctl->ip_opt_len = 4 + 4 * 8;
 			break;
@@ -510,8 +1194,12 @@ static void parse_opts(struct run_state *ctl, int argc, char **argv)
 int main(int argc, char **argv)
 {
 	struct run_state ctl = {
-		.rtt = 1000,
-		.time_format = time_format_ctime
+		.time_format = time_format_ctime,
+		.parallel = DEFAULT_PARALLEL,
+		.count = MSGS
+	};
+	struct measure_vars mv = {
+		.rtt = 1000
 	};
 	int measure_status;
 
@@ -522,18 +1210,20 @@ int main(int argc, char **argv)
 	};
 	struct addrinfo *result;
 	int status;
+	char *file = NULL;
 
 	atexit(close_stdout);
 
-	parse_opts(&ctl, argc, argv);
+	parse_opts(&ctl, argc, argv, &file);
 	argc -= optind;
 	argv += optind;
-	if (argc != 1)
+	if (argc < 1 && !file)
 		usage(1);
 
 	ctl.sock_raw = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
 	if (ctl.sock_raw < 0)
 		error(1, errno, "socket");
+	enable_timestamps(&ctl);
 	if (nice(-16) == -1)
 		error(1, errno, "nice");
 	drop_rights();
@@ -543,15 +1233,46 @@ int main(int argc, char **argv)
 
 	ctl.id = getpid();
 
+	if (ctl.monitor && !ctl.budget)
+		ctl.budget = DEFAULT_BUDGET;
+	if (argc > 1 || file || ctl.monitor) {
+		int size = 0;
+		int i;
+
+		if (ctl.ip_opt_len)
+			error(1, 0, _("-o cannot be used with several destinations or -m"));
+		ctl.survey = 1;
+		/* Room for every reply in flight, and our own requests looped back. */
+		i = ctl.parallel * PIPELINE * 2 * PACKET_IN;
+		setsockopt(ctl.sock_raw, SOL_SOCKET, SO_RCVBUF, &i, sizeof(i));
+		for (i = 0; i < argc; i++)
+			survey_add(&ctl, argv[i], &size);
+		if (file) {
+			FILE *in = stdin;
+
+			if (strcmp(file, "-") && !(in = fopen(file, "r")))
+				error(1, errno, "%s", file);
+			survey_read(&ctl, in, &size);
+			if (in != stdin)
+				fclose(in);
+		}
+		if (ctl.monitor && !ctl.nhosts)
+			error(1, 0, _("no destination to monitor"));
+		survey(&ctl);
+		survey_print(&ctl);
+		exit(0);
+	}
+
+	mv.id = ctl.id;
 	status = getaddrinfo(argv[0], NULL, &hints, &result);
 	if (status)
 		error(1, 0, "%s: %s", argv[0], gai_strerror(status));
-	ctl.hisname = strdup(result->ai_canonname);
+	mv.hisname = strdup(result->ai_canonname);
 
-	memcpy(&ctl.server, result->ai_addr, sizeof ctl.server);
+	memcpy(&mv.server, result->ai_addr, sizeof mv.server);
 	freeaddrinfo(result);
 
-	if (connect(ctl.sock_raw, (struct sockaddr *)&ctl.server, sizeof(ctl.server)) == -1)
+	if (connect(ctl.sock_raw, (struct sockaddr *)&mv.server, sizeof(mv.server)) == -1)
 		error(1, errno, "connect");
 	if (ctl.ip_opt_len) {
 		struct sockaddr_in myaddr = { 0 };
@@ -568,10 +1289,10 @@ int main(int argc, char **argv)
 		if (getsockname(ctl.sock_raw, (struct sockaddr *)&myaddr, &addrlen) == -1)
 			error(1, errno, "getsockname");
 		((uint32_t *) (rspace + 4))[0 * 2] = myaddr.sin_addr.s_addr;
-		((uint32_t *) (rspace + 4))[1 * 2] = ctl.server.sin_addr.s_addr;
+		((uint32_t *) (rspace + 4))[1 * 2] = mv.server.sin_addr.s_addr;
 		((uint32_t *) (rspace + 4))[2 * 2] = myaddr.sin_addr.s_addr;
 		if (ctl.ip_opt_len == 4 + 4 * 8) {
-			((uint32_t *) (rspace + 4))[2 * 2] = ctl.server.sin_addr.s_addr;
+			((uint32_t *) (rspace + 4))[2 * 2] = mv.server.sin_addr.s_addr;
 			((uint32_t *) (rspace + 4))[3 * 2] = myaddr.sin_addr.s_addr;
 		}
 
@@ -582,7 +1303,7 @@ int main(int argc, char **argv)
 		free(rspace);
 	}
 
-	measure_status = measure(&ctl);
+	measure_status = measure(&ctl, &mv);
 	if (measure_status < 0) {
 		if (errno)
 			error(1, errno, "measure");
@@ -591,13 +1312,13 @@ int main(int argc, char **argv)
 
 	switch (measure_status) {
 	case HOSTDOWN:
-		error(1, 0, _("%s is down"), ctl.hisname);
+		error(1, 0, _("%s is down"), mv.hisname);
 		break;
 	case NONSTDTIME:
-		error(1, 0, _("%s time transmitted in a non-standard format"), ctl.hisname);
+		error(1, 0, _("%s time transmitted in a non-standard format"), mv.hisname);
 		break;
 	case UNREACHABLE:
-		error(1, 0, _("%s is unreachable"), ctl.hisname);
+		error(1, 0, _("%s is unreachable"), mv.hisname);
 		break;
 	default:
 		break;
@@ -615,11 +1336,16 @@ int main(int argc, char **argv)
 				strftime(s, sizeof(s), "%Y-%m-%dT%H:%M:%S%z\n", &tm);
 			} else
 				strftime(s, sizeof(s), "%a %b %e %H:%M:%S %Y", &tm);
-			printf(_("\nhost=%s rtt=%ld(%ld)ms/%ldms delta=%dms/%dms %s"),
-				ctl.hisname, ctl.rtt, ctl.rtt_sigma, ctl.min_rtt,
-				ctl.measure_delta, ctl.measure_delta1, s);
-		} else
-			printf("%ld %d %d\n", now, ctl.measure_delta, ctl.measure_delta1);
+			printf(_("\nhost=%s rtt=%ld(%ld)ms/%ldms delta=%dms/%dms"),
+				mv.hisname, mv.rtt, mv.rtt_sigma, mv.min_rtt,
+				mv.measure_delta, mv.measure_delta1);
+			if (!isnan(mv.skew))
+				printf(_(" skew=%+.1f(%.1f)ppm"), mv.skew, mv.skew_err);
+			printf(" %s", s);
+		} else {
+			/* Scripts parse this line, it keeps its three fields. */
+			printf("%ld %d %d\n", now, mv.measure_delta, mv.measure_delta1);
+		}
 	}
 	exit(0);
 }
@@ -0,0 +1,281 @@
+/*
+ * doubletree.c
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "doubletree.h"
+#include "iputils_common.h"
+
+enum {
+	HOPSET_INITIAL_SIZE = 1024,
+};
+
+static uint32_t hopset_hash(void const *key, size_t len)
+{
+	unsigned char const *p = key;
+	uint32_t h = 2166136261U;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static void hopset_alloc(struct hopset *set, size_t size)
+{
+	set->size = size;
+	set->count = 0;
+	set->keys = malloc(size * set->keylen);
+	set->used = calloc(size, 1);
+	if (!set->keys || !set->used)
+		error(1, errno, "cannot allocate memory");
+}
+
+static size_t hopset_slot(struct hopset const *set, void const *key)
+{
+	size_t i = hopset_hash(key, set->keylen) & (set->size - 1);
+
+	while (set->used[i] && memcmp(set->keys + i * set->keylen, key, set->keylen))
+		i = (i + 1) & (set->size - 1);
+	return i;
+}
+
+void hopset_init(struct hopset *set, size_t keylen)
+{
+	set->keylen = keylen;
+	hopset_alloc(set, HOPSET_INITIAL_SIZE);
+}
+
+/* Returns 1 when the key was not in the set yet. */
+int hopset_add(struct hopset *set, void const *key)
+{
+	size_t i;
+
+	if (2 * (set->count + 1) > set->size) {
+		struct hopset old = *set;
+		size_t iter = 0;
+		void const *k;
+
+		hopset_alloc(set, old.size * 2);
+		while ((k = hopset_next(&old, &iter)) != NULL)
+			hopset_add(set, k);
+		hopset_free(&old);
+	}
+	i = hopset_slot(set, key);
+	if (set->used[i])
+		return 0;
+	memcpy(set->keys + i * set->keylen, key, set->keylen);
+	set->used[i] = 1;
+	set->count++;
+	return 1;
+}
+
+int hopset_contains(struct hopset const *set, void const *key)
+{
+	return set->used[hopset_slot(set, key)];
+}
+
+void const *hopset_next(struct hopset const *set, size_t *iter)
+{
+	for (; *iter < set->size; (*iter)++) {
+		if (set->used[*iter])
+			return set->keys + (*iter)++ * set->keylen;
+	}
+	return NULL;
+}
+
+void hopset_free(struct hopset *set)
+{
+	free(set->keys);
+	free(set->used);
+	set->keys = NULL;
+	set->used = NULL;
+}
+
+/* IPv4 addresses are kept IPv4-mapped so both families share one key. */
+void dt_addr(struct in6_addr *addr, struct sockaddr const *sa)
+{
+	memset(addr, 0, sizeof(*addr));
+	switch (sa->sa_family) {
+	case AF_INET6:
+		*addr = ((struct sockaddr_in6 const *)sa)->sin6_addr;
+		break;
+	case AF_INET:
+		addr->s6_addr[10] = 0xff;
+		addr->s6_addr[11] = 0xff;
+		memcpy(&addr->s6_addr[12], &((struct sockaddr_in const *)sa)->sin_addr, 4);
+		break;
+	}
+}
+
+static char const *dt_ntop(struct in6_addr const *addr, char *buf, size_t len)
+{
+	if (IN6_IS_ADDR_V4MAPPED(addr))
+		return inet_ntop(AF_INET, &addr->s6_addr[12], buf, len);
+	return inet_ntop(AF_INET6, addr, buf, len);
+}
+
+void doubletree_init(struct doubletree *dt)
+{
+	memset(dt, 0, sizeof(*dt));
+	hopset_init(&dt->stopset, sizeof(struct hop_node));
+	hopset_init(&dt->global, sizeof(struct hop_dest));
+	hopset_init(&dt->links, sizeof(struct hop_link));
+}
+
+static int cmp_link(const void *a, const void *b)
+{
+	struct hop_link const *x = *(struct hop_link const *const *)a;
+	struct hop_link const *y = *(struct hop_link const *const *)b;
+
+	if (x->ttl != y->ttl)
+		return x->ttl < y->ttl ? -1 : 1;
+	return memcmp(x, y, sizeof(*x));
+}
+
+/* Print the aggregate hop graph as a list of links ordered by hop. */
+void doubletree_print(struct doubletree *dt)
+{
+	struct hop_link const **links;
+	void const *k;
+	size_t iter = 0;
+	size_t n = 0;
+	size_t i;
+	char from[INET6_ADDRSTRLEN];
+	char to[INET6_ADDRSTRLEN];
+
+	links = malloc((dt->links.count + 1) * sizeof(*links));
+	if (!links)
+		error(1, errno, "cannot allocate memory");
+	while ((k = hopset_next(&dt->links, &iter)) != NULL)
+		links[n++] = k;
+	qsort(links, n, sizeof(*links), cmp_link);
+
+	printf(_("Hop graph: %zu interfaces at distinct hops, %zu links\n"),
+	       dt->stopset.count, n);
+	for (i = 0; i < n; i++)
+		printf("%3u: %s -> %s\n", links[i]->ttl,
+		       dt_ntop(&links[i]->from, from, sizeof(from)),
+		       dt_ntop(&links[i]->to, to, sizeof(to)));
+	printf(_("%ld probes for %ld destinations\n"), dt->probes, dt->traces);
+	free(links);
+}
+
+void doubletree_free(struct doubletree *dt)
+{
+	hopset_free(&dt->stopset);
+	hopset_free(&dt->global);
+	hopset_free(&dt->links);
+}
+
+void dt_start(struct dt_trace *t, struct sockaddr const *dst,
+	      int midpoint, int max_ttl)
+{
+	memset(t, 0, sizeof(*t));
+	dt_addr(&t->dst, dst);
+	if (max_ttl > DT_MAX_TTL)
+		max_ttl = DT_MAX_TTL;
+	if (midpoint > max_ttl)
+		midpoint = max_ttl;
+	t->max_ttl = max_ttl;
+	t->midpoint = midpoint;
+	t->ttl = midpoint;
+	t->dir = 1;
+}
+
+static void dt_backward(struct dt_trace *t)
+{
+	t->dir = -1;
+	t->ttl = t->midpoint - 1;
+}
+
+/*
+ * Account the reply to the probe for hop 'ttl' and return the next hop
+ * to probe, 0 when the destination is done.
+ */
+int dt_reply(struct doubletree *dt, struct dt_trace *t,
+	     struct sockaddr const *from, int ttl, int final)
+{
+	struct hop_node node;
+	struct hop_dest pair;
+	int known, probed;
+
+	memset(&node, 0, sizeof(node));
+	dt_addr(&node.addr, from);
+	node.ttl = ttl;
+	known = !hopset_add(&dt->stopset, &node);
+	memset(&pair, 0, sizeof(pair));
+	pair.addr = node.addr;
+	pair.dst = t->dst;
+	probed = !hopset_add(&dt->global, &pair);
+
+	t->path[ttl] = node.addr;
+	t->seen[ttl] = 1;
+	t->tries = 0;
+	if (final == DT_HOP_REACHED && (!t->reached || ttl < t->reached))
+		t->reached = ttl;
+
+	if (t->dir > 0) {
+		t->gap = 0;
+		if (probed && final == DT_HOP_TRANSIT) {
+			/* The rest of the path to this destination is known. */
+			t->stopped = ttl;
+			dt_backward(t);
+		} else if (final != DT_HOP_TRANSIT || ttl >= t->max_ttl)
+			dt_backward(t);
+		else
+			t->ttl++;
+	} else if (known) {
+		/* The path merged into known topology. */
+		t->merged = ttl;
+		t->ttl = 0;
+	} else
+		t->ttl--;
+	return t->ttl;
+}
+
+/* The probe for the current hop got no answer; returns the next hop. */
+int dt_timeout(struct dt_trace *t)
+{
+	if (++t->tries < DT_TRIES)
+		return t->ttl;
+	t->tries = 0;
+	if (t->dir > 0) {
+		if (++t->gap >= DT_GAP_LIMIT || t->ttl >= t->max_ttl)
+			dt_backward(t);
+		else
+			t->ttl++;
+	} else
+		t->ttl--;
+	return t->ttl;
+}
+
+void dt_finish(struct doubletree *dt, struct dt_trace *t)
+{
+	struct hop_link link;
+	int ttl;
+
+	for (ttl = 1; ttl < t->max_ttl; ttl++) {
+		if (!t->seen[ttl] || !t->seen[ttl + 1] ||
+		    !memcmp(&t->path[ttl], &t->path[ttl + 1], sizeof(t->path[ttl])))
+			continue;
+		memset(&link, 0, sizeof(link));
+		link.from = t->path[ttl];
+		link.to = t->path[ttl + 1];
+		link.ttl = ttl;
+		hopset_add(&dt->links, &link);
+	}
+	dt->probes += t->probes;
+	dt->traces++;
+}
@@ -0,0 +1,105 @@
+#ifndef IPUTILS_DOUBLETREE_H
+#define IPUTILS_DOUBLETREE_H
+/*
+ * Multi-destination topology discovery shared by tracepath and traceroute6.
+ *
+ * Each destination is probed forward from a midpoint hop until it is
+ * reached, and then backward towards us.  Every (interface, hop) pair ever
+ * seen goes to the local stop set and backward probing ends as soon as it
+ * hits a known pair, i.e. when the path merges into topology already
+ * discovered for another destination.  Every (interface, destination) pair
+ * goes to the global stop set and forward probing ends on a known pair, as
+ * the rest of the path to that destination was probed already.  This is
+ * the Doubletree algorithm of Donnet et al., reduced to a single monitor,
+ * so the global stop set only spares destinations traced more than once.
+ */
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+enum {
+	DT_MAX_TTL = 255,
+	DT_MIDPOINT_DEFAULT = 5,
+	DT_WINDOW = 32,		/* destinations probed concurrently */
+	DT_TRIES = 2,		/* probes per hop before it is declared silent */
+	DT_GAP_LIMIT = 3,	/* silent hops ending forward probing */
+	DT_TIMEOUT_MS = 1000,
+};
+
+/* What the reply to a probe tells about the hop. */
+enum {
+	DT_HOP_TRANSIT,		/* hop limit exceeded in transit */
+	DT_HOP_REACHED,		/* destination answered */
+	DT_HOP_UNREACH,		/* destination unreachable */
+};
+
+/* Open addressing hash set of fixed size keys. */
+struct hopset {
+	size_t keylen;
+	size_t size;
+	size_t count;
+	unsigned char *keys;
+	unsigned char *used;
+};
+
+struct hop_node {
+	struct in6_addr addr;
+	uint32_t ttl;
+};
+
+struct hop_dest {
+	struct in6_addr addr;
+	struct in6_addr dst;
+};
+
+struct hop_link {
+	struct in6_addr from;
+	struct in6_addr to;
+	uint32_t ttl;
+};
+
+struct doubletree {
+	struct hopset stopset;	/* struct hop_node */
+	struct hopset global;	/* struct hop_dest */
+	struct hopset links;	/* struct hop_link */
+	long probes;
+	long traces;
+};
+
+struct dt_trace {
+	int ttl;		/* hop being probed, 0 when finished */
+	int dir;		/* 1 forward, -1 backward */
+	int midpoint;
+	int max_ttl;
+	int tries;
+	int gap;
+	int probes;
+	int reached;
+	int merged;		/* hop where backward probing stopped */
+	int stopped;		/* hop where forward probing stopped */
+	struct in6_addr dst;
+	struct in6_addr path[DT_MAX_TTL + 2];
+	unsigned char seen[DT_MAX_TTL + 2];
+};
+
+extern void hopset_init(struct hopset *set, size_t keylen);
+extern int hopset_add(struct hopset *set, void const *key);
+extern int hopset_contains(struct hopset const *set, void const *key);
+extern void const *hopset_next(struct hopset const *set, size_t *iter);
+extern void hopset_free(struct hopset *set);
+
+extern void dt_addr(struct in6_addr *addr, struct sockaddr const *sa);
+
+extern void doubletree_init(struct doubletree *dt);
+extern void doubletree_print(struct doubletree *dt);
+extern void doubletree_free(struct doubletree *dt);
+
+extern void dt_start(struct dt_trace *t, struct sockaddr const *dst,
+		     int midpoint, int max_ttl);
+extern int dt_reply(struct doubletree *dt, struct dt_trace *t,
+		    struct sockaddr const *from, int ttl, int final);
+extern int dt_timeout(struct dt_trace *t);
+extern void dt_finish(struct doubletree *dt, struct dt_trace *t);
+
+#endif /* IPUTILS_DOUBLETREE_H */
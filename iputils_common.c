@@ -1,12 +1,18 @@
 #include <errno.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio_ext.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "iputils_common.h"
+
 #if HAVE_GETRANDOM
 # include <sys/random.h>
 #endif
@@ -132,3 +138,79 @@ void timespecsub(struct timespec *a, struct timespec *b, struct timespec *res)
 		res->tv_nsec += 1000000000L;
 	}
 }
+
+/*
+ * Pass the messages waiting on the rtnetlink socket 'fd' to 'cb'.  With 'seq'
+ * set, wait for the end of that dump instead.  Returns -1 with errno set on
+ * socket errors, to ENOBUFS if notifications were lost.
+ */
+int iputils_nl_read(int fd, uint32_t seq, void (*cb)(struct nlmsghdr *nh))
+{
+	char buf[32768] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct nlmsghdr *nh;
+	ssize_t n;
+	int lost = 0;
+
+	for (;;) {
+		n = recv(fd, buf, sizeof(buf), seq ? 0 : MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN && !seq)
+				break;
+			if (errno == ENOBUFS) {
+				/* Notifications overflowed, a dump goes on. */
+				lost = 1;
+				if (seq)
+					continue;
+				break;
+			}
+			return -1;
+		}
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (size_t)n);
+		     nh = NLMSG_NEXT(nh, n)) {
+			if (!seq || nh->nlmsg_seq != seq) {
+				if (nh->nlmsg_type != NLMSG_ERROR &&
+				    nh->nlmsg_type != NLMSG_DONE)
+					cb(nh);
+				continue;
+			}
+			if (nh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(nh);
+
+				errno = -err->error;
+				return -1;
+			}
+			if (nh->nlmsg_type == NLMSG_DONE)
+				goto done;
+			cb(nh);
+		}
+	}
+ done:
+	if (lost) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	return 0;
+}
+
+/* Dump the 'type' objects of 'family' and pass them to 'cb'. */
+int iputils_nl_dump(int fd, int type, int family,
+		    void (*cb)(struct nlmsghdr *nh))
+{
+	static uint32_t seq;
+	struct {
+		struct nlmsghdr nh;
+		struct rtgenmsg g;
+	} req;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = sizeof(req);
+	req.nh.nlmsg_type = type;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nh.nlmsg_seq = ++seq;
+	req.g.rtgen_family = family;
+	if (send(fd, &req, sizeof(req), 0) < 0)
+		return -1;
+	return iputils_nl_read(fd, seq, cb);
+}
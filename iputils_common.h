@@ -1,6 +1,7 @@
 #ifndef IPUTILS_COMMON_H
 #define IPUTILS_COMMON_H
 
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/time.h>
 
@@ -70,4 +71,10 @@ extern void iputils_srand(void);
 extern void timespecsub(struct timespec *a, struct timespec *b,
 			struct timespec *res);
 
+struct nlmsghdr;
+extern int iputils_nl_read(int fd, uint32_t seq,
+			   void (*cb)(struct nlmsghdr *nh));
+extern int iputils_nl_dump(int fd, int type, int family,
+			   void (*cb)(struct nlmsghdr *nh));
+
 #endif /* IPUTILS_COMMON_H */
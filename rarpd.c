@@ -20,20 +20,23 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
-#include <poll.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <linux/if.h>
 #include <linux/if_arp.h>
 #include <linux/if_packet.h>
 #include <linux/filter.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <time.h>
 
 #include "iputils_common.h"
 
-int do_reload = 1;
-
 int debug;
 int verbose;
 int ifidx;
@@ -43,19 +46,53 @@ int all_ifaces;
 int listen_arp;
 char *ifname;
 char *tftp_dir = "/etc/tftpboot";
+char *ethers_file = "/etc/ethers";
 
-extern int ether_ntohost(char *name, unsigned char *ea);
+extern int ether_line(const char *line, unsigned char *ea, char *hostname);
 void usage(void) __attribute__((noreturn));
 
+enum {
+	RARP_HASH_MIN = 256,
+	RARP_MAX_ADDRS = 8,
+	RARP_BATCH = 64,	/* frames per recvmmsg() and sendmmsg() */
+	RARP_FRAME = 1024,
+	RARP_RCVBUF = 1 << 20,
+	RARP_IFL_MIN = 64,
+	RARP_CACHE_SIZE = 1024,
+	RARP_CACHE_HASH = 2 * RARP_CACHE_SIZE,
+	RARP_CACHE_TTL = 10000,	/* ms */
+	RARP_KEY_MAX = 8 + 2 * 16 + 4,
+	RARP_MAC_RATE = 2,	/* requests per second and client */
+	RARP_MAC_BURST = 4,
+	RARP_RATE = 5000,	/* requests per second */
+	RARP_BURST = 5000,
+};
+
+/*
+ * Interfaces indexed by ifindex.  The table is filled by a dump at startup
+ * and then kept current from rtnetlink notifications, it is only dumped
+ * again on SIGHUP or when notifications were lost.
+ */
 struct iflink
 {
-	struct iflink	*next;
 	int	       	index;
 	int		hatype;
 	unsigned char	lladdr[16];
 	char		name[IFNAMSIZ];
 	struct ifaddr 	*ifa_list;
-} *ifl_list;
+} **ifl_table;
+int ifl_size;
+int nlfd = -1;
+
+/*
+ * Sorted addresses of the boot images in tftp_dir.  The directory is watched
+ * with inotify and scanned again only when it changes, without a watch it is
+ * scanned for every request as it always was.
+ */
+uint32_t *boot_addrs;
+int boot_naddrs;
+int boot_fd = -1;
+int boot_wd = -1;
 
 struct ifaddr
 {
@@ -74,8 +111,84 @@ struct rarp_map
 	int		lladdr_len;
 	unsigned char	lladdr[16];
 	uint32_t		ipaddr;
+	int		naddr;
+	uint32_t	addrs[RARP_MAX_ADDRS];
+};
+
+/*
+ * Hash of the ethers database by (arp_type, lladdr), an entry with ifindex 0
+ * matches requests from every interface.  It is rebuilt from scratch on
+ * reload and only replaces the old one once complete.
+ */
+struct rarp_table
+{
+	unsigned int	size;		/* power of two */
+	unsigned int	count;
+	struct rarp_map	*hash[];
 } *rarp_db;
 
+/*
+ * A listening socket.  Requests are read and answered in place in batches,
+ * replies the socket could not take yet stay in the batch and the socket is
+ * polled for output instead of input until they are gone.
+ */
+struct rarp_sock
+{
+	int		fd;
+	int		count;		/* replies in the batch */
+	int		sent;
+	struct mmsghdr	msg[RARP_BATCH];
+	struct iovec	iov[RARP_BATCH];
+	struct sockaddr_ll sll[RARP_BATCH];
+	unsigned char	buf[RARP_BATCH][RARP_FRAME];
+} socks[2];
+int nsocks;
+int epfd;
+int sigfd = -1;
+
+/*
+ * Replies recently built, by interface and request up to the target
+ * address, so that retransmissions are answered without a lookup or
+ * another arp_advise().  Every entry also keeps the rate limit of its
+ * client.  Entries of an older generation are stale, the generation
+ * changes whenever the tables the replies were built from do.
+ */
+struct rarp_cached
+{
+	struct rarp_cached *hnext;	/* hash chain */
+	struct rarp_cached *prev;	/* LRU list, most recent first */
+	struct rarp_cached *next;
+	int		ifindex;
+	int		keylen;
+	unsigned char	key[RARP_KEY_MAX];
+	int		len;		/* of the reply, 0 when there is none */
+	unsigned char	reply[RARP_KEY_MAX + 4];
+	unsigned int	gen;
+	long long	expires;
+	long long	tokens;		/* thousandths of a request */
+	long long	tokens_at;
+};
+
+struct rarp_cache
+{
+	struct rarp_cached entries[RARP_CACHE_SIZE];
+	struct rarp_cached *hash[RARP_CACHE_HASH];
+	struct rarp_cached lru;
+	int		used;
+	unsigned int	gen;
+	long long	tokens;
+	long long	tokens_at;
+	long long	now;		/* ms, of the batch being served */
+} rcache;
+
+struct rarp_stats
+{
+	unsigned long	requests;
+	unsigned long	hits;
+	unsigned long	misses;
+	unsigned long	limited;
+} stats;
+
 void usage(void)
 {
 	fprintf(stderr,
@@ -94,197 +207,673 @@ void usage(void)
 	exit(1);
 }
 
-void load_db(void)
+static unsigned int rarp_hash(int hatype, int halen, unsigned char const *lladdr)
 {
+	uint32_t h = 2166136261U;
+	int i;
+
+	h = (h ^ hatype) * 16777619U;
+	for (i = 0; i < halen; i++)
+		h = (h ^ lladdr[i]) * 16777619U;
+	return h;
 }
 
-void load_if(void)
+static struct rarp_table *rarp_table_new(unsigned int size)
 {
-	int fd;
-	struct ifreq *ifrp, *ifend;
-	struct iflink *ifl;
-	struct ifaddr *ifa;
-	struct ifconf ifc;
-	struct ifreq ibuf[256];
+	struct rarp_table *t;
 
-	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-		syslog(LOG_ERR, "socket: %s", strerror(errno));
-		return;
-	}
+	t = calloc(1, sizeof(*t) + size * sizeof(t->hash[0]));
+	if (t)
+		t->size = size;
+	return t;
+}
 
-	ifc.ifc_len = sizeof ibuf;
-	ifc.ifc_buf = (char *)ibuf;
-	if (ioctl(fd, SIOCGIFCONF, (char *)&ifc) < 0 ||
-	    ifc.ifc_len < (int)sizeof(struct ifreq)) {
-		syslog(LOG_ERR, "SIOCGIFCONF: %s", strerror(errno));
-		close(fd);
-		return;
-	}
+static void rarp_table_free(struct rarp_table *t)
+{
+	struct rarp_map *r;
+	unsigned int i;
 
-	while ((ifl = ifl_list) != NULL) {
-		while ((ifa = ifl->ifa_list) != NULL) {
-			ifl->ifa_list = ifa->next;
-			free(ifa);
+	if (t == NULL)
+		return;
+	for (i = 0; i < t->size; i++) {
+		while ((r = t->hash[i]) != NULL) {
+			t->hash[i] = r->next;
+			free(r);
 		}
-		ifl_list = ifl->next;
-		free(ifl);
 	}
+	free(t);
+}
 
-	ifend = (struct ifreq *)((char *)ibuf + ifc.ifc_len);
-	for (ifrp = ibuf; ifrp < ifend; ifrp++) {
-		uint32_t addr;
-		uint32_t mask;
-		uint32_t prefix;
+static struct rarp_map *rarp_table_find(struct rarp_table *t, int ifindex, int hatype,
+					int halen, unsigned char const *lladdr)
+{
+	struct rarp_map *r;
 
-		if (ifrp->ifr_addr.sa_family != AF_INET)
-			continue;
-		addr = ((struct sockaddr_in*)&ifrp->ifr_addr)->sin_addr.s_addr;
-		if (addr == 0)
-			continue;
-		if (ioctl(fd, SIOCGIFINDEX, ifrp)) {
-			syslog(LOG_ERR, "ioctl(SIOCGIFNAME): %s", strerror(errno));
+	if (t == NULL)
+		return NULL;
+	for (r = t->hash[rarp_hash(hatype, halen, lladdr) & (t->size - 1)]; r; r = r->next) {
+		if (r->arp_type != hatype || r->lladdr_len != halen)
 			continue;
-		}
-		if (ifidx && ifrp->ifr_ifindex != ifidx)
+		if (r->ifindex != ifindex && r->ifindex != 0)
 			continue;
-		for (ifl = ifl_list; ifl; ifl = ifl->next)
-			if (ifl->index == ifrp->ifr_ifindex)
-				break;
-		if (ifl == NULL) {
-			char *p;
-			int index = ifrp->ifr_ifindex;
+		if (memcmp(r->lladdr, lladdr, halen) == 0)
+			return r;
+	}
+	return NULL;
+}
+
+/* Add r to *tp, doubling the table once it is full.  The first entry wins. */
+static void rarp_table_add(struct rarp_table **tp, struct rarp_map *r)
+{
+	struct rarp_table *t = *tp;
+	unsigned int h;
 
-			if (ioctl(fd, SIOCGIFHWADDR, ifrp)) {
-				syslog(LOG_ERR, "ioctl(SIOCGIFHWADDR): %s", strerror(errno));
-				continue;
+	if (rarp_table_find(t, r->ifindex, r->arp_type, r->lladdr_len, r->lladdr)) {
+		free(r);
+		return;
+	}
+	if (t->count == t->size) {
+		struct rarp_table *n = rarp_table_new(t->size * 2);
+		struct rarp_map *e;
+		unsigned int i;
+
+		if (n) {
+			for (i = 0; i < t->size; i++) {
+				while ((e = t->hash[i]) != NULL) {
+					t->hash[i] = e->next;
+					h = rarp_hash(e->arp_type, e->lladdr_len, e->lladdr) & (n->size - 1);
+					e->next = n->hash[h];
+					n->hash[h] = e;
+				}
 			}
+			n->count = t->count;
+			free(t);
+			*tp = t = n;
+		}
+	}
+	h = rarp_hash(r->arp_type, r->lladdr_len, r->lladdr) & (t->size - 1);
+	r->next = t->hash[h];
+	t->hash[h] = r;
+	t->count++;
+}
 
-			ifl = (struct iflink*)malloc(sizeof(*ifl));
-			if (ifl == NULL)
-				continue;
-			memset(ifl, 0, sizeof(*ifl));
-			ifl->next = ifl_list;
-			ifl_list = ifl;
-			ifl->index = index;
-			ifl->hatype = ifrp->ifr_hwaddr.sa_family;
-			memcpy(ifl->lladdr, ifrp->ifr_hwaddr.sa_data, 14);
-			strncpy(ifl->name, ifrp->ifr_name, IFNAMSIZ);
-			p = strchr(ifl->name, ':');
-			if (p)
-				*p = 0;
+/* Resolve the name of an ethers entry to its IPv4 addresses. */
+static int rarp_resolve(struct rarp_map *r, char const *name)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_INET,
+		.ai_socktype = SOCK_DGRAM
+	};
+	struct addrinfo *res, *ai;
+	struct in_addr in;
+
+	if (inet_aton(name, &in)) {
+		r->addrs[r->naddr++] = in.s_addr;
+		return 0;
+	}
+	if (getaddrinfo(name, NULL, &hints, &res))
+		return -1;
+	for (ai = res; ai && r->naddr < RARP_MAX_ADDRS; ai = ai->ai_next)
+		r->addrs[r->naddr++] = ((struct sockaddr_in *)ai->ai_addr)->sin_addr.s_addr;
+	freeaddrinfo(res);
+	return 0;
+}
+
+/*
+ * Read the ethers file and resolve every name in it now, so that requests
+ * are answered from memory without touching NSS.  The new table replaces the
+ * current one only when the file could be read.
+ */
+void load_db(void)
+{
+	struct rarp_table *t;
+	char *line = NULL;
+	char *name = NULL;
+	size_t len = 0;
+	FILE *f;
+
+	f = fopen(ethers_file, "r");
+	if (f == NULL) {
+		if (errno != ENOENT)
+			syslog(LOG_ERR, "%s: %s", ethers_file, strerror(errno));
+		return;
+	}
+	t = rarp_table_new(RARP_HASH_MIN);
+	if (t == NULL) {
+		syslog(LOG_ERR, "load_db: %s", strerror(errno));
+		fclose(f);
+		return;
+	}
+
+	while (getline(&line, &len, f) != -1) {
+		unsigned char ea[6];
+		struct rarp_map *r;
+		char *p;
+
+		p = realloc(name, len);
+		if (p == NULL)
+			break;
+		name = p;
+		if (ether_line(line, ea, name))
+			continue;
+		r = calloc(1, sizeof(*r));
+		if (r == NULL)
+			break;
+		r->arp_type = ARPHRD_ETHER;
+		r->lladdr_len = 6;
+		memcpy(r->lladdr, ea, 6);
+		if (rarp_resolve(r, name) || r->naddr == 0) {
 			if (verbose)
-				syslog(LOG_INFO, "link %s", ifl->name);
-		}
-		if (ioctl(fd, SIOCGIFNETMASK, ifrp)) {
-			syslog(LOG_ERR, "ioctl(SIOCGIFMASK): %s", strerror(errno));
+				syslog(LOG_INFO, "%s: no IP address", name);
+			free(r);
 			continue;
 		}
-		mask = ((struct sockaddr_in*)&ifrp->ifr_netmask)->sin_addr.s_addr;
-		if (ioctl(fd, SIOCGIFDSTADDR, ifrp)) {
-			syslog(LOG_ERR, "ioctl(SIOCGIFDSTADDR): %s", strerror(errno));
-			continue;
+		rarp_table_add(&t, r);
+	}
+	free(name);
+	free(line);
+	fclose(f);
+
+	rarp_table_free(rarp_db);
+	rarp_db = t;
+	if (verbose)
+		syslog(LOG_INFO, "%u entries in %s", t->count, ethers_file);
+}
+
+static long long monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Take one request from a bucket refilled with rate per second. */
+static int rate_take(long long *tokens, long long *at, int rate, int burst)
+{
+	*tokens += (rcache.now - *at) * rate;
+	*at = rcache.now;
+	if (*tokens > burst * 1000LL)
+		*tokens = burst * 1000LL;
+	if (*tokens < 1000)
+		return 0;
+	*tokens -= 1000;
+	return 1;
+}
+
+static void rcache_init(void)
+{
+	rcache.lru.next = rcache.lru.prev = &rcache.lru;
+}
+
+/* Forget every reply, the tables they were built from changed. */
+void rcache_flush(void)
+{
+	rcache.gen++;
+}
+
+static void rcache_unlink(struct rarp_cached *c)
+{
+	struct rarp_cached **p;
+
+	p = &rcache.hash[rarp_hash(c->ifindex, c->keylen, c->key) % RARP_CACHE_HASH];
+	while (*p != c)
+		p = &(*p)->hnext;
+	*p = c->hnext;
+	c->prev->next = c->next;
+	c->next->prev = c->prev;
+}
+
+static void rcache_push(struct rarp_cached *c)
+{
+	c->next = rcache.lru.next;
+	c->prev = &rcache.lru;
+	rcache.lru.next->prev = c;
+	rcache.lru.next = c;
+}
+
+/* Find the entry of a request, recycling the least recently used one. */
+static struct rarp_cached *rcache_get(int ifindex, unsigned char const *key, int keylen)
+{
+	unsigned int h = rarp_hash(ifindex, keylen, key) % RARP_CACHE_HASH;
+	struct rarp_cached *c;
+
+	for (c = rcache.hash[h]; c; c = c->hnext) {
+		if (c->ifindex == ifindex && c->keylen == keylen &&
+		    !memcmp(c->key, key, keylen)) {
+			c->prev->next = c->next;
+			c->next->prev = c->prev;
+			rcache_push(c);
+			return c;
 		}
-		prefix = ((struct sockaddr_in*)&ifrp->ifr_dstaddr)->sin_addr.s_addr;
-		for (ifa = ifl->ifa_list; ifa; ifa = ifa->next) {
-			if (ifa->local == addr &&
-			    ifa->prefix == prefix &&
-			    ifa->mask == mask)
-				break;
+	}
+	if (rcache.used < RARP_CACHE_SIZE) {
+		c = &rcache.entries[rcache.used++];
+	} else {
+		c = rcache.lru.prev;
+		rcache_unlink(c);
+	}
+	memset(c, 0, sizeof(*c));
+	c->ifindex = ifindex;
+	c->keylen = keylen;
+	memcpy(c->key, key, keylen);
+	c->gen = rcache.gen - 1;
+	c->tokens = RARP_MAC_BURST * 1000LL;
+	c->tokens_at = rcache.now;
+	c->hnext = rcache.hash[h];
+	rcache.hash[h] = c;
+	rcache_push(c);
+	return c;
+}
+
+static struct iflink *iflink_get(int ifindex)
+{
+	if (ifindex <= 0 || ifindex >= ifl_size)
+		return NULL;
+	return ifl_table[ifindex];
+}
+
+static struct iflink *iflink_add(int ifindex)
+{
+	struct iflink *ifl;
+
+	if (ifindex >= ifl_size) {
+		int size = ifl_size ? ifl_size : RARP_IFL_MIN;
+		struct iflink **t;
+
+		while (size <= ifindex)
+			size *= 2;
+		t = realloc(ifl_table, size * sizeof(*t));
+		if (t == NULL)
+			return NULL;
+		memset(t + ifl_size, 0, (size - ifl_size) * sizeof(*t));
+		ifl_table = t;
+		ifl_size = size;
+	}
+	if (ifl_table[ifindex])
+		return ifl_table[ifindex];
+	ifl = calloc(1, sizeof(*ifl));
+	if (ifl == NULL)
+		return NULL;
+	ifl->index = ifindex;
+	ifl_table[ifindex] = ifl;
+	return ifl;
+}
+
+static void iflink_del(int ifindex)
+{
+	struct iflink *ifl = iflink_get(ifindex);
+	struct ifaddr *ifa;
+
+	if (ifl == NULL)
+		return;
+	while ((ifa = ifl->ifa_list) != NULL) {
+		ifl->ifa_list = ifa->next;
+		free(ifa);
+	}
+	free(ifl);
+	ifl_table[ifindex] = NULL;
+}
+
+static void log_addr(const char *what, struct iflink *ifl, struct ifaddr *ifa)
+{
+	int i;
+	uint32_t m = ~0U;
+	char tmpa[64];
+
+	for (i=32; i>=0; i--) {
+		if (htonl(m) == ifa->mask)
+			break;
+		m <<= 1;
+	}
+	sprintf(tmpa, "%s", inet_ntoa(*(struct in_addr*)&ifa->local));
+	if (ifa->local == ifa->prefix)
+		syslog(LOG_INFO, "  %s %s/%d on %s\n", what, tmpa, i, ifl->name);
+	else
+		syslog(LOG_INFO, "  %s %s %s/%d on %s\n", what, tmpa,
+		       inet_ntoa(*(struct in_addr*)&ifa->prefix), i, ifl->name);
+}
+
+static void nl_link(struct nlmsghdr *nh)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	int len = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi));
+	struct iflink *ifl;
+	struct rtattr *ra;
+
+	if (len < 0 || (ifidx && ifi->ifi_index != ifidx))
+		return;
+	if (nh->nlmsg_type == RTM_DELLINK) {
+		ifl = iflink_get(ifi->ifi_index);
+		if (ifl && verbose)
+			syslog(LOG_INFO, "link %s gone", ifl->name);
+		iflink_del(ifi->ifi_index);
+		return;
+	}
+	ifl = iflink_get(ifi->ifi_index);
+	if (ifl == NULL) {
+		ifl = iflink_add(ifi->ifi_index);
+		if (ifl == NULL) {
+			syslog(LOG_ERR, "out of memory for link %d", ifi->ifi_index);
+			return;
 		}
-		if (ifa == NULL) {
-			if (mask == 0 || prefix == 0)
-				continue;
-			ifa = (struct ifaddr*)malloc(sizeof(*ifa));
-			memset(ifa, 0, sizeof(*ifa));
-			ifa->local = addr;
-			ifa->prefix = prefix;
-			ifa->mask = mask;
-			ifa->next = ifl->ifa_list;
-			ifl->ifa_list = ifa;
-
-			if (verbose) {
-				int i;
-				uint32_t m = ~0U;
-				for (i=32; i>=0; i--) {
-					if (htonl(m) == mask)
-						break;
-					m <<= 1;
-				}
-				if (addr == prefix) {
-					syslog(LOG_INFO, "  addr %s/%d on %s\n",
-					       inet_ntoa(*(struct in_addr*)&addr), i, ifl->name);
-				} else {
-					char tmpa[64];
-					sprintf(tmpa, "%s", inet_ntoa(*(struct in_addr*)&addr));
-					syslog(LOG_INFO, "  addr %s %s/%d on %s\n", tmpa,
-					       inet_ntoa(*(struct in_addr*)&prefix), i, ifl->name);
-				}
-			}
+	}
+	ifl->hatype = ifi->ifi_type;
+	for (ra = IFLA_RTA(ifi); RTA_OK(ra, len); ra = RTA_NEXT(ra, len)) {
+		if (ra->rta_type == IFLA_ADDRESS &&
+		    RTA_PAYLOAD(ra) <= sizeof(ifl->lladdr)) {
+			memset(ifl->lladdr, 0, sizeof(ifl->lladdr));
+			memcpy(ifl->lladdr, RTA_DATA(ra), RTA_PAYLOAD(ra));
+		} else if (ra->rta_type == IFLA_IFNAME) {
+			if (verbose && strncmp(ifl->name, RTA_DATA(ra), IFNAMSIZ))
+				syslog(LOG_INFO, "link %s", (char *)RTA_DATA(ra));
+			strncpy(ifl->name, RTA_DATA(ra), IFNAMSIZ - 1);
 		}
 	}
 }
 
-void configure(void)
+static void nl_addr(struct nlmsghdr *nh)
 {
-	load_if();
-	load_db();
+	struct ifaddrmsg *ifm = NLMSG_DATA(nh);
+	int len = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*ifm));
+	struct iflink *ifl;
+	struct ifaddr *ifa, **ifap;
+	struct rtattr *ra;
+	uint32_t addr = 0;
+	uint32_t prefix = 0;
+	uint32_t mask;
+
+	if (len < 0 || ifm->ifa_family != AF_INET)
+		return;
+	ifl = iflink_get(ifm->ifa_index);
+	if (ifl == NULL)
+		return;
+	for (ra = IFA_RTA(ifm); RTA_OK(ra, len); ra = RTA_NEXT(ra, len)) {
+		if (RTA_PAYLOAD(ra) < 4)
+			continue;
+		if (ra->rta_type == IFA_LOCAL)
+			memcpy(&addr, RTA_DATA(ra), 4);
+		else if (ra->rta_type == IFA_ADDRESS)
+			memcpy(&prefix, RTA_DATA(ra), 4);
+	}
+	if (addr == 0)
+		addr = prefix;
+	mask = ifm->ifa_prefixlen ? htonl(~0U << (32 - ifm->ifa_prefixlen)) : 0;
+	if (addr == 0 || mask == 0 || prefix == 0)
+		return;
+
+	for (ifap = &ifl->ifa_list; (ifa = *ifap) != NULL; ifap = &ifa->next) {
+		if (ifa->local == addr &&
+		    ifa->prefix == prefix &&
+		    ifa->mask == mask)
+			break;
+	}
+	if (nh->nlmsg_type == RTM_DELADDR) {
+		if (ifa == NULL)
+			return;
+		if (verbose)
+			log_addr("deleted", ifl, ifa);
+		*ifap = ifa->next;
+		free(ifa);
+		return;
+	}
+	if (ifa)
+		return;
+	ifa = (struct ifaddr*)malloc(sizeof(*ifa));
+	if (ifa == NULL)
+		return;
+	memset(ifa, 0, sizeof(*ifa));
+	ifa->local = addr;
+	ifa->prefix = prefix;
+	ifa->mask = mask;
+	ifa->next = ifl->ifa_list;
+	ifl->ifa_list = ifa;
+	if (verbose)
+		log_addr("addr", ifl, ifa);
 }
 
-int bootable(uint32_t addr)
+static void nl_msg(struct nlmsghdr *nh)
+{
+	switch (nh->nlmsg_type) {
+	case RTM_NEWLINK:
+	case RTM_DELLINK:
+		nl_link(nh);
+		break;
+	case RTM_NEWADDR:
+	case RTM_DELADDR:
+		nl_addr(nh);
+		break;
+	}
+}
+
+/* Apply the interface changes waiting.  Returns -1 if messages were lost. */
+static int nl_read(void)
+{
+	if (iputils_nl_read(nlfd, 0, nl_msg) < 0) {
+		if (errno != ENOBUFS)
+			syslog(LOG_ERR, "netlink: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int nl_dump(int type)
+{
+	if (iputils_nl_dump(nlfd, type, AF_UNSPEC, nl_msg) < 0) {
+		if (errno != ENOBUFS)
+			syslog(LOG_ERR, "netlink: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Rebuild the interface table from a full dump. */
+void load_if(void)
+{
+	int tries;
+	int i;
+
+	for (tries = 0; tries < 3; tries++) {
+		for (i = 0; i < ifl_size; i++)
+			iflink_del(i);
+		if (nl_dump(RTM_GETLINK) == 0 && nl_dump(RTM_GETADDR) == 0)
+			return;
+	}
+	syslog(LOG_ERR, "failed to dump interfaces, the table may be incomplete");
+}
+
+/* Follow interface changes, resynchronizing when notifications were lost. */
+void update_if(void)
+{
+	if (nl_read() < 0)
+		load_if();
+	rcache_flush();
+}
+
+/* Subscribe to interface changes. */
+int open_netlink(void)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &nlfd };
+	struct sockaddr_nl snl;
+	int rcvbuf = RARP_RCVBUF;
+
+	nlfd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (nlfd < 0)
+		return -1;
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	snl.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+	if (bind(nlfd, (struct sockaddr *)&snl, sizeof(snl)) < 0 ||
+	    epoll_ctl(epfd, EPOLL_CTL_ADD, nlfd, &ev) < 0) {
+		int saved = errno;
+
+		close(nlfd);
+		errno = saved;
+		return nlfd = -1;
+	}
+	setsockopt(nlfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	return nlfd;
+}
+
+static int cmp_addr(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Image names start with the client address in upper case hex. */
+static int boot_name(const char *name, uint32_t *addr)
+{
+	uint32_t a = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		if (name[i] >= '0' && name[i] <= '9')
+			a = (a << 4) | (name[i] - '0');
+		else if (name[i] >= 'A' && name[i] <= 'F')
+			a = (a << 4) | (name[i] - 'A' + 10);
+		else
+			return -1;
+	}
+	*addr = htonl(a);
+	return 0;
+}
+
+void load_boot(void)
 {
 	struct dirent *dent;
+	uint32_t *addrs = NULL;
+	int n = 0, size = 0;
 	DIR *d;
-	char name[9];
 
-	sprintf(name, "%08X", (uint32_t)ntohl(addr));
 	d = opendir(tftp_dir);
 	if (d == NULL) {
 		syslog(LOG_ERR, "opendir: %s", strerror(errno));
-		return 0;
+		boot_naddrs = 0;
+		return;
 	}
 	while ((dent = readdir(d)) != NULL) {
-		if (strncmp(dent->d_name, name, 8) == 0)
-			break;
+		uint32_t addr;
+
+		if (boot_name(dent->d_name, &addr))
+			continue;
+		if (n == size) {
+			uint32_t *p;
+
+			size = size ? 2 * size : RARP_HASH_MIN;
+			p = realloc(addrs, size * sizeof(*p));
+			if (p == NULL)
+				break;
+			addrs = p;
+		}
+		addrs[n++] = addr;
 	}
 	closedir(d);
-	return dent != NULL;
+
+	qsort(addrs, n, sizeof(*addrs), cmp_addr);
+	free(boot_addrs);
+	boot_addrs = addrs;
+	boot_naddrs = n;
+}
+
+/* Start watching tftp_dir, if it is not watched yet. */
+void watch_boot(void)
+{
+	if (boot_fd < 0) {
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &boot_fd };
+
+		boot_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (boot_fd < 0) {
+			syslog(LOG_ERR, "inotify_init1: %s", strerror(errno));
+			return;
+		}
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, boot_fd, &ev)) {
+			syslog(LOG_ERR, "epoll_ctl: %s", strerror(errno));
+			close(boot_fd);
+			boot_fd = -1;
+			return;
+		}
+	}
+	if (boot_wd < 0) {
+		boot_wd = inotify_add_watch(boot_fd, tftp_dir,
+					    IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+					    IN_MOVED_TO | IN_DELETE_SELF |
+					    IN_MOVE_SELF | IN_ONLYDIR);
+		if (boot_wd < 0)
+			syslog(LOG_ERR, "inotify_add_watch %s: %s", tftp_dir,
+			       strerror(errno));
+	}
+}
+
+/* Rescan tftp_dir once for a whole batch of changes. */
+void update_boot(void)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+
+	while ((n = read(boot_fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			/* The directory itself went away, or was moved. */
+			if (ev->mask & (IN_IGNORED | IN_MOVE_SELF)) {
+				if (boot_wd >= 0 && !(ev->mask & IN_IGNORED))
+					inotify_rm_watch(boot_fd, boot_wd);
+				boot_wd = -1;
+			}
+		}
+	}
+	if (n < 0 && errno != EAGAIN && errno != EINTR)
+		syslog(LOG_ERR, "inotify: %s", strerror(errno));
+	watch_boot();
+	load_boot();
+	rcache_flush();
+	if (verbose)
+		syslog(LOG_INFO, "%d boot images in %s", boot_naddrs, tftp_dir);
+}
+
+int bootable(uint32_t addr)
+{
+	if (boot_wd < 0)
+		load_boot();
+	return bsearch(&addr, boot_addrs, boot_naddrs, sizeof(addr), cmp_addr) != NULL;
+}
+
+void configure(void)
+{
+	load_if();
+	load_db();
+	if (!only_ethers) {
+		watch_boot();
+		load_boot();
+	}
+	rcache_flush();
 }
 
-struct ifaddr *select_ipaddr(int ifindex, uint32_t *sel_addr, uint32_t **alist)
+struct ifaddr *select_ipaddr(int ifindex, uint32_t *sel_addr, uint32_t const *alist, int n)
 {
 	struct iflink *ifl;
 	struct ifaddr *ifa;
-	int retry = 0;
 	int i;
 
-retry:
-	for (ifl=ifl_list; ifl; ifl=ifl->next)
-		if (ifl->index == ifindex)
-			break;
-	if (ifl == NULL && !retry) {
-		retry++;
-		load_if();
-		goto retry;
-	}
+	ifl = iflink_get(ifindex);
 	if (ifl == NULL)
 		return NULL;
 
-	for (i=0; alist[i]; i++) {
-		uint32_t addr = *(alist[i]);
+	for (i=0; i<n; i++) {
+		uint32_t addr = alist[i];
 		for (ifa=ifl->ifa_list; ifa; ifa=ifa->next) {
 			if (!((ifa->prefix^addr)&ifa->mask)) {
 				*sel_addr = addr;
 				return ifa;
 			}
 		}
-		if (ifa == NULL && retry==0) {
-			retry++;
-			load_if();
-			goto retry;
-		}
 	}
-	if (i==1 && allow_offlink) {
-		*sel_addr = *(alist[0]);
+	if (n==1 && allow_offlink) {
+		*sel_addr = alist[0];
 		return ifl->ifa_list;
 	}
 	syslog(LOG_ERR, "Off-link request on %s", ifl->name);
@@ -294,50 +883,23 @@ retry:
 struct rarp_map *rarp_lookup(int ifindex, int hatype,
 			     int halen, unsigned char *lladdr)
 {
+	static struct rarp_map emap;
 	struct rarp_map *r;
 
-	for (r=rarp_db; r; r=r->next) {
-		if (r->arp_type != hatype && r->arp_type != -1)
-			continue;
-		if (r->lladdr_len != halen)
-			continue;
-		if (r->ifindex != ifindex && r->ifindex != 0)
-			continue;
-		if (memcmp(r->lladdr, lladdr, halen) == 0)
-			break;
-	}
-
+	r = rarp_table_find(rarp_db, ifindex, hatype, halen, lladdr);
 	if (r == NULL) {
-		if (hatype == ARPHRD_ETHER && halen == 6) {
-			struct ifaddr *ifa;
-			struct hostent *hp;
-			char ename[256];
-			static struct rarp_map emap = {
-				.arp_type = ARPHRD_ETHER,
-				.lladdr_len = 6
-			};
-
-			if (ether_ntohost(ename, lladdr) != 0 ||
-			    (hp = gethostbyname(ename)) == NULL) {
-				if (verbose)
-					syslog(LOG_INFO, "not found in /etc/ethers");
-				return NULL;
-			}
-			if (hp->h_addrtype != AF_INET) {
-				syslog(LOG_ERR, "no IP address");
-				return NULL;
-			}
-			ifa = select_ipaddr(ifindex, &emap.ipaddr, (uint32_t **)hp->h_addr_list);
-			if (ifa) {
-				memcpy(emap.lladdr, lladdr, 6);
-				if (only_ethers || bootable(emap.ipaddr))
-					return &emap;
-				if (verbose)
-					syslog(LOG_INFO, "not bootable");
-			}
-		}
+		if (verbose)
+			syslog(LOG_INFO, "not found in %s", ethers_file);
+		return NULL;
 	}
-	return r;
+	emap = *r;
+	if (select_ipaddr(ifindex, &emap.ipaddr, r->addrs, r->naddr) == NULL)
+		return NULL;
+	if (only_ethers || bootable(emap.ipaddr))
+		return &emap;
+	if (verbose)
+		syslog(LOG_INFO, "not bootable");
+	return NULL;
 }
 
 static int load_arp_bpflet(int fd)
@@ -360,9 +922,7 @@ int put_mylladdr(unsigned char **ptr_p, int ifindex, int alen)
 {
 	struct iflink *ifl;
 
-	for (ifl=ifl_list; ifl; ifl = ifl->next)
-		if (ifl->index == ifindex)
-			break;
+	ifl = iflink_get(ifindex);
 
 	if (ifl==NULL)
 		return -1;
@@ -378,9 +938,7 @@ int put_myipaddr(unsigned char **ptr_p, int ifindex, uint32_t hisipaddr)
 	struct iflink *ifl;
 	struct ifaddr *ifa;
 
-	for (ifl=ifl_list; ifl; ifl = ifl->next)
-		if (ifl->index == ifindex)
-			break;
+	ifl = iflink_get(ifindex);
 
 	if (ifl==NULL)
 		return -1;
@@ -403,9 +961,7 @@ void arp_advise(int ifindex, unsigned char *lladdr, int lllen, uint32_t ipaddr)
 	struct sockaddr_in *sin;
 	struct iflink *ifl;
 
-	for (ifl=ifl_list; ifl; ifl = ifl->next)
-		if (ifl->index == ifindex)
-			break;
+	ifl = iflink_get(ifindex);
 
 	if (ifl == NULL)
 		return;
@@ -425,54 +981,85 @@ void arp_advise(int ifindex, unsigned char *lladdr, int lllen, uint32_t ipaddr)
 	close(fd);
 }
 
-void serve_it(int fd)
+/* Look the target of a request up and turn it into the reply. */
+static int make_reply(unsigned char *buf, struct sockaddr_ll *sll)
 {
-	unsigned char buf[1024];
-	struct sockaddr_ll sll = { 0 };
-	socklen_t sll_len = sizeof(sll);
 	struct arphdr *a = (struct arphdr*)buf;
 	struct rarp_map *rmap;
 	unsigned char *ptr;
-	ssize_t n;
 
-	n = recvfrom(fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr*)&sll, &sll_len);
-	if (n<0) {
-		if (errno != EINTR && errno != EAGAIN)
-			syslog(LOG_ERR, "recvfrom: %s", strerror(errno));
-		return;
-	}
+	/* Lookup requested target in our database */
+	rmap = rarp_lookup(sll->sll_ifindex, sll->sll_hatype,
+			   sll->sll_halen, (unsigned char*)(a+1) + sll->sll_halen + 4);
+	if (rmap == NULL)
+		return 0;
+
+	/* Prepare reply. It is almost ready, we only
+	   replace ARP packet type, put our lladdr and
+	   IP address to source fields,
+	   and fill target IP address.
+	 */
+	a->ar_op = htons(ARPOP_RREPLY);
+	ptr = (unsigned char*)(a+1);
+	if (put_mylladdr(&ptr, sll->sll_ifindex, rmap->lladdr_len))
+		return 0;
+	if (put_myipaddr(&ptr, sll->sll_ifindex, rmap->ipaddr))
+		return 0;
+	/* It is already filled */
+	ptr += rmap->lladdr_len;
+	memcpy(ptr, &rmap->ipaddr, 4);
+	ptr += 4;
+
+	/* Update our ARP cache. Probably, this guy
+	   will not able to make ARP (if it is broken)
+	 */
+	arp_advise(sll->sll_ifindex, rmap->lladdr, rmap->lladdr_len, rmap->ipaddr);
+
+	return ptr - buf;
+}
+
+/*
+ * Turn the request of n bytes in buf, received as described by sll, into
+ * its reply in place.  Returns the length of the reply, 0 if there is none.
+ */
+static int build_reply(unsigned char *buf, ssize_t n, struct sockaddr_ll *sll)
+{
+	struct arphdr *a = (struct arphdr*)buf;
+	struct rarp_cached *c;
+	int keylen;
 
 	/* Do not accept packets for other hosts and our own ones */
-	if (sll.sll_pkttype != PACKET_BROADCAST &&
-	    sll.sll_pkttype != PACKET_MULTICAST &&
-	    sll.sll_pkttype != PACKET_HOST)
-		return;
+	if (sll->sll_pkttype != PACKET_BROADCAST &&
+	    sll->sll_pkttype != PACKET_MULTICAST &&
+	    sll->sll_pkttype != PACKET_HOST)
+		return 0;
 
-	if (ifidx && sll.sll_ifindex != ifidx)
-		return;
+	if (ifidx && sll->sll_ifindex != ifidx)
+		return 0;
 
 	if ((size_t)n<sizeof(*a)) {
 		syslog(LOG_ERR, "truncated arp packet; len=%zu", n);
-		return;
+		return 0;
 	}
 
 	/* Accept only RARP requests */
 	if (a->ar_op != htons(ARPOP_RREQUEST))
-		return;
+		return 0;
+	stats.requests++;
 
 	if (verbose) {
 		int i;
 		char tmpbuf[16*3];
 		char *p = tmpbuf;
-		for (i=0; i<sll.sll_halen; i++) {
+		for (i=0; i<sll->sll_halen; i++) {
 			if (i) {
-				sprintf(p, ":%02x", sll.sll_addr[i]);
+				sprintf(p, ":%02x", sll->sll_addr[i]);
 				p++;
 			} else
-				sprintf(p, "%02x", sll.sll_addr[i]);
+				sprintf(p, "%02x", sll->sll_addr[i]);
 			p += 2;
 		}
-		syslog(LOG_INFO, "RARP request from %s on if%d", tmpbuf, sll.sll_ifindex);
+		syslog(LOG_INFO, "RARP request from %s on if%d", tmpbuf, sll->sll_ifindex);
 	}
 
 	/* Sanity checks */
@@ -480,16 +1067,16 @@ void serve_it(int fd)
 	/* 1. IP only -> pln==4 */
 	if (a->ar_pln != 4) {
 		syslog(LOG_ERR, "interesting rarp_req plen=%d", a->ar_pln);
-		return;
+		return 0;
 	}
 	/* 2. ARP protocol must be IP */
 	if (a->ar_pro != htons(ETH_P_IP)) {
 		syslog(LOG_ERR, "rarp protocol is not IP %04x", ntohs(a->ar_pro));
-		return;
+		return 0;
 	}
 	/* 3. ARP types must match */
-	if (htons(sll.sll_hatype) != a->ar_hrd) {
-		switch (sll.sll_hatype) {
+	if (htons(sll->sll_hatype) != a->ar_hrd) {
+		switch (sll->sll_hatype) {
 		case ARPHRD_FDDI:
 			if (a->ar_hrd == htons(ARPHRD_ETHER) ||
 			    a->ar_hrd == htons(ARPHRD_IEEE802))
@@ -497,84 +1084,172 @@ void serve_it(int fd)
 			/* fallthrough */
 		default:
 			syslog(LOG_ERR, "rarp htype mismatch");
-			return;
+			return 0;
 		}
 	}
 	/* 3. LL address lengths must be equal */
-	if (a->ar_hln != sll.sll_halen) {
+	if (a->ar_hln != sll->sll_halen) {
 		syslog(LOG_ERR, "rarp hlen mismatch");
-		return;
+		return 0;
 	}
 	/* 4. Check packet length */
 	if (sizeof(*a) + 2*4 + 2*a->ar_hln > (size_t) n) {
 		syslog(LOG_ERR, "truncated rarp request; len=%zu", n);
-		return;
+		return 0;
 	}
 	/* 5. Silly check: if this guy set different source
 	      addresses in MAC header and in ARP, he is insane
 	 */
-	if (memcmp(sll.sll_addr, a+1, sll.sll_halen)) {
+	if (memcmp(sll->sll_addr, a+1, sll->sll_halen)) {
 		syslog(LOG_ERR, "this guy set different his lladdrs in arp and header");
-		return;
+		return 0;
 	}
 	/* End of sanity checks */
 
-	/* Lookup requested target in our database */
-	rmap = rarp_lookup(sll.sll_ifindex, sll.sll_hatype,
-			   sll.sll_halen, (unsigned char*)(a+1) + sll.sll_halen + 4);
-	if (rmap == NULL)
-		return;
+	/* Retransmissions are answered from the cache, within limits. */
+	keylen = sizeof(*a) + 2*a->ar_hln + 4;
+	if (keylen > RARP_KEY_MAX)
+		return make_reply(buf, sll);
+	c = rcache_get(sll->sll_ifindex, buf, keylen);
+	if (!rate_take(&c->tokens, &c->tokens_at, RARP_MAC_RATE, RARP_MAC_BURST) ||
+	    !rate_take(&rcache.tokens, &rcache.tokens_at, RARP_RATE, RARP_BURST)) {
+		stats.limited++;
+		if (verbose)
+			syslog(LOG_INFO, "rate limited");
+		return 0;
+	}
+	if (c->gen == rcache.gen && c->expires > rcache.now) {
+		stats.hits++;
+		memcpy(buf, c->reply, c->len);
+		return c->len;
+	}
+	stats.misses++;
+	c->len = make_reply(buf, sll);
+	memcpy(c->reply, buf, c->len);
+	c->gen = rcache.gen;
+	c->expires = rcache.now + RARP_CACHE_TTL;
+	return c->len;
+}
 
-	/* Prepare reply. It is almost ready, we only
-	   replace ARP packet type, put our lladdr and
-	   IP address to source fields,
-	   and fill target IP address.
-	 */
-	a->ar_op = htons(ARPOP_RREPLY);
-	ptr = (unsigned char*)(a+1);
-	if (put_mylladdr(&ptr, sll.sll_ifindex, rmap->lladdr_len))
-		return;
-	if (put_myipaddr(&ptr, sll.sll_ifindex, rmap->ipaddr))
-		return;
-	/* It is already filled */
-	ptr += rmap->lladdr_len;
-	memcpy(ptr, &rmap->ipaddr, 4);
-	ptr += 4;
+static void sock_events(struct rarp_sock *rs, uint32_t events)
+{
+	struct epoll_event ev = { .events = events, .data.ptr = rs };
 
-	/* Update our ARP cache. Probably, this guy
-	   will not able to make ARP (if it is broken)
-	 */
-	arp_advise(sll.sll_ifindex, rmap->lladdr, rmap->lladdr_len, rmap->ipaddr);
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, rs->fd, &ev))
+		syslog(LOG_ERR, "epoll_ctl: %s", strerror(errno));
+}
 
-	/* Sendto is blocking, but with 5sec timeout */
-	alarm(5);
-	sendto(fd, buf, ptr - buf, 0, (struct sockaddr*)&sll, sizeof(sll));
-	alarm(0);
+/*
+ * Send the replies left in the batch of rs.  Returns 0 when they are all
+ * gone, a socket error only drops the reply it happened on.
+ */
+static int flush_replies(struct rarp_sock *rs)
+{
+	while (rs->sent < rs->count) {
+		int n = sendmmsg(rs->fd, rs->msg + rs->sent, rs->count - rs->sent,
+				 MSG_DONTWAIT);
+
+		if (n < 0) {
+			if (errno == EAGAIN || errno == ENOBUFS) {
+				sock_events(rs, EPOLLOUT);
+				return -1;
+			}
+			if (errno != EINTR) {
+				syslog(LOG_ERR, "sendmmsg: %s", strerror(errno));
+				rs->sent++;
+			}
+			continue;
+		}
+		rs->sent += n;
+	}
+	rs->count = rs->sent = 0;
+	return 0;
 }
 
-void catch_signal(int sig, void (*handler)(int))
+/* Read a batch of requests from rs and answer them. */
+void serve_it(struct rarp_sock *rs)
 {
-	struct sigaction sa;
+	int i, n;
+
+	for (i = 0; i < RARP_BATCH; i++) {
+		rs->iov[i].iov_base = rs->buf[i];
+		rs->iov[i].iov_len = RARP_FRAME;
+		rs->msg[i].msg_hdr = (struct msghdr) {
+			.msg_name = &rs->sll[i],
+			.msg_namelen = sizeof(rs->sll[i]),
+			.msg_iov = &rs->iov[i],
+			.msg_iovlen = 1
+		};
+	}
+	n = recvmmsg(rs->fd, rs->msg, RARP_BATCH, MSG_DONTWAIT, NULL);
+	if (n < 0) {
+		if (errno != EINTR && errno != EAGAIN)
+			syslog(LOG_ERR, "recvmmsg: %s", strerror(errno));
+		return;
+	}
+	rcache.now = monotonic_ms();
+
+	/* Replies are built in place and packed to the front of the batch. */
+	for (i = 0; i < n; i++) {
+		int len = build_reply(rs->buf[i], rs->msg[i].msg_len, &rs->sll[i]);
 
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_handler = handler;
-	sigaction(sig, &sa, NULL);
+		if (len == 0)
+			continue;
+		rs->iov[rs->count].iov_base = rs->buf[i];
+		rs->iov[rs->count].iov_len = len;
+		rs->msg[rs->count].msg_hdr.msg_name = &rs->sll[i];
+		rs->msg[rs->count].msg_hdr.msg_namelen = sizeof(rs->sll[i]);
+		rs->count++;
+	}
+	flush_replies(rs);
 }
 
-void sig_alarm(int signo __attribute__((__unused__)))
+/* Block the signals handled by the main loop and watch them from epoll. */
+int open_signals(void)
 {
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &sigfd };
+	sigset_t sset;
+
+	sigemptyset(&sset);
+	sigaddset(&sset, SIGHUP);
+	sigaddset(&sset, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &sset, NULL);
+	sigfd = signalfd(-1, &sset, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sigfd < 0)
+		return -1;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev) < 0) {
+		int saved = errno;
+
+		close(sigfd);
+		errno = saved;
+		return sigfd = -1;
+	}
+	return sigfd;
 }
 
-void sig_hup(int signo __attribute__((__unused__)))
+/* SIGHUP reloads the configuration, SIGUSR1 logs the statistics. */
+void handle_signals(void)
 {
-	do_reload = 1;
+	struct signalfd_siginfo si;
+
+	while (read(sigfd, &si, sizeof(si)) == sizeof(si)) {
+		switch (si.ssi_signo) {
+		case SIGHUP:
+			configure();
+			break;
+		case SIGUSR1:
+			syslog(LOG_INFO, "%lu requests, %lu cache hits, %lu misses, %lu rate limited",
+			       stats.requests, stats.hits, stats.misses, stats.limited);
+			break;
+		}
+	}
 }
 
 int main(int argc, char **argv)
 {
-	struct pollfd pset[2];
-	int psize;
+	int fd;
 	int opt;
+	int i;
 
 	atexit(close_stdout);
 	opterr = 0;
@@ -620,57 +1295,46 @@ int main(int argc, char **argv)
 		ifname = argv[optind];
 	}
 
-	psize = 1;
-	pset[0].fd = socket(PF_PACKET, SOCK_DGRAM, 0);
+	fd = socket(PF_PACKET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
 
 	if (ifname) {
 		struct ifreq ifr;
 		memset(&ifr, 0, sizeof(ifr));
 		strncpy(ifr.ifr_name, ifname, IFNAMSIZ);
-		if (ioctl(pset[0].fd, SIOCGIFINDEX, &ifr)) {
+		if (ioctl(fd, SIOCGIFINDEX, &ifr)) {
 			error(0, errno, "ioctl(SIOCGIFINDEX)");
 			usage();
 		}
 		ifidx = ifr.ifr_ifindex;
 	}
 
-	pset[1].fd = -1;
-	if (listen_arp) {
-		pset[1].fd = socket(PF_PACKET, SOCK_DGRAM, 0);
-		if (pset[1].fd >= 0) {
-			load_arp_bpflet(pset[1].fd);
-			psize = 1;
-		}
-	}
-
-	if (pset[1].fd >= 0) {
-		struct sockaddr_ll sll;
-		memset(&sll, 0, sizeof(sll));
-		sll.sll_family = AF_PACKET;
-		sll.sll_protocol = htons(ETH_P_ARP);
-		sll.sll_ifindex = all_ifaces ? 0 : ifidx;
-		if (bind(pset[1].fd, (struct sockaddr*)&sll, sizeof(sll)) < 0) {
-			close(pset[1].fd);
-			pset[1].fd = -1;
-			psize = 1;
-		}
-	}
-	if (pset[0].fd >= 0) {
+	if (fd >= 0) {
 		struct sockaddr_ll sll;
 		memset(&sll, 0, sizeof(sll));
 		sll.sll_family = AF_PACKET;
 		sll.sll_protocol = htons(ETH_P_RARP);
 		sll.sll_ifindex = all_ifaces ? 0 : ifidx;
-		if (bind(pset[0].fd, (struct sockaddr*)&sll, sizeof(sll)) < 0) {
-			close(pset[0].fd);
-			pset[0].fd = -1;
-		}
+		if (bind(fd, (struct sockaddr*)&sll, sizeof(sll)) < 0)
+			close(fd);
+		else
+			socks[nsocks++].fd = fd;
 	}
-	if (pset[0].fd < 0) {
-		pset[0] = pset[1];
-		psize--;
+	if (listen_arp) {
+		fd = socket(PF_PACKET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+		if (fd >= 0) {
+			struct sockaddr_ll sll;
+			memset(&sll, 0, sizeof(sll));
+			sll.sll_family = AF_PACKET;
+			sll.sll_protocol = htons(ETH_P_ARP);
+			sll.sll_ifindex = all_ifaces ? 0 : ifidx;
+			load_arp_bpflet(fd);
+			if (bind(fd, (struct sockaddr*)&sll, sizeof(sll)) < 0)
+				close(fd);
+			else
+				socks[nsocks++].fd = fd;
+		}
 	}
-	if (psize == 0)
+	if (nsocks == 0)
 		error(1, errno, "failed to bind any socket");
 
 	if (!debug) {
@@ -679,34 +1343,60 @@ int main(int argc, char **argv)
 	}
 
 	openlog("rarpd", LOG_PID | LOG_CONS, LOG_DAEMON);
-	catch_signal(SIGALRM, sig_alarm);
-	catch_signal(SIGHUP, sig_hup);
-
-	for (;;) {
-		int i;
+	rcache_init();
 
-		if (do_reload) {
-			configure();
-			do_reload = 0;
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		syslog(LOG_ERR, "epoll_create1: %s", strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < nsocks; i++) {
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &socks[i] };
+		int rcvbuf = RARP_RCVBUF;
+
+		/* Room for a storm of requests from clients booting together. */
+		setsockopt(socks[i].fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, socks[i].fd, &ev)) {
+			syslog(LOG_ERR, "epoll_ctl: %s", strerror(errno));
+			exit(1);
 		}
+	}
+	if (open_netlink() < 0) {
+		syslog(LOG_ERR, "netlink: %s", strerror(errno));
+		exit(1);
+	}
+	if (open_signals() < 0) {
+		syslog(LOG_ERR, "signalfd: %s", strerror(errno));
+		exit(1);
+	}
+	configure();
 
-#define EVENTS (POLLIN|POLLPRI|POLLERR|POLLHUP)
-		pset[0].events = EVENTS;
-		pset[0].revents = 0;
-		pset[1].events = EVENTS;
-		pset[1].revents = 0;
+	for (;;) {
+		struct epoll_event events[4];
+		int n;
 
-		i = poll(pset, psize, -1);
-		if (i <= 0) {
-			if (errno != EINTR && i<0) {
-				syslog(LOG_ERR, "poll returned some crap: %s\n", strerror(errno));
+		n = epoll_wait(epfd, events, 4, -1);
+		if (n < 0) {
+			if (errno != EINTR) {
+				syslog(LOG_ERR, "epoll_wait: %s", strerror(errno));
 				sleep(10);
 			}
 			continue;
 		}
-		for (i=0; i<psize; i++) {
-			if (pset[i].revents&EVENTS)
-				serve_it(pset[i].fd);
+		for (i = 0; i < n; i++) {
+			struct rarp_sock *rs = events[i].data.ptr;
+
+			if (events[i].data.ptr == &nlfd)
+				update_if();
+			else if (events[i].data.ptr == &sigfd)
+				handle_signals();
+			else if (events[i].data.ptr == &boot_fd)
+				update_boot();
+			else if (rs->count) {
+				if (flush_replies(rs) == 0)
+					sock_events(rs, EPOLLIN);
+			} else
+				serve_it(rs);
 		}
 	}
 }
@@ -33,6 +33,10 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
 /* Do not use "improved" glibc version! */
 #include <linux/limits.h>
 
@@ -42,9 +46,9 @@
 #include <sys/file.h>
 #include <malloc.h>
 
-#include <sys/ioctl.h>
 #include <linux/if.h>
-#include <linux/route.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 #include <netinet/in.h>
 #include <netinet/ip.h>
@@ -76,6 +80,9 @@ struct interface
 	struct in_addr	netmask;
 	int		ifindex;
 	char		name[IFNAMSIZ];
+	int		stale;		/* Not seen in the current dump */
+	int		advertisements;	/* Sent since the address appeared */
+	long long	next_advertise;
 };
 
 /*
@@ -86,32 +93,37 @@ struct interface
 
 #define ALLIGN(ptr)	(ptr)
 
-static int join(int sock, struct sockaddr_in *sin);
 static void solicitor(struct sockaddr_in *sin);
 #ifdef RDISC_SERVER
 static void advertise(struct sockaddr_in *sin, int lft);
+static void advertise_if(struct interface *ifp, struct sockaddr_in *sin, int lft);
 #endif
 static char *pr_name(struct in_addr addr);
 static void pr_pack(char *buf, int cc, struct sockaddr_in *from);
-static void age_table(int time);
+static void age_table(void);
 static void record_router(struct in_addr router, int preference, int ttl);
-static void add_route(struct in_addr addr);
-static void del_route(struct in_addr addr);
-static void rtioctl(struct in_addr addr, int op);
+static void add_route(struct in_addr addr, uint32_t metric);
+static void del_route(struct in_addr addr, uint32_t metric);
+static void flush_routes(void);
+static uint32_t route_metric(int pref);
 static int support_multicast(void);
-static int sendbcast(int s, char *packet, int packetlen);
-static int sendmcast(int s, char *packet, int packetlen, struct sockaddr_in *sin);
-static int sendbcastif(int s, char *packet, int packetlen, struct interface *ifp);
-static int sendmcastif(int s, char *packet, int packetlen, struct sockaddr_in *sin, struct interface *ifp);
+static void queue_packet(void *packet, int packetlen, struct in_addr dst,
+			 struct interface *ifp);
+static void flush_packets(void);
+static int join_links(void);
+static void update_ifs(void);
 static int is_directly_connected(struct in_addr in);
+static int usable(struct interface *ifp);
 static void initlog(void);
 static void discard_table(void);
-static void init(void);
+static int init(void);
 
 #define ALL_HOSTS_ADDRESS		"224.0.0.1"
 #define ALL_ROUTERS_ADDRESS		"224.0.0.2"
 
-#define MAXIFS 32
+#define SEND_BATCH	64	/* packets per sendmmsg() */
+#define ADVERTISE_SLACK	250	/* ms an advertisement may be sent early */
+#define OUT_PACKET	16	/* advertisement of a single address */
 
 #if defined(__GLIBC__) && __GLIBC__ < 2
 /* For router advertisement */
@@ -153,6 +165,8 @@ static int num_interfaces;
 
 static struct interface *interfaces;
 static int interfaces_size;			/* Number of elements in interfaces */
+static int nlfd = -1;				/* rtnetlink, interface changes */
+static struct sockaddr_in joinaddr;		/* Group to receive on */
 
 
 #define	MAXPACKET	4096	/* max packet size */
@@ -161,6 +175,7 @@ static int interfaces_size;			/* Number of elements in interfaces */
 int debugfile;
 
 int socketfd;		/* Socket file descriptor */
+int timerfd;		/* Deadline of the periodic work */
 struct sockaddr_in whereto;/* Address to send to */
 
 /* Common variables */
@@ -196,7 +211,9 @@ int best_preference = 1;  	/* Set to record only the router(s) with the
 static void graceful_finish(void);
 static void finish(void);
 static void timer(void);
-static void initifs(void);
+static void schedule(void);
+static long long next_expiry(void);
+static int initifs(void);
 static unsigned short in_cksum(unsigned short *addr, int len);
 
 static int logging = 0;
@@ -216,6 +233,14 @@ static void logmsg(int const prio, char const *const fmt, ...)
 
 static void logperror(char *str);
 
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
 static __inline__ int isbroadcast(struct sockaddr_in *sin)
 {
 	return (sin->sin_addr.s_addr == INADDR_BROADCAST);
@@ -261,14 +286,65 @@ void do_fork(void)
 	initlog();
 }
 
-void signal_setup(int signo, void (*handler)(void))
+/* Block the signals handled by the main loop and return their descriptor. */
+static int signal_setup(void)
+{
+	sigset_t sset;
+	int fd;
+
+	sigemptyset(&sset);
+	sigaddset(&sset, SIGHUP);
+	sigaddset(&sset, SIGTERM);
+	sigaddset(&sset, SIGINT);
+	sigprocmask(SIG_BLOCK, &sset, NULL);
+	fd = signalfd(-1, &sset, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0) {
+		logperror("signalfd");
+		exit(5);
+	}
+	return fd;
+}
+
+static void handle_signals(int fd)
 {
-	struct sigaction sa;
+	struct signalfd_siginfo si;
 
-	memset(&sa, 0, sizeof(sa));
+	while (read(fd, &si, sizeof(si)) == sizeof(si)) {
+		switch (si.ssi_signo) {
+		case SIGHUP:
+			initifs();
+			break;
+		case SIGTERM:
+			graceful_finish();
+			break;
+		case SIGINT:
+			finish();
+			break;
+		}
+	}
+}
+
+static void receive_packets(void)
+{
+	struct sockaddr_in from = { 0 };
+
+	for (;;) {
+		unsigned char	packet[MAXPACKET];
+		int len = sizeof (packet);
+		socklen_t fromlen = sizeof (from);
+		int cc;
 
-	sa.sa_handler = (void (*)(int))handler;
-	sigaction(signo, &sa, NULL);
+		cc=recvfrom(socketfd, (char *)packet, len, MSG_DONTWAIT,
+			    (struct sockaddr *)&from, &fromlen);
+		if (cc<0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				logperror("recvfrom");
+			return;
+		}
+		pr_pack( (char *)packet, cc, &from );
+	}
 }
 
 /*
@@ -278,11 +354,10 @@ char    *sendaddress, *recvaddress;
 
 int main(int argc, char **argv)
 {
-	struct sockaddr_in from = { 0 };
 	char **av = argv;
 	struct sockaddr_in *to = &whereto;
-	struct sockaddr_in joinaddr;
-	sigset_t sset, sset_empty;
+	struct epoll_event ev = { .events = EPOLLIN };
+	int epfd, sigfd, on = 1;
 #ifdef RDISC_SERVER
 	int val;
 
@@ -434,99 +509,185 @@ next:
 		logperror("socket");
 		exit(5);
 	}
+	/* Broadcasts and multicasts leave from the interface in IP_PKTINFO. */
+	setsockopt(socketfd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
 
 	setlinebuf( stdout );
 
-	signal_setup(SIGINT, finish );
-	signal_setup(SIGTERM, graceful_finish );
-	signal_setup(SIGHUP, initifs );
-	signal_setup(SIGALRM, timer );
-
-	sigemptyset(&sset);
-	sigemptyset(&sset_empty);
-	sigaddset(&sset, SIGALRM);
-	sigaddset(&sset, SIGHUP);
-	sigaddset(&sset, SIGTERM);
-	sigaddset(&sset, SIGINT);
-
-	init();
-	if (join(socketfd, &joinaddr) < 0) {
+	sigfd = signal_setup();
+	timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (timerfd < 0 || epfd < 0) {
+		logperror("timerfd/epoll");
+		exit(5);
+	}
+	ev.data.fd = socketfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, socketfd, &ev);
+	ev.data.fd = timerfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &ev);
+	ev.data.fd = sigfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
+
+	if (init() < 0) {
 		logmsg(LOG_ERR, "Failed joining addresses\n");
 		exit (2);
 	}
+	ev.data.fd = nlfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, nlfd, &ev);
 
 	timer();	/* start things going */
 
 	for (;;) {
-		unsigned char	packet[MAXPACKET];
-		int len = sizeof (packet);
-		socklen_t fromlen = sizeof (from);
-		int cc;
+		struct epoll_event events[4];
+		int i, n;
 
-		cc=recvfrom(socketfd, (char *)packet, len, 0,
-			    (struct sockaddr *)&from, &fromlen);
-		if (cc<0) {
-			if (errno == EINTR)
-				continue;
-			logperror("recvfrom");
+		n = epoll_wait(epfd, events, 4, -1);
+		if (n < 0) {
+			if (errno != EINTR)
+				logperror("epoll_wait");
 			continue;
 		}
-
-		sigprocmask(SIG_SETMASK, &sset, NULL);
-		pr_pack( (char *)packet, cc, &from );
-		sigprocmask(SIG_SETMASK, &sset_empty, NULL);
+		for (i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+
+			if (fd == socketfd) {
+				/* Advertisements move deadlines. */
+				receive_packets();
+				schedule();
+			} else if (fd == nlfd) {
+				/* New addresses are advertised early. */
+				update_ifs();
+				schedule();
+			} else if (fd == sigfd) {
+				/* SIGHUP rescans the interfaces. */
+				handle_signals(sigfd);
+				schedule();
+			} else if (fd == timerfd)
+				timer();
+		}
 	}
 	/*NOTREACHED*/
 }
 
-#define TIMER_INTERVAL 	3
-#define GETIFCONF_TIMER	30
+/*
+ * Deadlines of the periodic work, in ms of CLOCK_MONOTONIC.  A single
+ * timerfd is armed for the earliest of them and of the router expiries.
+ * Every interface has its own advertisement timer, next_advertise is the
+ * earliest of them.
+ */
+static long long next_advertise;
+static long long next_solicit;
 
-static int left_until_advertise;
+#ifdef RDISC_SERVER
+static long long advertise_interval(void)
+{
+	return min_adv_int * 1000LL +
+		(max_adv_int - min_adv_int) * (long long)(rand() % 1000);
+}
 
-/* Called every TIMER_INTERVAL */
-void timer()
+/*
+ * Advertise on the interfaces whose timer is due, or nearly so, to share
+ * the wakeup and the sendmmsg().  The intervals are drawn independently so
+ * that the interfaces do not stay in step.
+ */
+static void advertise_due(long long now)
 {
-	static int time;
-	static int left_until_getifconf;
-	static int left_until_solicit;
+	int i, sent = 0;
+
+	next_advertise = now + max_adv_int * 1000LL;
+	for (i = 0; i < num_interfaces; i++) {
+		struct interface *ifp = &interfaces[i];
 
+		if (ifp->next_advertise <= now + ADVERTISE_SLACK) {
+			long long interval = advertise_interval();
 
-	time += TIMER_INTERVAL;
+			if (usable(ifp)) {
+				advertise_if(ifp, &whereto, lifetime);
+				sent++;
+			}
+			if (++ifp->advertisements < initial_advertisements &&
+			    interval > initial_advert_interval * 1000LL)
+				interval = initial_advert_interval * 1000LL;
+			ifp->next_advertise = now + interval;
+		}
+		if (ifp->next_advertise < next_advertise)
+			next_advertise = ifp->next_advertise;
+	}
+	flush_packets();
+	if (sent) {
+		ntransmitted++;
+		if (verbose)
+			logmsg(LOG_INFO, "Sent advertisement to %s on %d interfaces\n",
+			       pr_name(whereto.sin_addr), sent);
+	}
+}
 
-	left_until_getifconf -= TIMER_INTERVAL;
-	left_until_advertise -= TIMER_INTERVAL;
-	left_until_solicit -= TIMER_INTERVAL;
+/* Restart the timers after an advertisement was sent to all interfaces. */
+static void restart_advertise(void)
+{
+	long long now = now_ms();
+	int i;
 
-	if (left_until_getifconf < 0) {
-		initifs();
-		left_until_getifconf = GETIFCONF_TIMER;
+	next_advertise = now + max_adv_int * 1000LL;
+	for (i = 0; i < num_interfaces; i++) {
+		interfaces[i].next_advertise = now + advertise_interval();
+		if (interfaces[i].next_advertise < next_advertise)
+			next_advertise = interfaces[i].next_advertise;
 	}
+}
+#endif
+
+/* Do the periodic work that is due. */
+void timer()
+{
+	long long now = now_ms();
+	uint64_t expirations;
+
+	if (read(timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		logperror("timerfd");
+
 #ifdef RDISC_SERVER
-	if (responder && left_until_advertise <= 0) {
-		ntransmitted++;
-		advertise(&whereto, lifetime);
-		if (ntransmitted < initial_advertisements)
-			left_until_advertise = initial_advert_interval;
-		else
-			left_until_advertise = min_adv_int +
-				((max_adv_int - min_adv_int) *
-				 (rand() % 1000)/1000);
+	if (responder) {
+		if (now >= next_advertise)
+			advertise_due(now);
 	} else
 #endif
-	if (solicit && left_until_solicit <= 0) {
+	if (solicit && now >= next_solicit) {
 		ntransmitted++;
 		solicitor(&whereto);
 		if (ntransmitted < max_solicitations)
-			left_until_solicit = solicitation_interval;
+			next_solicit = now + solicitation_interval * 1000LL;
 		else {
 			solicit = 0;
 			if (!forever && nreceived == 0)
 				exit(5);
 		}
 	}
-	age_table(TIMER_INTERVAL);
-	alarm(TIMER_INTERVAL);
+	age_table();
+	schedule();
+}
+
+/* Arm the timer for the earliest deadline, disarm it when nothing is due. */
+void schedule(void)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	long long next = 0;
+	long long expiry = next_expiry();
+
+#ifdef RDISC_SERVER
+	if (responder)
+		next = next_advertise;
+#endif
+	if (solicit && (!next || next_solicit < next))
+		next = next_solicit;
+	if (expiry && (!next || expiry < next))
+		next = expiry;
+	if (next) {
+		its.it_value.tv_sec = next / 1000;
+		its.it_value.tv_nsec = (next % 1000) * 1000000;
+	}
+	if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		logperror("timerfd_settime");
 }
 
 /*
@@ -555,14 +716,25 @@ solicitor(struct sockaddr_in *sin)
 	/* Compute ICMP checksum here */
 	icp->checksum = in_cksum( (unsigned short *)icp, packetlen );
 
-	if (isbroadcast(sin))
-		i = sendbcast(socketfd, (char *)outpack, packetlen);
-	else if (ismulticast(sin))
-		i = sendmcast(socketfd, (char *)outpack, packetlen, sin);
-	else
-		i = sendto(socketfd, (char *)outpack, packetlen, 0,
-			   (struct sockaddr *)sin, sizeof(struct sockaddr));
+	if (isbroadcast(sin) || ismulticast(sin)) {
+		int mask = IFF_BROADCAST|IFF_POINTOPOINT;
+
+		if (ismulticast(sin))
+			mask |= IFF_MULTICAST;
+		for (i = 0; i < num_interfaces; i++) {
+			struct interface *ifp = &interfaces[i];
 
+			if (!usable(ifp) || (ifp->flags & mask) == 0)
+				continue;
+			queue_packet(outpack, packetlen, isbroadcast(sin) ?
+				     ifp->bcastaddr : sin->sin_addr, ifp);
+		}
+		flush_packets();
+		return;
+	}
+
+	i = sendto(socketfd, (char *)outpack, packetlen, 0,
+		   (struct sockaddr *)sin, sizeof(struct sockaddr));
 	if( i < 0 || i != packetlen )  {
 		if( i<0 ) {
 		    logperror("solicitor:sendto");
@@ -576,81 +748,70 @@ solicitor(struct sockaddr_in *sin)
 /*
  * 			A V E R T I S E
  *
- * Compose and transmit an ICMP ROUTER ADVERTISEMENT packet.
+ * Compose and queue an ICMP ROUTER ADVERTISEMENT packet for one interface.
  * The IP packet will be added on by the kernel.
  */
 void
-advertise(struct sockaddr_in *sin, int lft)
+advertise_if(struct interface *ifp, struct sockaddr_in *sin, int lft)
 {
 	static unsigned char outpack[MAXPACKET];
 	struct icmp_ra *rap = (struct icmp_ra *) ALLIGN(outpack);
 	struct icmp_ra_addr *ap;
-	int packetlen, i, cc;
+	struct in_addr dst = sin->sin_addr;
+	int packetlen;
+
+	if (isbroadcast(sin)) {
+		dst = ifp->bcastaddr;
+	} else if (!ismulticast(sin)) {
+		/*
+		 * Verify that the interface matches the destination
+		 * address.
+		 */
+		if ((sin->sin_addr.s_addr & ifp->netmask.s_addr) !=
+		    (ifp->address.s_addr & ifp->netmask.s_addr))
+			return;
+	}
+
+	rap->icmp_type = ICMP_ROUTERADVERT;
+	rap->icmp_code = 0;
+	rap->icmp_cksum = 0;
+	rap->icmp_num_addrs = 0;
+	rap->icmp_wpa = 2;
+	rap->icmp_lifetime = htons(lft);
+	packetlen = 8;
+
+	/*
+	 * TODO handle multiple logical interfaces per
+	 * physical interface. (increment with rap->icmp_wpa * 4 for
+	 * each address.)
+	 */
+	ap = (struct icmp_ra_addr *)ALLIGN(outpack + ICMP_MINLEN);
+	ap->ira_addr = ifp->localaddr.s_addr;
+	ap->ira_preference = htonl(ifp->preference);
+	packetlen += rap->icmp_wpa * 4;
+	rap->icmp_num_addrs++;
+
+	/* Compute ICMP checksum here */
+	rap->icmp_cksum = in_cksum( (unsigned short *)rap, packetlen );
+
+	queue_packet(outpack, packetlen, dst, ifp);
+}
+
+/* Advertise on every interface, sending the packets in batches. */
+void
+advertise(struct sockaddr_in *sin, int lft)
+{
+	int i;
 
 	if (verbose) {
 		logmsg(LOG_INFO, "Sending advertisement to %s\n",
 			 pr_name(sin->sin_addr));
 	}
 
-	for (i = 0; i < num_interfaces; i++) {
-		rap->icmp_type = ICMP_ROUTERADVERT;
-		rap->icmp_code = 0;
-		rap->icmp_cksum = 0;
-		rap->icmp_num_addrs = 0;
-		rap->icmp_wpa = 2;
-		rap->icmp_lifetime = htons(lft);
-		packetlen = 8;
-
-		/*
-		 * TODO handle multiple logical interfaces per
-		 * physical interface. (increment with rap->icmp_wpa * 4 for
-		 * each address.)
-		 */
-		ap = (struct icmp_ra_addr *)ALLIGN(outpack + ICMP_MINLEN);
-		ap->ira_addr = interfaces[i].localaddr.s_addr;
-		ap->ira_preference = htonl(interfaces[i].preference);
-		packetlen += rap->icmp_wpa * 4;
-		rap->icmp_num_addrs++;
-
-		/* Compute ICMP checksum here */
-		rap->icmp_cksum = in_cksum( (unsigned short *)rap, packetlen );
-
-		if (isbroadcast(sin))
-			cc = sendbcastif(socketfd, (char *)outpack, packetlen,
-					&interfaces[i]);
-		else if (ismulticast(sin))
-			cc = sendmcastif(socketfd, (char *)outpack, packetlen, sin,
-					&interfaces[i]);
-		else {
-			struct interface *ifp = &interfaces[i];
-			/*
-			 * Verify that the interface matches the destination
-			 * address.
-			 */
-			if ((sin->sin_addr.s_addr & ifp->netmask.s_addr) ==
-			    (ifp->address.s_addr & ifp->netmask.s_addr)) {
-				if (debug) {
-					logmsg(LOG_DEBUG, "Unicast to %s ",
-						 pr_name(sin->sin_addr));
-					logmsg(LOG_DEBUG, "on interface %s, %s\n",
-						 ifp->name,
-						 pr_name(ifp->address));
-				}
-				cc = sendto(socketfd, (char *)outpack, packetlen, 0,
-					    (struct sockaddr *)sin,
-					    sizeof(struct sockaddr));
-			} else
-				cc = packetlen;
-		}
-		if( cc < 0 || cc != packetlen )  {
-			if (cc < 0) {
-				logperror("sendto");
-			} else {
-				logmsg(LOG_ERR, "wrote %s %d chars, ret=%d\n",
-				       sendaddress, packetlen, cc );
-			}
-		}
-	}
+	for (i = 0; i < num_interfaces; i++)
+		if (usable(&interfaces[i]))
+			advertise_if(&interfaces[i], sin, lft);
+	flush_packets();
 }
 #endif
 
@@ -811,15 +972,11 @@ pr_pack(char *buf, int cc, struct sockaddr_in *from)
 					      ntohl(ap->ira_preference),
 					      ntohs(rap->icmp_lifetime));
 		}
+		flush_routes();
 		nreceived++;
 		if (!forever) {
 			do_fork();
 			forever = 1;
-/*
- * The next line was added so that the alarm is set for the new procces
- * Fraser Gardiner Sun Microsystems Australia
- */
-			(void) alarm(TIMER_INTERVAL);
 		}
 		break;
 	}
@@ -878,10 +1035,8 @@ pr_pack(char *buf, int cc, struct sockaddr_in *from)
 				sin.sin_addr.s_addr = htonl(0xe0000001);
 			else
 				sin.sin_addr.s_addr = INADDR_BROADCAST;
-			/* Restart the timer when we broadcast */
-			left_until_advertise = min_adv_int +
-				((max_adv_int - min_adv_int)
-				 * (rand() % 1000)/1000);
+			/* Restart the timers when we broadcast */
+			restart_advertise();
 		} else {
 			sin.sin_addr.s_addr = ip->saddr;
 			if (!is_directly_connected(sin.sin_addr)) {
@@ -989,265 +1144,394 @@ graceful_finish()
 }
 
 
-/* From libc/rpc/pmap_rmt.c */
+/*
+ * OUTPUT
+ *
+ * Packets for several interfaces are queued and sent with one sendmmsg().
+ * Each one carries the interface to leave from in IP_PKTINFO, so neither
+ * IP_MULTICAST_IF nor SO_BROADCAST has to be changed between them.
+ */
+static struct {
+	struct mmsghdr	msg[SEND_BATCH];
+	struct iovec	iov[SEND_BATCH];
+	struct sockaddr_in to[SEND_BATCH];
+	union {
+		char		buf[CMSG_SPACE(sizeof(struct in_pktinfo))];
+		size_t		align;
+	} cmsg[SEND_BATCH];
+	unsigned char	packet[SEND_BATCH][OUT_PACKET];
+	struct interface *ifp[SEND_BATCH];
+	int		n;
+} out;
 
-int
-sendbcast(int socket, char *packet, int packetlen)
+void
+flush_packets(void)
 {
-	int i, cc;
+	int sent = 0;
 
-	for (i = 0; i < num_interfaces; i++) {
-		if ((interfaces[i].flags & (IFF_BROADCAST|IFF_POINTOPOINT)) == 0)
+	while (sent < out.n) {
+		int cc = sendmmsg(socketfd, out.msg + sent, out.n - sent, 0);
+
+		if (cc < 0) {
+			if (errno == EINTR)
+				continue;
+			logperror("sendmmsg");
+			logmsg(LOG_ERR, "Cannot send packet to %s over interface %s\n",
+			       pr_name(out.to[sent].sin_addr), out.ifp[sent]->name);
+			sent++;
 			continue;
-		cc = sendbcastif(socket, packet, packetlen, &interfaces[i]);
-		if (cc!= packetlen) {
-			return (cc);
 		}
+		sent += cc;
 	}
-	return (packetlen);
+	out.n = 0;
 }
 
-int
-sendbcastif(int socket, char *packet, int packetlen, struct interface *ifp)
+void
+queue_packet(void *packet, int packetlen, struct in_addr dst,
+	     struct interface *ifp)
 {
-	int on;
-	int cc;
-	struct sockaddr_in baddr;
+	struct in_pktinfo *pi;
+	struct cmsghdr *cm;
+	struct msghdr *mh;
+	int i;
 
-	baddr.sin_family = AF_INET;
-	baddr.sin_addr = ifp->bcastaddr;
-	if (debug)
-		logmsg(LOG_DEBUG, "Broadcast to %s\n",
-			 pr_name(baddr.sin_addr));
-	on = 1;
-	setsockopt(socket, SOL_SOCKET, SO_BROADCAST, (char*)&on, sizeof(on));
-	cc = sendto(socket, packet, packetlen, 0,
-		    (struct sockaddr *)&baddr, sizeof (struct sockaddr));
-	if (cc!= packetlen) {
-		logperror("sendbcast: sendto");
-		logmsg(LOG_ERR, "Cannot send broadcast packet to %s\n",
-		       pr_name(baddr.sin_addr));
-	}
-	on = 0;
-	setsockopt(socket, SOL_SOCKET, SO_BROADCAST, (char*)&on, sizeof(on));
-	return (cc);
+	if (out.n == SEND_BATCH)
+		flush_packets();
+	i = out.n++;
+	if (debug) {
+		logmsg(LOG_DEBUG, "Send to %s ", pr_name(dst));
+		logmsg(LOG_DEBUG, "over interface %s, %s\n",
+			 ifp->name, pr_name(ifp->localaddr));
+	}
+
+	memcpy(out.packet[i], packet, packetlen);
+	out.iov[i].iov_base = out.packet[i];
+	out.iov[i].iov_len = packetlen;
+	memset(&out.to[i], 0, sizeof(out.to[i]));
+	out.to[i].sin_family = AF_INET;
+	out.to[i].sin_addr = dst;
+	out.ifp[i] = ifp;
+
+	mh = &out.msg[i].msg_hdr;
+	memset(mh, 0, sizeof(*mh));
+	mh->msg_name = &out.to[i];
+	mh->msg_namelen = sizeof(out.to[i]);
+	mh->msg_iov = &out.iov[i];
+	mh->msg_iovlen = 1;
+	mh->msg_control = out.cmsg[i].buf;
+	mh->msg_controllen = sizeof(out.cmsg[i].buf);
+	cm = CMSG_FIRSTHDR(mh);
+	cm->cmsg_level = IPPROTO_IP;
+	cm->cmsg_type = IP_PKTINFO;
+	cm->cmsg_len = CMSG_LEN(sizeof(*pi));
+	pi = (struct in_pktinfo *)CMSG_DATA(cm);
+	memset(pi, 0, sizeof(*pi));
+	pi->ipi_ifindex = ifp->ifindex;
+	pi->ipi_spec_dst = ifp->localaddr;
 }
 
-int
-sendmcast(int socket, char *packet, int packetlen, struct sockaddr_in *sin)
-{
-	int i, cc;
+/*
+ * INTERFACES
+ *
+ * One entry per IPv4 address, kept up to date from rtnetlink notifications
+ * and resynchronized with a full dump on SIGHUP or when notifications were
+ * lost.  Flags and names of the links are indexed by ifindex.
+ */
+struct link {
+	int		flags;
+	int		joined;		/* 1 member of joinaddr, -1 failed */
+	char		name[IFNAMSIZ];
+};
 
-	for (i = 0; i < num_interfaces; i++) {
-		if ((interfaces[i].flags & (IFF_BROADCAST|IFF_POINTOPOINT|IFF_MULTICAST)) == 0)
-			continue;
-		cc = sendmcastif(socket, packet, packetlen, sin, &interfaces[i]);
-		if (cc!= packetlen) {
-			return (cc);
+static struct link *links;
+static int links_size;
+
+static struct link *get_link(int ifindex, int create)
+{
+	if (ifindex <= 0)
+		return (NULL);
+	if (ifindex >= links_size) {
+		int size = links_size ? links_size : 64;
+		struct link *l;
+
+		if (!create)
+			return (NULL);
+		while (size <= ifindex)
+			size *= 2;
+		l = realloc(links, size * sizeof(*l));
+		if (l == NULL) {
+			logmsg(LOG_ERR, "Out of memory\n");
+			return (NULL);
 		}
+		memset(l + links_size, 0, (size - links_size) * sizeof(*l));
+		links = l;
+		links_size = size;
 	}
-	return (packetlen);
+	return (&links[ifindex]);
 }
 
-int
-sendmcastif(int socket, char *packet, int packetlen, struct sockaddr_in *sin,
-	    struct interface *ifp)
+static int usable(struct interface *ifp)
 {
-	int cc;
-	struct ip_mreqn mreq;
+	if ((ifp->flags & IFF_UP) == 0)
+		return (0);
+	if (ifp->flags & IFF_LOOPBACK)
+		return (0);
+	return (ifp->flags & (IFF_MULTICAST|IFF_BROADCAST|IFF_POINTOPOINT)) != 0;
+}
 
-	memset(&mreq, 0, sizeof(mreq));
-	mreq.imr_ifindex = ifp->ifindex;
-	mreq.imr_address = ifp->localaddr;
-	if (debug)
-		logmsg(LOG_DEBUG, "Multicast to interface %s, %s\n",
-			 ifp->name,
-			 pr_name(mreq.imr_address));
-	if (setsockopt(socket, IPPROTO_IP, IP_MULTICAST_IF,
-		       (char *)&mreq,
-		       sizeof(mreq)) < 0) {
-		logperror("setsockopt (IP_MULTICAST_IF)");
-		logmsg(LOG_ERR, "Cannot send multicast packet over interface %s, %s\n",
-		       ifp->name,
-		       pr_name(mreq.imr_address));
-		return (-1);
-	}
-	cc = sendto(socket, packet, packetlen, 0,
-		    (struct sockaddr *)sin, sizeof (struct sockaddr));
-	if (cc!= packetlen) {
-		logperror("sendmcast: sendto");
-		logmsg(LOG_ERR, "Cannot send multicast packet over interface %s, %s\n",
-		       ifp->name, pr_name(mreq.imr_address));
-	}
-	return (cc);
+static void set_flags(struct interface *ifp, int flags)
+{
+	ifp->flags = flags;
+	/* Simulate broadcast for pt-pt */
+	if (flags & IFF_POINTOPOINT)
+		ifp->flags |= IFF_BROADCAST;
 }
 
-void
-init()
+static void remove_interface(int i)
 {
-	initifs();
-#ifdef RDISC_SERVER
-	{
-		int i;
-		for (i = 0; i < interfaces_size; i++)
-			interfaces[i].preference = preference;
-	}
-#endif
+	if (verbose)
+		logmsg(LOG_INFO, "Interface %s, %s gone\n", interfaces[i].name,
+		       inet_ntoa(interfaces[i].localaddr));
+	interfaces[i] = interfaces[--num_interfaces];
 }
 
-void
-initifs()
+static void nl_link(struct nlmsghdr *nh)
 {
-	int	sock;
-	struct ifconf ifc;
-	struct ifreq ifreq, *ifr;
-	struct sockaddr_in *sin;
-	int n, i;
-	char *buf;
-	int numifs;
-	unsigned bufsize;
+	struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	int len = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi));
+	struct link *l;
+	struct rtattr *ra;
+	int i;
 
-	sock = socket(AF_INET, SOCK_DGRAM, 0);
-	if (sock < 0) {
-		logperror("initifs: socket");
+	if (len < 0)
 		return;
-	}
-#ifdef SIOCGIFNUM
-	if (ioctl(sock, SIOCGIFNUM, (char *)&numifs) < 0) {
-		numifs = MAXIFS;
-	}
-#else
-	numifs = MAXIFS;
-#endif
-	bufsize = numifs * sizeof(struct ifreq);
-	buf = (char *)malloc(bufsize);
-	if (buf == NULL) {
-		logmsg(LOG_ERR, "out of memory\n");
-		(void) close(sock);
+	if (nh->nlmsg_type == RTM_DELLINK) {
+		for (i = 0; i < num_interfaces; )
+			if (interfaces[i].ifindex == ifi->ifi_index)
+				remove_interface(i);
+			else
+				i++;
+		l = get_link(ifi->ifi_index, 0);
+		if (l)
+			memset(l, 0, sizeof(*l));
 		return;
 	}
-	if (interfaces != NULL)
-		(void) free(interfaces);
-	interfaces = (struct interface *)ALLIGN(malloc(numifs *
-					sizeof(struct interface)));
-	if (interfaces == NULL) {
-		logmsg(LOG_ERR, "out of memory\n");
-		(void) close(sock);
-		(void) free(buf);
+	l = get_link(ifi->ifi_index, 1);
+	if (l == NULL)
 		return;
-	}
-	interfaces_size = numifs;
+	l->flags = ifi->ifi_flags;
+	for (ra = IFLA_RTA(ifi); RTA_OK(ra, len); ra = RTA_NEXT(ra, len))
+		if (ra->rta_type == IFLA_IFNAME)
+			snprintf(l->name, IFNAMSIZ, "%s", (char *)RTA_DATA(ra));
+	for (i = 0; i < num_interfaces; i++)
+		if (interfaces[i].ifindex == ifi->ifi_index)
+			set_flags(&interfaces[i], l->flags);
+}
 
-	ifc.ifc_len = bufsize;
-	ifc.ifc_buf = buf;
-	if (ioctl(sock, SIOCGIFCONF, (char *)&ifc) < 0) {
-		logperror("initifs: ioctl (get interface configuration)");
-		(void) close(sock);
-		(void) free(buf);
+static void nl_addr(struct nlmsghdr *nh)
+{
+	struct ifaddrmsg *ifm = NLMSG_DATA(nh);
+	int len = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*ifm));
+	struct in_addr local = { 0 }, address = { 0 }, bcast = { 0 };
+	struct interface *ifp = NULL;
+	struct link *l;
+	struct rtattr *ra;
+	char *label = NULL;
+	int i;
+
+	if (len < 0 || ifm->ifa_family != AF_INET)
 		return;
+	for (ra = IFA_RTA(ifm); RTA_OK(ra, len); ra = RTA_NEXT(ra, len)) {
+		if (ra->rta_type == IFA_LABEL)
+			label = RTA_DATA(ra);
+		if (RTA_PAYLOAD(ra) < sizeof(struct in_addr))
+			continue;
+		if (ra->rta_type == IFA_LOCAL)
+			memcpy(&local, RTA_DATA(ra), sizeof(local));
+		else if (ra->rta_type == IFA_ADDRESS)
+			memcpy(&address, RTA_DATA(ra), sizeof(address));
+		else if (ra->rta_type == IFA_BROADCAST)
+			memcpy(&bcast, RTA_DATA(ra), sizeof(bcast));
 	}
-	ifr = ifc.ifc_req;
-	for (i = 0, n = ifc.ifc_len/sizeof (struct ifreq); n > 0; n--, ifr++) {
-		ifreq = *ifr;
+	if (local.s_addr == 0)
+		local = address;
 
-		if (ioctl(sock, SIOCGIFFLAGS, (char *)&ifreq) < 0) {
-			logperror("initifs: ioctl (get interface flags)");
-			continue;
-		}
-		if (ifr->ifr_addr.sa_family != AF_INET)
-			continue;
-		if ((ifreq.ifr_flags & IFF_UP) == 0)
-			continue;
-		if (ifreq.ifr_flags & IFF_LOOPBACK)
-			continue;
-		if ((ifreq.ifr_flags & (IFF_MULTICAST|IFF_BROADCAST|IFF_POINTOPOINT)) == 0)
-			continue;
-		strncpy(interfaces[i].name, ifr->ifr_name, IFNAMSIZ-1);
-
-		sin = (struct sockaddr_in *)ALLIGN(&ifr->ifr_addr);
-		interfaces[i].localaddr = sin->sin_addr;
-		interfaces[i].flags = ifreq.ifr_flags;
-		interfaces[i].netmask.s_addr = (uint32_t)0xffffffff;
-		if (ioctl(sock, SIOCGIFINDEX, (char *)&ifreq) < 0) {
-			logperror("initifs: ioctl (get ifindex)");
-			continue;
+	for (i = 0; i < num_interfaces; i++) {
+		if (interfaces[i].ifindex == (int)ifm->ifa_index &&
+		    interfaces[i].localaddr.s_addr == local.s_addr) {
+			ifp = &interfaces[i];
+			break;
 		}
-		interfaces[i].ifindex = ifreq.ifr_ifindex;
-		if (ifreq.ifr_flags & IFF_POINTOPOINT) {
-			if (ioctl(sock, SIOCGIFDSTADDR, (char *)&ifreq) < 0) {
-				logperror("initifs: ioctl (get destination addr)");
-				continue;
-			}
-			sin = (struct sockaddr_in *)ALLIGN(&ifreq.ifr_addr);
-			/* A pt-pt link is identified by the remote address */
-			interfaces[i].address = sin->sin_addr;
-			interfaces[i].remoteaddr = sin->sin_addr;
-			/* Simulate broadcast for pt-pt */
-			interfaces[i].bcastaddr = sin->sin_addr;
-			interfaces[i].flags |= IFF_BROADCAST;
-		} else {
-			/* Non pt-pt links are identified by the local address */
-			interfaces[i].address = interfaces[i].localaddr;
-			interfaces[i].remoteaddr = interfaces[i].address;
-			if (ioctl(sock, SIOCGIFNETMASK, (char *)&ifreq) < 0) {
-				logperror("initifs: ioctl (get netmask)");
-				continue;
-			}
-			sin = (struct sockaddr_in *)ALLIGN(&ifreq.ifr_addr);
-			interfaces[i].netmask = sin->sin_addr;
-			if (ifreq.ifr_flags & IFF_BROADCAST) {
-				if (ioctl(sock, SIOCGIFBRDADDR, (char *)&ifreq) < 0) {
-					logperror("initifs: ioctl (get broadcast address)");
-					continue;
-				}
-				sin = (struct sockaddr_in *)ALLIGN(&ifreq.ifr_addr);
-				interfaces[i].bcastaddr = sin->sin_addr;
+	}
+	if (nh->nlmsg_type == RTM_DELADDR) {
+		if (ifp)
+			remove_interface(i);
+		return;
+	}
+	if (ifp == NULL) {
+		if (num_interfaces == interfaces_size) {
+			int size = interfaces_size ? 2 * interfaces_size : 64;
+			struct interface *p;
+
+			p = realloc(interfaces, size * sizeof(*p));
+			if (p == NULL) {
+				logmsg(LOG_ERR, "Out of memory\n");
+				return;
 			}
+			interfaces = p;
+			interfaces_size = size;
 		}
-		i++;
+		ifp = &interfaces[num_interfaces++];
+		memset(ifp, 0, sizeof(*ifp));
+		ifp->ifindex = ifm->ifa_index;
+		ifp->localaddr = local;
+#ifdef RDISC_SERVER
+		ifp->preference = preference;
+		/* Spread the first advertisements of new interfaces. */
+		ifp->next_advertise = now_ms() + rand() % 1000;
+		if (ifp->next_advertise < next_advertise)
+			next_advertise = ifp->next_advertise;
+#endif
 	}
-	num_interfaces = i;
-	(void) close(sock);
-	(void) free(buf);
+	ifp->stale = 0;
+	l = get_link(ifp->ifindex, 1);
+	if (l)
+		set_flags(ifp, l->flags);
+	snprintf(ifp->name, IFNAMSIZ, "%s", label ? label : l ? l->name : "");
+	if (address.s_addr != local.s_addr) {
+		/* A pt-pt link is identified by the remote address */
+		ifp->address = address;
+		ifp->remoteaddr = address;
+		ifp->bcastaddr = address;
+		ifp->netmask.s_addr = (uint32_t)0xffffffff;
+	} else {
+		/* Non pt-pt links are identified by the local address */
+		ifp->address = local;
+		ifp->remoteaddr = local;
+		ifp->bcastaddr = bcast;
+		ifp->netmask.s_addr = ifm->ifa_prefixlen ?
+			htonl(~0U << (32 - ifm->ifa_prefixlen)) : 0;
+	}
+}
+
+static void nl_msg(struct nlmsghdr *nh)
+{
+	switch (nh->nlmsg_type) {
+	case RTM_NEWLINK:
+	case RTM_DELLINK:
+		nl_link(nh);
+		break;
+	case RTM_NEWADDR:
+	case RTM_DELADDR:
+		nl_addr(nh);
+		break;
+	}
+}
+
+/* Apply the interface changes waiting.  Returns -1 if messages were lost. */
+static int nl_read(void)
+{
+	if (iputils_nl_read(nlfd, 0, nl_msg) < 0) {
+		if (errno != ENOBUFS)
+			logperror("netlink");
+		return (-1);
+	}
+	return (0);
+}
+
+static int nl_dump(int type)
+{
+	if (iputils_nl_dump(nlfd, type, AF_INET, nl_msg) < 0) {
+		if (errno != ENOBUFS)
+			logperror("netlink");
+		return (-1);
+	}
+	return (0);
 }
 
+/* Join the receive group on the links that do not listen to it yet. */
 int
-join(int sock, struct sockaddr_in *sin)
+join_links(void)
 {
-	int i, j;
 	struct ip_mreqn mreq;
-	int *joined;
+	int i, ret = 0;
 
-	if (isbroadcast(sin))
+	if (isbroadcast(&joinaddr))
 		return (0);
 
-	if ((joined = calloc(num_interfaces, sizeof(int))) == NULL) {
-		logperror("cannot allocate memory");
-		return (-1);
-	}
-	mreq.imr_multiaddr = sin->sin_addr;
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.imr_multiaddr = joinaddr.sin_addr;
 	for (i = 0; i < num_interfaces; i++) {
-		for (j = 0; j < i; j++) {
-			if (joined[j] == interfaces[i].ifindex)
-				break;
-		}
-		if (j != i)
-			continue;
+		struct link *l = get_link(interfaces[i].ifindex, 0);
 
+		if (l == NULL || l->joined || !usable(&interfaces[i]))
+			continue;
 		mreq.imr_ifindex = interfaces[i].ifindex;
-		mreq.imr_address.s_addr = 0;
-
-		if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP,
-			       (char *)&mreq, sizeof(mreq)) < 0) {
+		if (setsockopt(socketfd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+			       (char *)&mreq, sizeof(mreq)) < 0 &&
+		    errno != EADDRINUSE) {
 			logperror("setsockopt (IP_ADD_MEMBERSHIP)");
-			free(joined);
-			return (-1);
+			logmsg(LOG_ERR, "Cannot join %s on interface %s\n",
+			       pr_name(joinaddr.sin_addr), l->name);
+			/* Not retried until the link comes back. */
+			l->joined = -1;
+			ret = -1;
+			continue;
 		}
+		l->joined = 1;
+	}
+	return (ret);
+}
 
-		joined[i] = interfaces[i].ifindex;
+int
+init()
+{
+	struct sockaddr_nl snl = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR
+	};
+
+	nlfd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (nlfd < 0 || bind(nlfd, (struct sockaddr *)&snl, sizeof(snl)) < 0) {
+		logperror("init: netlink");
+		exit(5);
 	}
-	free(joined);
-	return (0);
+	return (initifs());
+}
+
+/*
+ * Rebuild the interface list from a full dump.  Returns -1 when joining the
+ * receive group failed on a link.
+ */
+int
+initifs()
+{
+	int tries, i;
+
+	for (tries = 0; tries < 3; tries++) {
+		for (i = 0; i < num_interfaces; i++)
+			interfaces[i].stale = 1;
+		if (nl_dump(RTM_GETLINK) < 0 || nl_dump(RTM_GETADDR) < 0)
+			continue;
+		for (i = 0; i < num_interfaces; )
+			if (interfaces[i].stale)
+				remove_interface(i);
+			else
+				i++;
+		return (join_links());
+	}
+	logmsg(LOG_ERR, "Cannot dump interfaces, the list may be incomplete\n");
+	return (join_links());
+}
+
+/* Follow interface changes, resynchronizing when notifications were lost. */
+void
+update_ifs(void)
+{
+	if (nl_read() < 0)
+		initifs();
+	else
+		join_links();
 }
 
 int support_multicast()
@@ -1276,6 +1560,8 @@ is_directly_connected(struct in_addr in)
 	int i;
 
 	for (i = 0; i < num_interfaces; i++) {
+		if (!usable(&interfaces[i]))
+			continue;
 		/* Check that the subnetwork numbers match */
 
 		if ((in.s_addr & interfaces[i].netmask.s_addr ) ==
@@ -1287,98 +1573,272 @@ is_directly_connected(struct in_addr in)
 
 /*
  * TABLES
+ *
+ * Routers are hashed by address.  A max-heap ordered by preference gives
+ * the best routers without a scan, a min-heap ordered by expiry time lets
+ * ageing look at expired routers only, and the routers installed in the
+ * kernel are kept on a list of their own.
  */
+enum {
+	HEAP_PREF,
+	HEAP_EXPIRY,
+	NUM_HEAPS
+};
+
+#define ROUTER_HASH_MIN	64
+
 struct table {
 	struct in_addr	router;
 	int		preference;
-	int		remaining_time;
+	long long	expires;	/* ms, CLOCK_MONOTONIC */
 	int		in_kernel;
-	struct table	*next;
+	uint32_t	metric;		/* of the route in the kernel */
+	int		pos[NUM_HEAPS];	/* index in each heap */
+	struct table	*hnext;		/* hash chain */
+	struct table	*knext;		/* routers in the kernel */
+	struct table	**kprev;
+};
+
+struct heap {
+	int		id;
+	int		n;
+	int		size;
+	struct table	**v;
 };
 
-struct table *table;
+static struct table **router_hash;
+static unsigned int router_hash_size;
+static unsigned int num_routers;
+static struct heap pref_heap = { .id = HEAP_PREF };
+static struct heap expiry_heap = { .id = HEAP_EXPIRY };
+static struct table *kernel_routes;
+
+static uint32_t hash32(uint32_t x)
+{
+	uint32_t h = x * 2654435761U;
+
+	return h ^ (h >> 16);
+}
+
+static unsigned int router_slot(struct in_addr addr)
+{
+	return hash32(ntohl(addr.s_addr)) & (router_hash_size - 1);
+}
+
+static int heap_before(struct heap *h, struct table *a, struct table *b)
+{
+	if (h->id == HEAP_PREF)
+		return a->preference > b->preference;
+	return a->expires < b->expires;
+}
+
+static void heap_set(struct heap *h, int i, struct table *tp)
+{
+	h->v[i] = tp;
+	tp->pos[h->id] = i;
+}
+
+static void heap_sift(struct heap *h, int i)
+{
+	struct table *tp = h->v[i];
+
+	while (i > 0 && heap_before(h, tp, h->v[(i - 1) / 2])) {
+		heap_set(h, i, h->v[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	for (;;) {
+		int c = 2 * i + 1;
+
+		if (c >= h->n)
+			break;
+		if (c + 1 < h->n && heap_before(h, h->v[c + 1], h->v[c]))
+			c++;
+		if (!heap_before(h, h->v[c], tp))
+			break;
+		heap_set(h, i, h->v[c]);
+		i = c;
+	}
+	heap_set(h, i, tp);
+}
+
+static int heap_insert(struct heap *h, struct table *tp)
+{
+	if (h->n == h->size) {
+		int size = h->size ? 2 * h->size : ROUTER_HASH_MIN;
+		struct table **v = realloc(h->v, size * sizeof(*v));
+
+		if (v == NULL)
+			return -1;
+		h->v = v;
+		h->size = size;
+	}
+	heap_set(h, h->n++, tp);
+	heap_sift(h, h->n - 1);
+	return 0;
+}
+
+static void heap_remove(struct heap *h, struct table *tp)
+{
+	int i = tp->pos[h->id];
+
+	if (--h->n == i)
+		return;
+	heap_set(h, i, h->v[h->n]);
+	heap_sift(h, i);
+}
 
 struct table *
 find_router(struct in_addr addr)
 {
 	struct table *tp;
 
-	tp = table;
-	while (tp) {
+	if (router_hash == NULL)
+		return (NULL);
+	for (tp = router_hash[router_slot(addr)]; tp; tp = tp->hnext)
 		if (tp->router.s_addr == addr.s_addr)
 			return (tp);
-		tp = tp->next;
-	}
 	return (NULL);
 }
 
+static int hash_insert(struct table *tp)
+{
+	unsigned int i;
+
+	if (num_routers >= router_hash_size) {
+		unsigned int old_size = router_hash_size;
+		struct table **old = router_hash;
+		struct table *next;
+
+		router_hash_size = old_size ? 2 * old_size : ROUTER_HASH_MIN;
+		router_hash = calloc(router_hash_size, sizeof(*router_hash));
+		if (router_hash == NULL) {
+			router_hash = old;
+			router_hash_size = old_size;
+			if (old == NULL)
+				return -1;
+		} else {
+			for (i = 0; i < old_size; i++) {
+				for (; old[i]; old[i] = next) {
+					unsigned int slot = router_slot(old[i]->router);
+
+					next = old[i]->hnext;
+					old[i]->hnext = router_hash[slot];
+					router_hash[slot] = old[i];
+				}
+			}
+			free(old);
+		}
+	}
+	i = router_slot(tp->router);
+	tp->hnext = router_hash[i];
+	router_hash[i] = tp;
+	num_routers++;
+	return 0;
+}
+
+static void hash_remove(struct table *tp)
+{
+	struct table **tpp = &router_hash[router_slot(tp->router)];
+
+	while (*tpp != tp)
+		tpp = &(*tpp)->hnext;
+	*tpp = tp->hnext;
+	num_routers--;
+}
+
+static void kernel_add(struct table *tp)
+{
+	tp->metric = route_metric(tp->preference);
+	add_route(tp->router, tp->metric);
+	tp->in_kernel++;
+	tp->knext = kernel_routes;
+	tp->kprev = &kernel_routes;
+	if (kernel_routes)
+		kernel_routes->kprev = &tp->knext;
+	kernel_routes = tp;
+}
+
+static void kernel_del(struct table *tp)
+{
+	del_route(tp->router, tp->metric);
+	tp->in_kernel = 0;
+	*tp->kprev = tp->knext;
+	if (tp->knext)
+		tp->knext->kprev = tp->kprev;
+}
+
+/* When the next router expires, 0 if there are none. */
+long long next_expiry(void)
+{
+	if (expiry_heap.n == 0)
+		return (0);
+	return (expiry_heap.v[0]->expires);
+}
+
 int max_preference(void)
+{
+	if (pref_heap.n == 0)
+		return ((int)INELIGIBLE_PREF);
+	return (pref_heap.v[0]->preference);
+}
+
+/*
+ * Install the routers of preference max from the subtree of the preference
+ * heap at i.  They form a subtree including the root when max is the best.
+ */
+static void add_best(int i, int max)
 {
 	struct table *tp;
-	int max = (int)INELIGIBLE_PREF;
 
-	tp = table;
-	while (tp) {
-		if (tp->preference > max)
-			max = tp->preference;
-		tp = tp->next;
-	}
-	return (max);
+	if (i >= pref_heap.n || pref_heap.v[i]->preference != max)
+		return;
+	tp = pref_heap.v[i];
+	if (!tp->in_kernel)
+		kernel_add(tp);
+	add_best(2 * i + 1, max);
+	add_best(2 * i + 2, max);
 }
 
+static void remove_router(struct table *tp)
+{
+	if (tp->in_kernel)
+		kernel_del(tp);
+	hash_remove(tp);
+	heap_remove(&pref_heap, tp);
+	heap_remove(&expiry_heap, tp);
+	free(tp);
+}
 
-/* Note: this might leave the kernel with no default route for a short time. */
+/* The route changes go out from flush_routes(), additions first. */
 void
-age_table(int time)
+age_table(void)
 {
-	struct table **tpp, *tp;
 	int recalculate_max = 0;
 	int max = max_preference();
+	long long now = now_ms();
 
-	tpp = &table;
-	while (*tpp != NULL) {
-		tp = *tpp;
-		tp->remaining_time -= time;
-		if (tp->remaining_time <= 0) {
-			*tpp = tp->next;
-			if (tp->in_kernel)
-				del_route(tp->router);
-			if (best_preference &&
-			    tp->preference == max)
-				recalculate_max++;
-			free((char *)tp);
-		} else {
-			tpp = &tp->next;
-		}
+	while (expiry_heap.n && expiry_heap.v[0]->expires <= now) {
+		struct table *tp = expiry_heap.v[0];
+
+		if (best_preference &&
+		    tp->preference == max)
+			recalculate_max++;
+		remove_router(tp);
 	}
 	if (recalculate_max) {
 		int max_pref = max_preference();
 
-		if (max_pref != (int) INELIGIBLE_PREF) {
-			tp = table;
-			while (tp) {
-				if (tp->preference == max_pref && !tp->in_kernel) {
-					add_route(tp->router);
-					tp->in_kernel++;
-				}
-				tp = tp->next;
-			}
-		}
+		if (max_pref != (int) INELIGIBLE_PREF)
+			add_best(0, max_pref);
 	}
+	flush_routes();
 }
 
 void discard_table(void)
 {
-	struct table **tpp, *tp;
-
-	tpp = &table;
-	while (*tpp != NULL) {
-		tp = *tpp;
-		*tpp = tp->next;
-		if (tp->in_kernel)
-			del_route(tp->router);
-		free((char *)tp);
-	}
+	while (pref_heap.n)
+		remove_router(pref_heap.v[0]);
+	flush_routes();
 }
 
 
@@ -1406,102 +1866,319 @@ record_router(struct in_addr router, int pref, int ttl)
 		else if (pref > tp->preference)
 			changed_up++;
 		tp->preference = pref;
-		tp->remaining_time = ttl;
+		tp->expires = now_ms() + ttl * 1000LL;
+		heap_sift(&pref_heap, tp->pos[HEAP_PREF]);
+		heap_sift(&expiry_heap, tp->pos[HEAP_EXPIRY]);
 	} else {
 		if (pref > old_max)
 			changed_up++;
-		tp = (struct table *)ALLIGN(malloc(sizeof(struct table)));
+		tp = (struct table *)ALLIGN(calloc(1, sizeof(struct table)));
 		if (tp == NULL) {
 			logmsg(LOG_ERR, "Out of memory\n");
 			return;
 		}
 		tp->router = router;
 		tp->preference = pref;
-		tp->remaining_time = ttl;
+		tp->expires = now_ms() + ttl * 1000LL;
 		tp->in_kernel = 0;
-		tp->next = table;
-		table = tp;
+		if (hash_insert(tp) < 0) {
+			logmsg(LOG_ERR, "Out of memory\n");
+			free(tp);
+			return;
+		}
+		if (heap_insert(&pref_heap, tp) < 0) {
+			logmsg(LOG_ERR, "Out of memory\n");
+			hash_remove(tp);
+			free(tp);
+			return;
+		}
+		if (heap_insert(&expiry_heap, tp) < 0) {
+			logmsg(LOG_ERR, "Out of memory\n");
+			hash_remove(tp);
+			heap_remove(&pref_heap, tp);
+			free(tp);
+			return;
+		}
 	}
 	if (!tp->in_kernel &&
 	    (!best_preference || tp->preference == max_preference()) &&
-	    tp->preference != (int) INELIGIBLE_PREF) {
-		add_route(tp->router);
-		tp->in_kernel++;
-	}
-	if (tp->preference == (int) INELIGIBLE_PREF && tp->in_kernel) {
-		del_route(tp->router);
-		tp->in_kernel = 0;
+	    tp->preference != (int) INELIGIBLE_PREF)
+		kernel_add(tp);
+	if (tp->preference == (int) INELIGIBLE_PREF && tp->in_kernel)
+		kernel_del(tp);
+	if (tp->in_kernel && tp->metric != route_metric(tp->preference)) {
+		/* Move the route to the metric of the new preference. */
+		kernel_del(tp);
+		kernel_add(tp);
 	}
 	if (best_preference && changed_down) {
 		/* Check if we should add routes */
 		int new_max = max_preference();
-		if (new_max != (int) INELIGIBLE_PREF) {
-			tp = table;
-			while (tp) {
-				if (tp->preference == new_max &&
-				    !tp->in_kernel) {
-					add_route(tp->router);
-					tp->in_kernel++;
-				}
-				tp = tp->next;
-			}
-		}
+		if (new_max != (int) INELIGIBLE_PREF)
+			add_best(0, new_max);
 	}
 	if (best_preference && (changed_up || changed_down)) {
 		/* Check if we should remove routes already in the kernel */
 		int new_max = max_preference();
-		tp = table;
-		while (tp) {
-			if (tp->preference < new_max && tp->in_kernel) {
-				del_route(tp->router);
-				tp->in_kernel = 0;
-			}
-			tp = tp->next;
+		struct table *next;
+
+		for (tp = kernel_routes; tp; tp = next) {
+			next = tp->knext;
+			if (tp->preference < new_max)
+				kernel_del(tp);
+		}
+	}
+}
+
+/*
+ * ROUTES
+ *
+ * Route changes are queued while the table is updated and flush_routes()
+ * sends them over rtnetlink together, additions first, so that switching to
+ * another best router never leaves the kernel without a default route.
+ */
+#define ROUTE_BATCH	256	/* route messages per sendmsg() */
+
+struct route_op {
+	struct in_addr	gw;
+	uint32_t	metric;
+	int		add;
+	int		hnext;		/* hash chain, -1 at the end */
+};
+
+struct route_msg {
+	struct nlmsghdr	nh;
+	struct rtmsg	rtm;
+	struct rtattr	gw_attr;
+	struct in_addr	gw;
+	struct rtattr	metric_attr;
+	uint32_t	metric;
+};
+
+static struct route_op *route_ops;
+static int num_route_ops;
+static int route_ops_size;
+static int *route_hash;		/* 2 * route_ops_size chains of route_ops */
+static int rtnl_fd = -1;
+static uint32_t rtnl_seq;
+
+/* With all routers accepted, higher preferences get lower metrics. */
+static uint32_t route_metric(int pref)
+{
+	if (best_preference)
+		return (0);
+	return (0x7fffffffU - (uint32_t)pref);
+}
+
+static int *route_chain(struct in_addr addr, uint32_t metric)
+{
+	return &route_hash[hash32(ntohl(addr.s_addr) ^ hash32(metric)) &
+			   (2 * route_ops_size - 1)];
+}
+
+/* The link pointing to route_ops[i] in its hash chain. */
+static int *route_link(int i)
+{
+	int *p = route_chain(route_ops[i].gw, route_ops[i].metric);
+
+	while (*p != i)
+		p = &route_ops[*p].hnext;
+	return p;
+}
+
+static void route_hash_rebuild(void)
+{
+	int *p;
+	int i;
+
+	for (i = 0; i < 2 * route_ops_size; i++)
+		route_hash[i] = -1;
+	for (i = 0; i < num_route_ops; i++) {
+		p = route_chain(route_ops[i].gw, route_ops[i].metric);
+		route_ops[i].hnext = *p;
+		*p = i;
+	}
+}
+
+static void queue_route(struct in_addr addr, uint32_t metric, int add)
+{
+	int *p;
+	int i;
+
+	/* An addition and a deletion of the same route cancel out. */
+	for (i = route_ops_size ? *route_chain(addr, metric) : -1; i >= 0;
+	     i = route_ops[i].hnext) {
+		struct route_op *op = &route_ops[i];
+		int last;
+
+		if (op->gw.s_addr != addr.s_addr || op->metric != metric)
+			continue;
+		if (op->add == add)
+			return;
+		/* Unlink it and move the last op in its place. */
+		*route_link(i) = op->hnext;
+		last = --num_route_ops;
+		if (i != last) {
+			*route_link(last) = i;
+			*op = route_ops[last];
+		}
+		return;
+	}
+	if (num_route_ops == route_ops_size) {
+		int size = route_ops_size ? 2 * route_ops_size : ROUTE_BATCH;
+		struct route_op *ops = realloc(route_ops, size * sizeof(*ops));
+		int *hash = NULL;
+
+		if (ops != NULL) {
+			route_ops = ops;
+			hash = malloc(2 * size * sizeof(*hash));
+		}
+		if (hash == NULL) {
+			logmsg(LOG_ERR, "Out of memory\n");
+			return;
 		}
+		free(route_hash);
+		route_hash = hash;
+		route_ops_size = size;
+		route_hash_rebuild();
+	}
+	p = route_chain(addr, metric);
+	route_ops[num_route_ops].gw = addr;
+	route_ops[num_route_ops].metric = metric;
+	route_ops[num_route_ops].add = add;
+	route_ops[num_route_ops].hnext = *p;
+	*p = num_route_ops++;
+}
+
+/* Forget the queued route changes. */
+static void route_ops_clear(void)
+{
+	while (num_route_ops > 0) {
+		num_route_ops--;
+		*route_chain(route_ops[num_route_ops].gw,
+			     route_ops[num_route_ops].metric) = -1;
 	}
 }
 
 void
-add_route(struct in_addr addr)
+add_route(struct in_addr addr, uint32_t metric)
 {
 	if (debug)
-		logmsg(LOG_DEBUG, "Add default route to %s\n", pr_name(addr));
-	rtioctl(addr, SIOCADDRT);
+		logmsg(LOG_DEBUG, "Add default route to %s, metric %u\n",
+			 pr_name(addr), metric);
+	queue_route(addr, metric, 1);
 }
 
 void
-del_route(struct in_addr addr)
+del_route(struct in_addr addr, uint32_t metric)
 {
 	if (debug)
-		logmsg(LOG_DEBUG, "Delete default route to %s\n", pr_name(addr));
-	rtioctl(addr, SIOCDELRT);
+		logmsg(LOG_DEBUG, "Delete default route to %s, metric %u\n",
+			 pr_name(addr), metric);
+	queue_route(addr, metric, 0);
 }
 
-void
-rtioctl(struct in_addr addr, int op)
+static void route_msg(struct route_msg *m, struct route_op *op)
 {
-	int sock;
-	struct rtentry rt;
-	struct sockaddr_in *sin;
+	memset(m, 0, sizeof(*m));
+	m->nh.nlmsg_len = sizeof(*m);
+	m->nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	if (op->add) {
+		m->nh.nlmsg_type = RTM_NEWROUTE;
+		m->nh.nlmsg_flags |= NLM_F_CREATE;
+		m->rtm.rtm_scope = RT_SCOPE_UNIVERSE;
+	} else {
+		m->nh.nlmsg_type = RTM_DELROUTE;
+		m->rtm.rtm_scope = RT_SCOPE_NOWHERE;
+	}
+	m->nh.nlmsg_seq = ++rtnl_seq;
+	m->rtm.rtm_family = AF_INET;
+	m->rtm.rtm_table = RT_TABLE_MAIN;
+	m->rtm.rtm_protocol = RTPROT_RA;
+	m->rtm.rtm_type = RTN_UNICAST;
+	m->gw_attr.rta_len = RTA_LENGTH(sizeof(m->gw));
+	m->gw_attr.rta_type = RTA_GATEWAY;
+	m->gw = op->gw;
+	m->metric_attr.rta_len = RTA_LENGTH(sizeof(m->metric));
+	m->metric_attr.rta_type = RTA_PRIORITY;
+	m->metric = op->metric;
+}
 
-	memset((char *)&rt, 0, sizeof(struct rtentry));
-	rt.rt_dst.sa_family = AF_INET;
-	rt.rt_gateway.sa_family = AF_INET;
-	rt.rt_genmask.sa_family = AF_INET;
-	sin = (struct sockaddr_in *)ALLIGN(&rt.rt_gateway);
-	sin->sin_addr = addr;
-	rt.rt_flags = RTF_UP | RTF_GATEWAY;
+/* Send n route messages in one go and collect their acknowledgements. */
+static void route_send(struct route_msg *msgs, struct route_op **ops, int n)
+{
+	struct sockaddr_nl nladdr = { .nl_family = AF_NETLINK };
+	uint32_t first = msgs[0].nh.nlmsg_seq;
+	char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+	int acked = 0;
+
+	if (sendto(rtnl_fd, msgs, n * sizeof(*msgs), 0,
+		   (struct sockaddr *)&nladdr, sizeof(nladdr)) < 0) {
+		logperror("netlink (add/delete route)");
+		return;
+	}
+	while (acked < n) {
+		struct nlmsghdr *nh;
+		ssize_t cc = recv(rtnl_fd, buf, sizeof(buf), 0);
 
-	sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	if (sock < 0) {
-		logperror("rtioctl: socket");
+		if (cc < 0) {
+			if (errno == EINTR)
+				continue;
+			logperror("netlink (add/delete route)");
+			return;
+		}
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (size_t)cc);
+		     nh = NLMSG_NEXT(nh, cc)) {
+			struct nlmsgerr *err = NLMSG_DATA(nh);
+			struct route_op *op;
+
+			if (nh->nlmsg_type != NLMSG_ERROR ||
+			    nh->nlmsg_seq - first >= (uint32_t)n)
+				continue;
+			acked++;
+			op = ops[nh->nlmsg_seq - first];
+			if (err->error == 0 || (op->add && err->error == -EEXIST))
+				continue;
+			logmsg(LOG_ERR, "Cannot %s default route to %s: %s\n",
+			       op->add ? "add" : "delete", pr_name(op->gw),
+			       strerror(-err->error));
+		}
+	}
+}
+
+/* Program the queued route changes into the kernel. */
+void
+flush_routes(void)
+{
+	static struct route_msg msgs[ROUTE_BATCH];
+	struct route_op *ops[ROUTE_BATCH];
+	int add, i, n = 0;
+
+	if (num_route_ops == 0)
 		return;
+	if (rtnl_fd < 0) {
+		rtnl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+		if (rtnl_fd < 0) {
+			logperror("flush_routes: socket");
+			route_ops_clear();
+			return;
+		}
 	}
-	if (ioctl(sock, op, (char *)&rt) < 0) {
-		if (!(op == SIOCADDRT && errno == EEXIST))
-			logperror("ioctl (add/delete route)");
+	for (add = 1; add >= 0; add--) {
+		for (i = 0; i < num_route_ops; i++) {
+			if (route_ops[i].add != add)
+				continue;
+			ops[n] = &route_ops[i];
+			route_msg(&msgs[n], ops[n]);
+			if (++n == ROUTE_BATCH) {
+				route_send(msgs, ops, n);
+				n = 0;
+			}
+		}
 	}
-	(void) close(sock);
+	if (n)
+		route_send(msgs, ops, n);
+	route_ops_clear();
 }
 
 /*
@@ -0,0 +1,316 @@
+/*
+ * resolver.c
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "iputils_common.h"
+#include "resolver.h"
+
+enum {
+	RESOLVER_HASH_SIZE = 2 * RESOLVER_CACHE_SIZE,
+	RESOLVER_REPORT_WAIT_MS = 2000,
+};
+
+struct rentry {
+	struct sockaddr_storage sa;
+	socklen_t salen;
+	char name[NI_MAXHOST];
+	int state;
+	unsigned int
+		late:1;			/* numeric address was handed out */
+	struct rentry *hnext;		/* hash chain */
+	struct rentry *prev;		/* LRU list, most recent first */
+	struct rentry *next;
+	struct rentry *qnext;		/* lookup queue */
+};
+
+static struct resolver {
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t done;
+	struct rentry entries[RESOLVER_CACHE_SIZE];
+	struct rentry *hash[RESOLVER_HASH_SIZE];
+	struct rentry lru;
+	struct rentry *head;
+	struct rentry *tail;
+	int used;
+	int pending;
+	int flags;
+	int fd;
+	int ready;			/* resolver_init() was called */
+} res;				/* in .bss, set up by resolver_init() */
+
+static size_t sa_key(struct sockaddr const *sa, void const **key)
+{
+	if (sa->sa_family == AF_INET6) {
+		*key = &((struct sockaddr_in6 const *)sa)->sin6_addr;
+		return sizeof(struct in6_addr);
+	}
+	*key = &((struct sockaddr_in const *)sa)->sin_addr;
+	return sizeof(struct in_addr);
+}
+
+static uint32_t sa_hash(struct sockaddr const *sa)
+{
+	unsigned char const *p;
+	void const *key;
+	size_t len = sa_key(sa, &key);
+	uint32_t h = 2166136261U;
+
+	for (p = key; len--; p++) {
+		h ^= *p;
+		h *= 16777619U;
+	}
+	return h % RESOLVER_HASH_SIZE;
+}
+
+static int sa_equal(struct sockaddr const *a, struct sockaddr const *b)
+{
+	void const *ka, *kb;
+	size_t len;
+
+	if (a->sa_family != b->sa_family)
+		return 0;
+	len = sa_key(a, &ka);
+	sa_key(b, &kb);
+	return !memcmp(ka, kb, len);
+}
+
+static void lru_unlink(struct rentry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static void lru_push(struct rentry *e)
+{
+	e->next = res.lru.next;
+	e->prev = &res.lru;
+	res.lru.next->prev = e;
+	res.lru.next = e;
+}
+
+static void hash_unlink(struct rentry *e)
+{
+	struct rentry **p = &res.hash[sa_hash((struct sockaddr *)&e->sa)];
+
+	while (*p != e)
+		p = &(*p)->hnext;
+	*p = e->hnext;
+}
+
+/* Take a free entry, or recycle the least recently used finished one. */
+static struct rentry *entry_alloc(void)
+{
+	struct rentry *e;
+
+	if (res.used < RESOLVER_CACHE_SIZE)
+		return &res.entries[res.used++];
+	for (e = res.lru.prev; e != &res.lru; e = e->prev) {
+		if (e->state != RESOLVER_PENDING) {
+			hash_unlink(e);
+			lru_unlink(e);
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void *resolver_thread(void *arg __attribute__((__unused__)))
+{
+	struct sockaddr_storage sa;
+	socklen_t salen;
+	char name[NI_MAXHOST];
+	struct rentry *e;
+	uint64_t one = 1;
+	int ret;
+
+	pthread_mutex_lock(&res.lock);
+	for (;;) {
+		while (!res.head)
+			pthread_cond_wait(&res.queued, &res.lock);
+		e = res.head;
+		res.head = e->qnext;
+		if (!res.head)
+			res.tail = NULL;
+		memcpy(&sa, &e->sa, sizeof(sa));
+		salen = e->salen;
+		pthread_mutex_unlock(&res.lock);
+
+		ret = getnameinfo((struct sockaddr *)&sa, salen, name, sizeof(name),
+				  NULL, 0, res.flags);
+
+		pthread_mutex_lock(&res.lock);
+		/* Pending entries are never recycled, e is still ours. */
+		if (ret) {
+			e->name[0] = '\0';
+			e->state = RESOLVER_FAILED;
+		} else {
+			memcpy(e->name, name, sizeof(e->name));
+			e->state = RESOLVER_DONE;
+		}
+		res.pending--;
+		pthread_cond_broadcast(&res.done);
+		if (write(res.fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			error(0, errno, "eventfd");
+	}
+	return NULL;
+}
+
+/*
+ * Start the resolver threads.  'flags' are passed to getnameinfo().  The
+ * returned descriptor is readable whenever a lookup has completed.
+ */
+int resolver_init(int flags)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int i;
+
+	pthread_mutex_init(&res.lock, NULL);
+	pthread_cond_init(&res.queued, NULL);
+	pthread_cond_init(&res.done, NULL);
+	res.flags = flags;
+	res.lru.next = res.lru.prev = &res.lru;
+	res.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (res.fd < 0)
+		error(2, errno, "eventfd");
+	res.ready = 1;
+
+	/* Threads may be stuck in getnameinfo() at exit, never join them. */
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < RESOLVER_THREADS; i++) {
+		errno = pthread_create(&thread, &attr, resolver_thread, NULL);
+		if (errno)
+			error(2, errno, "pthread_create");
+	}
+	pthread_attr_destroy(&attr);
+	return res.fd;
+}
+
+/*
+ * Look up the name of 'sa' in the cache.  On a miss the lookup is queued
+ * and RESOLVER_PENDING returned with the numeric address in 'host'.
+ */
+int resolver_lookup(struct sockaddr const *sa, socklen_t salen,
+		    char *host, size_t hostlen)
+{
+	struct rentry *e;
+	int state;
+
+	pthread_mutex_lock(&res.lock);
+	for (e = res.hash[sa_hash(sa)]; e; e = e->hnext)
+		if (sa_equal(sa, (struct sockaddr *)&e->sa))
+			break;
+	if (e) {
+		lru_unlink(e);
+		lru_push(e);
+	} else if ((e = entry_alloc())) {
+		uint32_t h = sa_hash(sa);
+
+		memset(e, 0, sizeof(*e));
+		memcpy(&e->sa, sa, salen);
+		e->salen = salen;
+		e->state = RESOLVER_PENDING;
+		e->hnext = res.hash[h];
+		res.hash[h] = e;
+		lru_push(e);
+		if (res.tail)
+			res.tail->qnext = e;
+		else
+			res.head = e;
+		res.tail = e;
+		res.pending++;
+		pthread_cond_signal(&res.queued);
+	}
+
+	state = e ? e->state : RESOLVER_PENDING;
+	if (e)
+		e->late = state == RESOLVER_PENDING;
+	if (state == RESOLVER_DONE)
+		snprintf(host, hostlen, "%s", e->name);
+	pthread_mutex_unlock(&res.lock);
+
+	if (state == RESOLVER_FAILED)
+		host[0] = '\0';
+	else if (state == RESOLVER_PENDING &&
+		 getnameinfo(sa, salen, host, hostlen, NULL, 0, NI_NUMERICHOST))
+		host[0] = '\0';
+	return state;
+}
+
+/* Clear the readiness of the resolver descriptor. */
+void resolver_ack(void)
+{
+	uint64_t count;
+
+	if (read(res.fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		error(0, errno, "eventfd");
+}
+
+/* Wait for queued lookups, returns the number still pending. */
+int resolver_wait(int timeout_ms)
+{
+	struct timespec deadline;
+	int pending;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&res.lock);
+	while (res.pending &&
+	       pthread_cond_timedwait(&res.done, &res.lock, &deadline) == 0)
+		;
+	pending = res.pending;
+	pthread_mutex_unlock(&res.lock);
+	return pending;
+}
+
+/* Print the names that were not known yet when their address was printed. */
+void resolver_report(void)
+{
+	char addr[NI_MAXHOST];
+	int header = 0;
+	int i;
+
+	if (!res.ready)
+		return;
+	resolver_wait(RESOLVER_REPORT_WAIT_MS);
+
+	pthread_mutex_lock(&res.lock);
+	for (i = 0; i < res.used; i++) {
+		struct rentry *e = &res.entries[i];
+
+		if (!e->late || e->state != RESOLVER_DONE)
+			continue;
+		if (getnameinfo((struct sockaddr *)&e->sa, e->salen, addr, sizeof(addr),
+				NULL, 0, NI_NUMERICHOST) || !strcmp(addr, e->name))
+			continue;
+		if (!header)
+			printf(_("Names resolved late:\n"));
+		header = 1;
+		printf("  %s  %s\n", addr, e->name);
+	}
+	pthread_mutex_unlock(&res.lock);
+}
@@ -0,0 +1,33 @@
+#ifndef IPUTILS_RESOLVER_H
+#define IPUTILS_RESOLVER_H
+/*
+ * Reverse DNS lookups for tracepath and traceroute6.
+ *
+ * Lookups run in a small pool of threads so that probing never waits for a
+ * slow PTR zone.  Results are kept in an LRU cache shared by every hop and
+ * destination of the process, and a descriptor becomes readable whenever a
+ * lookup completes, so callers can refresh their output from poll().
+ */
+#include <stddef.h>
+#include <sys/socket.h>
+
+enum {
+	RESOLVER_THREADS = 4,
+	RESOLVER_CACHE_SIZE = 1024,
+};
+
+/* resolver_lookup() results */
+enum {
+	RESOLVER_PENDING,	/* queued, the buffer holds the numeric address */
+	RESOLVER_DONE,		/* the buffer holds the name */
+	RESOLVER_FAILED,	/* getnameinfo() failed, the buffer is empty */
+};
+
+extern int resolver_init(int flags);
+extern int resolver_lookup(struct sockaddr const *sa, socklen_t salen,
+			   char *host, size_t hostlen);
+extern void resolver_ack(void);
+extern int resolver_wait(int timeout_ms);
+extern void resolver_report(void);
+
+#endif /* IPUTILS_RESOLVER_H */
@@ -33,12 +33,42 @@
 
 #include <arpa/tftp.h>
 
-extern int readit(FILE *file, struct tftphdr **dpp, int convert);
-extern void read_ahead(FILE *file, int convert);
-extern int writeit(FILE *file, struct tftphdr **dpp, int ct, int convert);
-extern int write_behind(FILE *file, int convert);
+#ifndef OACK
+# define OACK	06			/* option acknowledgement, RFC 2347 */
+#endif
+
+/* Option limits of RFC 2348 and RFC 7440 */
+#define	MINBLKSIZE	8
+#define	MAXBLKSIZE	65464
+#define	MAXWINDOWSIZE	64		/* ours, the RFC allows 65535 */
+
+/* Blocks sent and not yet acknowledged. */
+struct window {
+	int blksize;			/* data bytes per block */
+	int size;			/* blocks in flight at most */
+	int count;			/* blocks held */
+	int first;			/* slot of the oldest block */
+	uint16_t base;			/* block number of the oldest block */
+	int eof;			/* the last block was read */
+	off_t offset;			/* of the next block in the file */
+	int newline;			/* in middle of newline expansion */
+	int prevchar;			/* previous char (cr check) */
+	const char *map;		/* the file mapped in memory, or NULL */
+	off_t mapsize;
+	int *len;			/* data bytes of each slot */
+	const char **data;		/* data of each slot in the map */
+	char *pkts;			/* slots of blksize + 4 bytes, 4 if mapped */
+};
+
+extern int win_init(struct window *w, int blksize, int size, const char *map,
+		    off_t mapsize);
+extern void win_free(struct window *w);
+extern struct tftphdr *win_block(struct window *w, int i, int *len);
+extern int win_iov(struct window *w, int i, struct iovec *iov);
+extern int win_fill(struct window *w, int fd, FILE *file);
+extern void win_ack(struct window *w, int n);
+extern int write_block(struct window *w, FILE *file, char *buf, int count,
+		       int convert);
 extern int synchnet(int f);
-extern struct tftphdr *w_init(void);
-extern struct tftphdr *r_init(void);
 
 #endif /* IPUTILS_TFTPD_H */
@@ -38,18 +38,22 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <grp.h>
+#include <linux/errqueue.h>
 #include <netdb.h>
 #include <netinet/in.h>
-#include <setjmp.h>
-#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <syslog.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "iputils_common.h"
@@ -57,7 +61,12 @@
 
 enum {
 	MAXARG = 1,
-	TIMEOUT = 5
+	TIMEOUT = 5,
+	TFTP_PORT = 69,
+	MAX_TRANSFERS = 500,	/* each holds a socket and maybe a file */
+	MAXEVENTS = 64,
+	WHEEL_SLOTS = 64,	/* seconds, above any retransmit interval */
+	ZEROCOPY_MIN = 16384	/* smaller blocks are cheaper to copy */
 };
 
 struct errmsg {
@@ -76,21 +85,71 @@ struct errmsg {
 };
 
 struct run_state;
+struct transfer;
 
 struct formats {
 	char *f_mode;
-	int (*f_validate)(struct run_state *ctl, char *filename, int mode);
-	void (*f_send)(struct run_state *ctl, struct formats *);
-	void (*f_recv)(struct run_state *ctl, struct formats *);
+	int (*f_validate)(struct run_state *ctl, struct transfer *t, char *filename, int mode);
+	int (*f_send)(struct run_state *ctl, struct transfer *t);
+	int (*f_recv)(struct run_state *ctl, struct transfer *t);
 	int f_convert;
 };
 
-struct run_state {
+/*
+ * A file read in octet mode, shared by the transfers of that file.  It is
+ * mapped in memory once, so they all send from the same page cache pages.
+ */
+struct shared_file {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	off_t size;
+	int fd;
+	void *map;		/* NULL if empty or not mappable */
+	int refs;
+	struct shared_file *next;
+};
+
+/* Transfer states */
+enum {
+	T_OACK,			/* options sent, waiting for their ACK */
+	T_DATA,			/* blocks moving */
+	T_LINGER,		/* final ACK sent, in case it gets lost */
+};
+
+/*
+ * A transfer in progress.  Each one talks to its client over its own
+ * connected socket and has a retransmit timer in the wheel.
+ */
+struct transfer {
 	int peer;
+	int op;			/* RRQ or WRQ */
+	int state;
+	struct formats *pf;
+	FILE *file;		/* file written, or read in netascii mode */
+	struct shared_file *sf;	/* file read in octet mode */
+	int blksize;		/* negotiated options */
+	int windowsize;
+	int oacklen;		/* length of the OACK in ackbuf, 0 if none */
+	char ackbuf[PKTSIZE];
+	struct window window;	/* blocks sent, or the block received */
+	uint16_t block;		/* last block received in order */
+	int received;		/* blocks received since the last ACK */
+	int next;		/* slot of the window to send next */
+	int resent;		/* window already resent on an ack */
+	int pollout;		/* waiting for room in the socket buffer */
+	int zerocopy;		/* MSG_ZEROCOPY, or 0 */
+	int confirmed;
+	int timeout;
+	long long expire;	/* second the retransmit timer fires */
+	struct transfer *tnext;
+	struct transfer **tprev;
+};
+
+struct run_state {
 	int rexmtval;
 	int maxtimeout;
 	char buf[PKTSIZE];
-	char ackbuf[PKTSIZE];
 	union {
 		struct sockaddr sa;
 		struct sockaddr_in sin;
@@ -98,24 +157,62 @@ struct run_state {
 	} from;
 	struct formats formats[3];
 	socklen_t fromlen;
-	int confirmed;
-	int timeout;
-	jmp_buf timeoutbuf;
 	char *dirs[MAXARG + 1];
-	FILE *file;
+	int epfd;
+	int listenfd;		/* -1 when started by inetd */
+	int port;
+	int workers;
+	int transfers;		/* in progress */
+	int max_transfers;	/* beyond, requests are turned down */
+	struct shared_file *files;
+	uint16_t *zc_headers;	/* DATA header of each block number */
+	struct transfer *wheel[WHEEL_SLOTS];
+	long long tick;		/* last second of the wheel processed */
 };
-struct run_state *global_ctl;
 
 /*
  * All includes, definitions, struct declarations, and global variables are above.  After
  * this comment all you can find is functions.
  */
 
+static long long monotonic_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void timer_cancel(struct transfer *t)
+{
+	if (!t->tprev)
+		return;
+	if (t->tnext)
+		t->tnext->tprev = t->tprev;
+	*t->tprev = t->tnext;
+	t->tprev = NULL;
+}
+
+/* (Re)start the retransmit timer of a transfer, 'secs' below WHEEL_SLOTS. */
+static void timer_arm(struct run_state *ctl, struct transfer *t, int secs)
+{
+	struct transfer **slot;
+
+	timer_cancel(t);
+	t->expire = ctl->tick + secs;
+	slot = &ctl->wheel[t->expire % WHEEL_SLOTS];
+	t->tnext = *slot;
+	if (t->tnext)
+		t->tnext->tprev = &t->tnext;
+	t->tprev = slot;
+	*slot = t;
+}
+
 /*
  * Send a nak packet (error message).  Error code passed in is one of the standard TFTP
  * codes, or a UNIX errno offset by 100.
  */
-void nak(struct run_state *ctl, uint16_t error)
+void nak(struct run_state *ctl, struct transfer *t, uint16_t error)
 {
 	struct tftphdr *tp;
 	ssize_t length;
@@ -134,14 +231,96 @@ void nak(struct run_state *ctl, uint16_t error)
 	length = strlen(pe->e_msg) + 1;	/* plus terminating null */
 	memcpy(tp->th_msg, pe->e_msg, length);
 	length += sizeof(tp->th_opcode) + sizeof(tp->th_code);
-	if (send(ctl->peer, ctl->buf, length, 0) != length)
+	if (send(t->peer, ctl->buf, length, 0) != length)
 		syslog(LOG_ERR, "nak: %s\n", strerror(errno));
 }
 
 /*
- * Handle initial connection protocol.
+ * Largest block that fits in the path MTU to the peer.  The socket must be
+ * connected.
  */
-void tftp(struct run_state *ctl, struct tftphdr *tp, int size)
+int max_blksize(struct transfer *t)
+{
+	struct sockaddr_storage ss;
+	socklen_t sslen = sizeof(ss);
+	int mtu, hdrlen;
+	socklen_t len = sizeof(mtu);
+
+	if (getpeername(t->peer, (struct sockaddr *)&ss, &sslen) < 0)
+		return SEGSIZE;
+	if (ss.ss_family == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+
+		/* IPv4 clients of the standalone server come as mapped addresses */
+		if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+			hdrlen = 20 + 8 + 4;
+		else
+			hdrlen = 40 + 8 + 4;
+		if (getsockopt(t->peer, IPPROTO_IPV6, IPV6_MTU, &mtu, &len) < 0)
+			return SEGSIZE;
+	} else {
+		hdrlen = 20 + 8 + 4;
+		if (getsockopt(t->peer, IPPROTO_IP, IP_MTU, &mtu, &len) < 0)
+			return SEGSIZE;
+	}
+	if (mtu - hdrlen < SEGSIZE)
+		return SEGSIZE;
+	if (mtu - hdrlen > MAXBLKSIZE)
+		return MAXBLKSIZE;
+	return mtu - hdrlen;
+}
+
+/*
+ * Negotiate the options following the mode in a request (RFC 2347).  Those
+ * we support are answered in an OACK built in ackbuf, the others are
+ * ignored.
+ */
+void options(struct transfer *t, char *cp, char *end)
+{
+	struct tftphdr *op = (struct tftphdr *)t->ackbuf;
+	char *ap = op->th_stuff;
+	char *opt, *val;
+	int seen = 0;
+	long v;
+
+	while (cp < end) {
+		opt = cp;
+		val = memchr(opt, '\0', end - opt);
+		if (val == NULL || ++val >= end)
+			break;
+		cp = memchr(val, '\0', end - val);
+		if (cp == NULL)
+			break;
+		cp++;
+		v = strtol(val, NULL, 10);
+		if (strcasecmp(opt, "blksize") == 0 && v >= MINBLKSIZE &&
+		    !(seen & 1)) {
+			if (v > max_blksize(t))
+				v = max_blksize(t);
+			t->blksize = v;
+			seen |= 1;
+		} else if (strcasecmp(opt, "windowsize") == 0 && v >= 1 &&
+			   !(seen & 2)) {
+			if (v > MAXWINDOWSIZE)
+				v = MAXWINDOWSIZE;
+			t->windowsize = v;
+			seen |= 2;
+		} else
+			continue;
+		ap += sprintf(ap, "%s", opt) + 1;
+		ap += sprintf(ap, "%ld", v) + 1;
+	}
+	if (ap != op->th_stuff) {
+		op->th_opcode = htons((uint16_t)OACK);
+		t->oacklen = ap - t->ackbuf;
+	}
+}
+
+/*
+ * Handle initial connection protocol.  Returns -1 when the transfer is
+ * over already.
+ */
+int tftp(struct run_state *ctl, struct transfer *t, struct tftphdr *tp, int size)
 {
 	char *cp;
 	int first = 1, ecode;
@@ -155,9 +334,9 @@ void tftp(struct run_state *ctl, struct tftphdr *tp, int size)
 			break;
 		cp++;
 	}
-	if (*cp != '\0') {
-		nak(ctl, EBADOP);
-		exit(1);
+	if (cp >= ctl->buf + size) {
+		nak(ctl, t, EBADOP);
+		return -1;
 	}
 	if (first) {
 		mode = ++cp;
@@ -171,19 +350,21 @@ void tftp(struct run_state *ctl, struct tftphdr *tp, int size)
 		if (strcmp(pf->f_mode, mode) == 0)
 			break;
 	if (pf->f_mode == 0) {
-		nak(ctl, EBADOP);
-		exit(1);
+		nak(ctl, t, EBADOP);
+		return -1;
 	}
-	ecode = (*pf->f_validate) (ctl, filename, tp->th_opcode);
+	t->pf = pf;
+	t->op = tp->th_opcode;
+	options(t, cp + 1, ctl->buf + size);
+	ecode = (*pf->f_validate) (ctl, t, filename, tp->th_opcode);
 	if (ecode) {
-		nak(ctl, ecode);
-		exit(1);
+		nak(ctl, t, ecode);
+		return -1;
 	}
 	if (tp->th_opcode == WRQ)
-		(*pf->f_recv) (ctl, pf);
+		return (*pf->f_recv) (ctl, t);
 	else
-		(*pf->f_send) (ctl, pf);
-	exit(0);
+		return (*pf->f_send) (ctl, t);
 }
 
 /*
@@ -193,10 +374,13 @@ void tftp(struct run_state *ctl, struct tftphdr *tp, int size)
  * If we were invoked with arguments from inetd then the file must also be in one of the
  * given directory prefixes.  Note also, full path name must be given as we have no login
  * directory.
+ *
+ * Files read in octet mode are opened once and shared by all their transfers.
  */
-int validate_access(struct run_state *ctl, char *filename, int mode)
+int validate_access(struct run_state *ctl, struct transfer *t, char *filename, int mode)
 {
 	struct stat stbuf;
+	struct shared_file *sf;
 	int fd;
 	char *cp;
 	char fnamebuf[1024 + 512];
@@ -233,187 +417,586 @@ int validate_access(struct run_state *ctl, char *filename, int mode)
 			return EACCESS;
 		}
 	}
-	fd = open(filename, mode == RRQ ? 0 : 1);
+	if (mode == RRQ && !t->pf->f_convert) {
+		for (sf = ctl->files; sf; sf = sf->next) {
+			/* A file changed in place is opened anew */
+			if (sf->dev == stbuf.st_dev && sf->ino == stbuf.st_ino &&
+			    sf->size == stbuf.st_size &&
+			    sf->mtime.tv_sec == stbuf.st_mtim.tv_sec &&
+			    sf->mtime.tv_nsec == stbuf.st_mtim.tv_nsec) {
+				sf->refs++;
+				t->sf = sf;
+				return 0;
+			}
+		}
+	}
+	fd = open(filename, (mode == RRQ ? O_RDONLY : O_WRONLY) | O_CLOEXEC);
 	if (fd < 0) {
 		syslog(LOG_ERR, "cannot open %s: %s", filename, strerror(errno));
 		return (errno + 100);
 	}
-	ctl->file = fdopen(fd, (mode == RRQ) ? "r" : "w");
-	if (ctl->file == NULL) {
+	if (mode == RRQ && !t->pf->f_convert) {
+		sf = malloc(sizeof(*sf));
+		if (sf == NULL) {
+			close(fd);
+			return (ENOMEM + 100);
+		}
+		sf->dev = stbuf.st_dev;
+		sf->ino = stbuf.st_ino;
+		sf->mtime = stbuf.st_mtim;
+		sf->size = stbuf.st_size;
+		sf->fd = fd;
+		sf->map = NULL;
+		if (sf->size > 0) {
+			sf->map = mmap(NULL, sf->size, PROT_READ, MAP_SHARED, fd, 0);
+			if (sf->map == MAP_FAILED)
+				sf->map = NULL;	/* read it then */
+		}
+		/* Start reading it all, other clients are likely to follow */
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		sf->refs = 1;
+		sf->next = ctl->files;
+		ctl->files = sf;
+		t->sf = sf;
+		return 0;
+	}
+	t->file = fdopen(fd, (mode == RRQ) ? "r" : "w");
+	if (t->file == NULL) {
+		close(fd);
 		return (errno + 100);
 	}
 	return 0;
 }
 
-void timer(int signo __attribute__((__unused__)))
+static void release_file(struct run_state *ctl, struct shared_file *sf)
 {
-	global_ctl->confirmed = 0;
-	global_ctl->timeout += global_ctl->rexmtval;
-	if (global_ctl->timeout >= global_ctl->maxtimeout)
-		exit(1);
-	longjmp(global_ctl->timeoutbuf, 1);
+	struct shared_file **p;
+
+	if (--sf->refs)
+		return;
+	for (p = &ctl->files; *p != sf; p = &(*p)->next)
+		;
+	*p = sf->next;
+	if (sf->map)
+		munmap(sf->map, sf->size);
+	close(sf->fd);
+	free(sf);
+}
+
+static void transfer_end(struct run_state *ctl, struct transfer *t)
+{
+	timer_cancel(t);
+	epoll_ctl(ctl->epfd, EPOLL_CTL_DEL, t->peer, NULL);
+	close(t->peer);
+	if (t->file)
+		fclose(t->file);
+	if (t->sf)
+		release_file(ctl, t->sf);
+	win_free(&t->window);
+	free(t);
+	ctl->transfers--;
+}
+
+/* Watch for room in the socket buffer, or stop doing so. */
+static void want_output(struct run_state *ctl, struct transfer *t, int on)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = t };
+
+	if (t->pollout == on)
+		return;
+	if (on)
+		ev.events |= EPOLLOUT;
+	epoll_ctl(ctl->epfd, EPOLL_CTL_MOD, t->peer, &ev);
+	t->pollout = on;
 }
 
 /*
- * Send the requested file.
+ * Send the blocks of the window from t->next on.  When the socket buffer
+ * fills up, the rest goes once there is room again.
  */
-void sendfile(struct run_state *ctl, struct formats *pf)
+static int send_window(struct run_state *ctl, struct transfer *t)
 {
-	struct tftphdr *dp;
-	struct tftphdr *ap;	/* ack packet */
-	volatile uint16_t block = 1;
-	ssize_t size, n;
-
-	ctl->confirmed = 0;
-	signal(SIGALRM, timer);
-	dp = r_init();
-	ap = (struct tftphdr *)ctl->ackbuf;
-	do {
-		size = readit(ctl->file, &dp, pf->f_convert);
-		if (size < 0) {
-			nak(ctl, errno + 100);
-			goto abort;
-		}
-		dp->th_opcode = htons((uint16_t)DATA);
-		dp->th_block = htons(block);
-		ctl->timeout = 0;
-		setjmp(ctl->timeoutbuf);
+	struct window *w = &t->window;
+	struct iovec iov[2];
+	struct msghdr msg = { .msg_iov = iov };
+	ssize_t n;
 
- send_data:
-		if (send(ctl->peer, dp, size + 4, ctl->confirmed) != size + 4) {
+	for (; t->next < w->count; t->next++) {
+		msg.msg_iovlen = win_iov(w, t->next, iov);
+		if (t->zerocopy)
+			iov[0].iov_base = &ctl->zc_headers[2 * (uint16_t)(w->base + t->next)];
+		n = sendmsg(t->peer, &msg, t->confirmed | t->zerocopy);
+		if (n < 0 && t->zerocopy && (errno == ENOBUFS || errno == EMSGSIZE))
+			/* Too many pages to pin for this one, copy it */
+			n = sendmsg(t->peer, &msg, t->confirmed);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				want_output(ctl, t, 1);
+				return 0;
+			}
 			syslog(LOG_ERR, "tftpd: write: %s\n", strerror(errno));
-			goto abort;
+			return -1;
 		}
-		ctl->confirmed = 0;
-		read_ahead(ctl->file, pf->f_convert);
-		for (;;) {
-			alarm(ctl->rexmtval);	/* read the ack */
-			n = recv(ctl->peer, ctl->ackbuf, sizeof(ctl->ackbuf), 0);
-			alarm(0);
-			if (n < 0) {
-				syslog(LOG_ERR, "tftpd: read: %s\n", strerror(errno));
-				goto abort;
-			}
-			ap->th_opcode = ntohs((uint16_t)ap->th_opcode);
-			ap->th_block = ntohs((uint16_t)ap->th_block);
-
-			if (ap->th_opcode == ERROR)
-				goto abort;
-
-			if (ap->th_opcode == ACK) {
-				if (ap->th_block == block) {
-					ctl->confirmed = MSG_CONFIRM;
-					break;
-				}
-				/* Re-synchronize with the other side */
-				synchnet(ctl->peer);
-				if (ap->th_block == (block - 1)) {
-					goto send_data;
-				}
-			}
+		t->confirmed = 0;
+	}
+	want_output(ctl, t, 0);
+	return 0;
+}
+
+/*
+ * Read the next window and send it.  Returns -1 when the last block has
+ * been acknowledged, or on errors.
+ */
+static int next_window(struct run_state *ctl, struct transfer *t)
+{
+	struct window *w = &t->window;
+
+	if (win_fill(w, t->sf ? t->sf->fd : -1, t->file) < 0) {
+		nak(ctl, t, errno + 100);
+		return -1;
+	}
+	if (w->count == 0)
+		return -1;		/* the last block was acknowledged */
+	t->next = 0;
+	t->timeout = 0;
+	timer_arm(ctl, t, ctl->rexmtval);
+	return send_window(ctl, t);
+}
+
+static int send_oack(struct run_state *ctl, struct transfer *t)
+{
+	timer_arm(ctl, t, ctl->rexmtval);
+	if (send(t->peer, t->ackbuf, t->oacklen, 0) != t->oacklen &&
+	    errno != EAGAIN) {
+		syslog(LOG_ERR, "tftpd: write: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef SO_ZEROCOPY
+/*
+ * Build the DATA headers of all the block numbers for zerocopy sends.  The
+ * kernel reads a header until the completion comes, which may be after its
+ * window slot was refilled, so they are taken from this table that is never
+ * written again.
+ */
+static int zerocopy_headers(struct run_state *ctl)
+{
+	int i;
 
+	if (ctl->zc_headers)
+		return 0;
+	ctl->zc_headers = malloc(2 * 65536 * sizeof(*ctl->zc_headers));
+	if (ctl->zc_headers == NULL)
+		return -1;
+	for (i = 0; i < 65536; i++) {
+		ctl->zc_headers[2 * i] = htons((uint16_t)DATA);
+		ctl->zc_headers[2 * i + 1] = htons((uint16_t)i);
+	}
+	return 0;
+}
+#endif
+
+/*
+ * Send the requested file.  The window of blocks is sent in a row and the
+ * client acknowledges the last block it received in order, from which the
+ * next window starts (RFC 7440).
+ */
+int sendfile(struct run_state *ctl, struct transfer *t)
+{
+	struct shared_file *sf = t->sf;
+#ifdef SO_ZEROCOPY
+	int on = 1;
+#endif
+
+	if (win_init(&t->window, t->blksize, t->windowsize,
+		     sf ? sf->map : NULL, sf ? sf->size : 0) < 0) {
+		nak(ctl, t, ENOMEM + 100);
+		return -1;
+	}
+	/*
+	 * Large blocks from the map are sent without copying them.  Pinning
+	 * the pages and the completion costs more than copying small ones.
+	 */
+#ifdef SO_ZEROCOPY
+	if (sf && sf->map && t->blksize >= ZEROCOPY_MIN &&
+	    zerocopy_headers(ctl) == 0 &&
+	    setsockopt(t->peer, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0)
+		t->zerocopy = MSG_ZEROCOPY;
+#endif
+	if (t->oacklen) {
+		t->state = T_OACK;
+		return send_oack(ctl, t);
+	}
+	t->state = T_DATA;
+	return next_window(ctl, t);
+}
+
+/* Handle an ACK of a file being sent. */
+static int read_ack(struct run_state *ctl, struct transfer *t, struct tftphdr *ap)
+{
+	struct window *w = &t->window;
+	uint16_t acked;
+
+	ap->th_opcode = ntohs((uint16_t)ap->th_opcode);
+	ap->th_block = ntohs((uint16_t)ap->th_block);
+
+	if (ap->th_opcode == ERROR)
+		return -1;
+	if (ap->th_opcode != ACK)
+		return 0;
+
+	if (t->state == T_OACK) {
+		if (ap->th_block != 0)
+			return 0;
+		t->state = T_DATA;
+		return next_window(ctl, t);
+	}
+	/* Blocks of the window acknowledged */
+	acked = ap->th_block - w->base + 1;
+	if (acked >= 1 && acked <= w->count) {
+		/* The rest of a partly acknowledged window is resent */
+		t->resent = acked < w->count;
+		win_ack(w, acked);
+		t->confirmed = MSG_CONFIRM;
+		return next_window(ctl, t);
+	}
+	/* Re-synchronize with the other side */
+	synchnet(t->peer);
+	/* Resend once, later duplicates answer blocks that were still in flight. */
+	if (acked == 0 && !t->resent) {
+		t->resent = 1;
+		t->next = 0;
+		return send_window(ctl, t);
+	}
+	return 0;
+}
+
+/* Acknowledge the blocks received, with the OACK before the first one. */
+static int send_ack(struct run_state *ctl, struct transfer *t)
+{
+	struct tftphdr *ap = (struct tftphdr *)t->ackbuf;
+	int len = 4;
+
+	if (t->block == 0 && t->oacklen)
+		len = t->oacklen;
+	else {
+		ap->th_opcode = htons((uint16_t)ACK);
+		ap->th_block = htons(t->block);
+	}
+	t->received = 0;
+	timer_arm(ctl, t, ctl->rexmtval);
+	if (send(t->peer, t->ackbuf, len, t->confirmed) != len && errno != EAGAIN) {
+		syslog(LOG_ERR, "tftpd: write: %s\n", strerror(errno));
+		return -1;
+	}
+	t->confirmed = 0;
+	return 0;
+}
+
+/*
+ * Receive a file.  Blocks are acknowledged once per window, or as soon as
+ * one arrives out of order.
+ */
+int recvfile(struct run_state *ctl, struct transfer *t)
+{
+	/* A window of one block holds the packet being received. */
+	if (win_init(&t->window, t->blksize, 1, NULL, 0) < 0) {
+		nak(ctl, t, ENOMEM + 100);
+		return -1;
+	}
+	t->state = T_DATA;
+	return send_ack(ctl, t);
+}
+
+/* Handle a DATA packet of a file being received. */
+static int write_data(struct run_state *ctl, struct transfer *t, struct tftphdr *dp, int n)
+{
+	ssize_t size;
+
+	dp->th_opcode = ntohs((uint16_t)dp->th_opcode);
+	dp->th_block = ntohs((uint16_t)dp->th_block);
+	if (dp->th_opcode == ERROR)
+		return -1;
+	if (dp->th_opcode != DATA || n < 4)
+		return 0;
+	if (t->state == T_LINGER) {
+		if (dp->th_block == t->block)	/* then my last ack was lost */
+			return send_ack(ctl, t);	/* resend final ack */
+		return 0;
+	}
+	if (dp->th_block != (uint16_t)(t->block + 1)) {
+		/* Re-synchronize with the other side */
+		synchnet(t->peer);
+		if (t->windowsize == 1 && dp->th_block == t->block)
+			return send_ack(ctl, t);	/* rexmit */
+		/* Once per gap, the following blocks are out of order too */
+		if (t->windowsize > 1 && !t->resent) {
+			t->resent = 1;
+			return send_ack(ctl, t);
 		}
-		block++;
-	} while (size == SEGSIZE);
- abort:
-	fclose(ctl->file);
+		return 0;
+	}
+	size = write_block(&t->window, t->file, dp->th_data, n - 4, t->pf->f_convert);
+	if (size != (n - 4)) {	/* ahem */
+		if (size < 0)
+			nak(ctl, t, errno + 100);
+		else
+			nak(ctl, t, ENOSPACE);
+		return -1;
+	}
+	t->block++;
+	t->timeout = 0;
+	t->resent = 0;
+	t->confirmed = MSG_CONFIRM;
+	if (size < t->blksize) {
+		/* Last block, send the "final" ack and wait in case it is lost */
+		if (close_stream(t->file))
+			syslog(LOG_ERR, "tftpd: write error: %s\n",  strerror(errno));
+		t->file = NULL;
+		t->state = T_LINGER;
+		return send_ack(ctl, t);
+	}
+	if (++t->received == t->windowsize)
+		return send_ack(ctl, t);
+	timer_arm(ctl, t, ctl->rexmtval);
+	return 0;
 }
 
-void justquit(int signo __attribute__((__unused__)))
+/* Nothing heard from the client for rexmtval seconds. */
+static int transfer_timeout(struct run_state *ctl, struct transfer *t)
 {
-	exit(0);
+	t->confirmed = 0;
+	t->timeout += ctl->rexmtval;
+	if (t->timeout >= ctl->maxtimeout || t->state == T_LINGER)
+		return -1;
+	if (t->op == WRQ)
+		return send_ack(ctl, t);
+	if (t->state == T_OACK)
+		return send_oack(ctl, t);
+	t->next = 0;
+	timer_arm(ctl, t, ctl->rexmtval);
+	return send_window(ctl, t);
 }
 
 /*
- * Receive a file.
+ * Collect the completions of zerocopy sends.  The kernel tells when it had
+ * to copy the data anyway, as it does for local clients, then the transfer
+ * stops asking for it.
  */
-void recvfile(struct run_state *ctl, struct formats *pf)
+static void zerocopy_done(struct transfer *t)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct sock_extended_err *serr;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(t->peer, &msg, MSG_ERRQUEUE) < 0)
+			return;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY &&
+			    (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED))
+				t->zerocopy = 0;
+		}
+	}
+}
+
+static void transfer_event(struct run_state *ctl, struct transfer *t, uint32_t events)
 {
 	struct tftphdr *dp;
-	struct tftphdr *ap;	/* ack buffer */
-	volatile uint16_t block = 0;
-	ssize_t n, size;
-
-	ctl->confirmed = 0;
-	signal(SIGALRM, timer);
-	dp = w_init();
-	ap = (struct tftphdr *)ctl->ackbuf;
-	do {
-		ctl->timeout = 0;
-		ap->th_opcode = htons((uint16_t)ACK);
-		ap->th_block = htons(block);
-		block++;
-		setjmp(ctl->timeoutbuf);
- send_ack:
-		if (send(ctl->peer, ctl->ackbuf, 4, ctl->confirmed) != 4) {
-			syslog(LOG_ERR, "tftpd: write: %s\n", strerror(errno));
-			goto abort;
+	ssize_t n;
+	int len;
+
+	if (events & EPOLLERR)
+		zerocopy_done(t);
+	if ((events & EPOLLOUT) && send_window(ctl, t) < 0)
+		goto end;
+	if (!(events & (EPOLLIN | EPOLLERR)))
+		return;
+	for (;;) {
+		if (t->op == WRQ) {
+			dp = win_block(&t->window, 0, &len);
+			n = recv(t->peer, dp, t->blksize + 4, 0);
+		} else {
+			dp = (struct tftphdr *)ctl->buf;
+			n = recv(t->peer, ctl->buf, sizeof(ctl->buf), 0);
 		}
-		ctl->confirmed = 0;
-		write_behind(ctl->file, pf->f_convert);
-		for (;;) {
-			alarm(ctl->rexmtval);
-			n = recv(ctl->peer, dp, PKTSIZE, 0);
-			alarm(0);
-			if (n < 0) {	/* really? */
-				syslog(LOG_ERR, "tftpd: read: %s\n", strerror(errno));
-				goto abort;
-			}
-			dp->th_opcode = ntohs((uint16_t)dp->th_opcode);
-			dp->th_block = ntohs((uint16_t)dp->th_block);
-			if (dp->th_opcode == ERROR)
-				goto abort;
-			if (dp->th_opcode == DATA) {
-				if (dp->th_block == block) {
-					ctl->confirmed = MSG_CONFIRM;
-					break;	/* normal */
-				}
-				/* Re-synchronize with the other side */
-				synchnet(ctl->peer);
-				if (dp->th_block == (block - 1))
-					goto send_ack;	/* rexmit */
-			}
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			syslog(LOG_ERR, "tftpd: read: %s\n", strerror(errno));
+			goto end;
 		}
-		/* size = write(file, dp->th_data, n - 4); */
-		size = writeit(ctl->file, &dp, n - 4, pf->f_convert);
-		if (size != (n - 4)) {	/* ahem */
-			if (size < 0)
-				nak(ctl, errno + 100);
-			else
-				nak(ctl, ENOSPACE);
-			goto abort;
+		if (n < 4)
+			continue;
+		if ((t->op == WRQ ? write_data(ctl, t, dp, n) : read_ack(ctl, t, dp)) < 0)
+			goto end;
+	}
+ end:
+	transfer_end(ctl, t);
+}
+
+/* Fire the retransmit timers of the seconds elapsed. */
+static void run_timers(struct run_state *ctl)
+{
+	long long now = monotonic_sec();
+	struct transfer *t, *list;
+
+	while (ctl->tick < now) {
+		ctl->tick++;
+		list = ctl->wheel[ctl->tick % WHEEL_SLOTS];
+		ctl->wheel[ctl->tick % WHEEL_SLOTS] = NULL;
+		if (list)
+			list->tprev = &list;
+		while ((t = list) != NULL) {
+			timer_cancel(t);
+			if (t->expire > ctl->tick)
+				timer_arm(ctl, t, t->expire - ctl->tick);
+			else if (transfer_timeout(ctl, t) < 0)
+				transfer_end(ctl, t);
 		}
-	} while (size == SEGSIZE);
-	write_behind(ctl->file, pf->f_convert);
-	if (close_stream(ctl->file))
-		syslog(LOG_ERR, "tftpd: write error: %s\n",  strerror(errno));
-	fclose(ctl->file);		/* close data file */
+	}
+}
 
-	ap->th_opcode = htons((uint16_t)ACK);	/* send the "final" ack */
-	ap->th_block = htons(block);
-	send(ctl->peer, ctl->ackbuf, 4, ctl->confirmed);
+/*
+ * Start a transfer for the request in ctl->buf, from ctl->from.  Replies
+ * come from a new socket, the transfer ID of the server.
+ */
+static void transfer_start(struct run_state *ctl, int n)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct tftphdr *tp = (struct tftphdr *)ctl->buf;
+	struct transfer *t;
+	int off = 0;
 
-	signal(SIGALRM, justquit);	/* just quit on timeout */
-	alarm(ctl->rexmtval);
-	n = recv(ctl->peer, ctl->buf, sizeof(ctl->buf), 0);	/* normally times out and quits */
-	alarm(0);
-	if (n >= 4 &&			/* if read some data */
-	    dp->th_opcode == DATA &&	/* and got a data block */
-	    block == dp->th_block) {	/* then my last ack was lost */
-		send(ctl->peer, ctl->ackbuf, 4, 0);	/* resend final ack */
+	tp->th_opcode = ntohs(tp->th_opcode);
+	if (tp->th_opcode != RRQ && tp->th_opcode != WRQ)
+		return;
+	t = calloc(1, sizeof(*t));
+	if (t == NULL) {
+		syslog(LOG_ERR, "out of memory\n");
+		return;
+	}
+	t->peer = socket(ctl->from.sa.sa_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (t->peer < 0) {
+		syslog(LOG_ERR, "socket: %s\n", strerror(errno));
+		free(t);
+		return;
 	}
- abort:
-	return;
+	/* IPv4 clients of the standalone server come as mapped addresses */
+	if (ctl->from.sa.sa_family == AF_INET6)
+		setsockopt(t->peer, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+	if (connect(t->peer, (struct sockaddr *)&ctl->from, ctl->fromlen) < 0) {
+		syslog(LOG_ERR, "connect: %s\n", strerror(errno));
+		close(t->peer);
+		free(t);
+		return;
+	}
+	ev.data.ptr = t;
+	if (epoll_ctl(ctl->epfd, EPOLL_CTL_ADD, t->peer, &ev) < 0) {
+		syslog(LOG_ERR, "epoll_ctl: %s\n", strerror(errno));
+		close(t->peer);
+		free(t);
+		return;
+	}
+	ctl->transfers++;
+	t->blksize = SEGSIZE;
+	t->windowsize = 1;
+	if (tftp(ctl, t, tp, n) < 0)
+		transfer_end(ctl, t);
 }
 
-int tftpd_inetd(struct run_state *ctl)
+/*
+ * Turn down the request in ctl->buf, from ctl->from, when max_transfers are
+ * in progress.  The error comes from the listening socket, the client gets
+ * it rather than retrying until it gives up.
+ */
+static void busy(struct run_state *ctl)
+{
+	struct tftphdr *tp = (struct tftphdr *)ctl->buf;
+	static const char msg[] = "Too many transfers, try again later";
+	size_t length = 4 + sizeof(msg);
+
+	if (ntohs(tp->th_opcode) != RRQ && ntohs(tp->th_opcode) != WRQ)
+		return;
+	tp->th_opcode = htons((uint16_t)ERROR);
+	tp->th_code = htons((uint16_t)EUNDEF);
+	memcpy(tp->th_msg, msg, sizeof(msg));
+	sendto(ctl->listenfd, ctl->buf, length, 0,
+	       (struct sockaddr *)&ctl->from, ctl->fromlen);
+}
+
+/* Start transfers for the requests queued on the listening socket. */
+static void accept_requests(struct run_state *ctl)
 {
-	struct tftphdr *tp;
-	int on = 1;
 	ssize_t n;
+	int i;
 
-	openlog("tftpd", LOG_PID, LOG_DAEMON);
+	for (i = 0; i < MAXEVENTS; i++) {
+		ctl->fromlen = sizeof(ctl->from);
+		n = recvfrom(ctl->listenfd, ctl->buf, sizeof(ctl->buf), 0,
+			     (struct sockaddr *)&ctl->from, &ctl->fromlen);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				syslog(LOG_ERR, "recvfrom: %s\n", strerror(errno));
+			return;
+		}
+		if (n < 4)
+			continue;
+		if (ctl->transfers >= ctl->max_transfers)
+			busy(ctl);
+		else
+			transfer_start(ctl, n);
+	}
+}
 
+/*
+ * Run the transfers, and accept new ones when listening, from a single
+ * epoll loop.  Returns when the last transfer is over in inetd mode.
+ */
+static void serve(struct run_state *ctl)
+{
+	struct epoll_event events[MAXEVENTS];
+	struct timespec ts;
+	int i, n, timeout;
+
+	while (ctl->listenfd >= 0 || ctl->transfers) {
+		timeout = -1;
+		if (ctl->transfers) {
+			/* Wake up at the next second of the wheel */
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			timeout = 1000 - ts.tv_nsec / 1000000;
+		}
+		n = epoll_wait(ctl->epfd, events, MAXEVENTS, timeout);
+		if (n < 0) {
+			if (errno != EINTR) {
+				syslog(LOG_ERR, "epoll_wait: %s\n", strerror(errno));
+				exit(1);
+			}
+			continue;
+		}
+		/* The wheel only turns while there are transfers */
+		if (!ctl->transfers)
+			ctl->tick = monotonic_sec();
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == NULL)
+				accept_requests(ctl);
+			else
+				transfer_event(ctl, events[i].data.ptr, events[i].events);
+		}
+		run_timers(ctl);
+	}
+}
+
+static void drop_privileges(void)
+{
 	/* Sanity. If parent forgot to setuid() on us. */
 	if (geteuid() == 0) {
 		/* Drop all supplementary groups. No error checking is needed */
@@ -423,6 +1006,15 @@ int tftpd_inetd(struct run_state *ctl)
 			exit(1);
 		}
 	}
+}
+
+int tftpd_inetd(struct run_state *ctl)
+{
+	int on = 1;
+	ssize_t n;
+
+	openlog("tftpd", LOG_PID, LOG_DAEMON);
+	drop_privileges();
 
 	if (ioctl(0, FIONBIO, &on) < 0) {
 		syslog(LOG_ERR, "ioctl(FIONBIO): %s\n", strerror(errno));
@@ -480,23 +1072,78 @@ int tftpd_inetd(struct run_state *ctl)
 		if (pid != 0)
 			exit(0);
 	}
-	alarm(0);
 	close(0);
 	close(1);
-	ctl->peer = socket(ctl->from.sa.sa_family, SOCK_DGRAM, 0);
-	if (ctl->peer < 0) {
-		syslog(LOG_ERR, "socket: %s\n", strerror(errno));
+	ctl->listenfd = -1;
+	ctl->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (ctl->epfd < 0) {
+		syslog(LOG_ERR, "epoll_create: %s\n", strerror(errno));
 		exit(1);
 	}
-	if (connect(ctl->peer, (struct sockaddr *)&ctl->from, sizeof(ctl->from)) < 0) {
-		syslog(LOG_ERR, "connect: %s\n", strerror(errno));
-		exit(1);
+	ctl->tick = monotonic_sec();
+	if (n >= 4)
+		transfer_start(ctl, n);
+	serve(ctl);
+	return 0;
+}
+
+/*
+ * Standalone server: listen on the tftp port and serve all the clients from
+ * one process, or from one process per worker sharing the port with
+ * SO_REUSEPORT.
+ */
+int tftpd_standalone(struct run_state *ctl)
+{
+	struct sockaddr_in6 sin6 = {
+		.sin6_family = AF_INET6,
+		.sin6_addr = IN6ADDR_ANY_INIT,
+		.sin6_port = htons(ctl->port)
+	};
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+		.sin_port = htons(ctl->port)
+	};
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	int on = 1, off = 0;
+	int i;
+
+	openlog("tftpd", LOG_PID, LOG_DAEMON);
+	for (i = 1; i < ctl->workers; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0)
+			error(1, errno, "fork");
+		if (pid == 0)
+			break;
 	}
-	tp = (struct tftphdr *)ctl->buf;
-	tp->th_opcode = ntohs(tp->th_opcode);
-	if (tp->th_opcode == RRQ || tp->th_opcode == WRQ)
-		tftp(ctl, tp, n);
-	return 1;
+
+	ctl->listenfd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (ctl->listenfd >= 0) {
+		setsockopt(ctl->listenfd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+		if (ctl->workers > 1)
+			setsockopt(ctl->listenfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+		if (bind(ctl->listenfd, (struct sockaddr *)&sin6, sizeof(sin6)) < 0)
+			error(1, errno, "bind");
+	} else {
+		/* No IPv6, serve IPv4 only */
+		ctl->listenfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (ctl->listenfd < 0)
+			error(1, errno, "socket");
+		if (ctl->workers > 1)
+			setsockopt(ctl->listenfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+		if (bind(ctl->listenfd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+			error(1, errno, "bind");
+	}
+	drop_privileges();
+
+	ctl->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (ctl->epfd < 0)
+		error(1, errno, "epoll_create");
+	if (epoll_ctl(ctl->epfd, EPOLL_CTL_ADD, ctl->listenfd, &ev) < 0)
+		error(1, errno, "epoll_ctl");
+	serve(ctl);
+	return 0;
 }
 
 static void __attribute__((__noreturn__)) usage(void)
@@ -504,6 +1151,12 @@ static void __attribute__((__noreturn__)) usage(void)
 	printf("\nUsage:\n");
 	printf(" %s [options] directory\n", program_invocation_short_name);
 	printf("\nOptions:\n");
+	printf(" -l, --listen         run standalone instead of from inetd\n");
+	printf(" -p, --port <port>    port to listen on (default 69)\n");
+	printf(" -w, --workers <num>  number of processes listening\n");
+	printf(" -m, --max-transfers <num>\n");
+	printf("                      transfers in progress per process (default %d)\n",
+	       MAX_TRANSFERS);
 	printf(" -h, --help           display this help\n");
 	printf(" -V, --version        display version\n");
 	printf("\nFor more details see tftpd(8).\n");
@@ -515,22 +1168,41 @@ int main(int ac, char **av)
 	struct run_state ctl = {
 		.rexmtval = TIMEOUT,
 		.maxtimeout = 5 * TIMEOUT,
+		.listenfd = -1,
+		.port = TFTP_PORT,
+		.workers = 1,
+		.max_transfers = MAX_TRANSFERS,
 		.formats = {
 			{"netascii", validate_access, sendfile, recvfile, 1},
 			{"octet", validate_access, sendfile, recvfile, 0}
 		}
 	};
-	int c, n = 0;
+	int c, n = 0, standalone = 0;
 	static const struct option longopts[] = {
+		{"listen", no_argument, NULL, 'l'},
+		{"port", required_argument, NULL, 'p'},
+		{"workers", required_argument, NULL, 'w'},
+		{"max-transfers", required_argument, NULL, 'm'},
 		{"version", no_argument, NULL, 'V'},
 		{"help", no_argument, NULL, 'h'},
 		{NULL, 0, NULL, 0}
 	};
 
-	global_ctl = &ctl;
-
-	while ((c = getopt_long(ac, av, "Vh", longopts, NULL)) != -1)
+	while ((c = getopt_long(ac, av, "lp:w:m:Vh", longopts, NULL)) != -1)
 		switch (c) {
+		case 'l':
+			standalone = 1;
+			break;
+		case 'p':
+			ctl.port = strtol_or_err(optarg, "invalid port", 1, 65535);
+			break;
+		case 'w':
+			ctl.workers = strtol_or_err(optarg, "invalid workers", 1, 1024);
+			break;
+		case 'm':
+			ctl.max_transfers = strtol_or_err(optarg, "invalid max transfers",
+							  1, 65535);
+			break;
 		case 'V':
 			printf(IPUTILS_VERSION("tftpd"));
 			return EXIT_SUCCESS;
@@ -542,9 +1214,11 @@ int main(int ac, char **av)
 				program_invocation_short_name);
 			exit(1);
 		}
-	ac--;
-	av++;
+	ac -= optind;
+	av += optind;
 	while (ac-- > 0 && n < MAXARG)
 		ctl.dirs[n++] = *av++;
+	if (standalone)
+		return tftpd_standalone(&ctl);
 	return tftpd_inetd(&ctl);
 }
@@ -28,177 +28,194 @@
  */
 
 /* Simple minded read-ahead/write-behind subroutines for tftp user and
-   server.  Written originally with multiple buffers in mind, but current
-   implementation has two buffer logic wired in.
+   server.
 
-   Todo:  add some sort of final error check so when the write-buffer
-   is finally flushed, the caller can detect if the disk filled up
-   (or had an i/o error) and return a nak to the other side.
+   Blocks read from the file are kept in a window until they are
+   acknowledged, so that a lost block is sent again without going back to
+   the file.  The window holds as many blocks as were negotiated with the
+   windowsize option (RFC 7440), each of the negotiated blksize (RFC 2348).
+   When the file is mapped in memory, the window only holds the headers
+   and blocks are sent from the map.  Received blocks are written as soon
+   as they arrive in order.  All the
+   state lives in the window, so that many transfers can run at once.
 
 			Jim Guyton 10/85
  */
 
 #include <netinet/in.h>
 #include <stdio.h>
-#include <sys/ioctl.h>
+#include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "tftp.h"
 
-struct bf {
-	int counter;		/* size of data in buffer, or flag */
-	char buf[PKTSIZE];	/* room for data packet */
-} bfs[2];
-
-				/* Values for bf.counter */
-#define BF_ALLOC -3		/* alloc'd but not yet filled */
-#define BF_FREE  -2		/* free */
-/* [-1 .. SEGSIZE] = size of data in the data buffer */
-
-static int nextone;		/* index of next buffer to use */
-static int current;		/* index of buffer in use */
-
-				/* control flags for crlf conversions */
-int newline = 0;		/* fillbuf: in middle of newline expansion */
-int prevchar = -1;		/* putbuf: previous char (cr check) */
-
-struct tftphdr *rw_init(int);
-
-/* write-behind */
-struct tftphdr *w_init()
+/*
+ * Set up an empty window of 'size' blocks of 'blksize' bytes.  Blocks come
+ * from 'map', 'mapsize' bytes long, unless it is NULL.
+ */
+int win_init(struct window *w, int blksize, int size, const char *map,
+	     off_t mapsize)
 {
-	return rw_init(0);
+	size_t slot = map ? 4 : (size_t)blksize + 4;
+
+	w->newline = 0;			/* init crlf flag */
+	w->prevchar = -1;
+	w->offset = 0;
+	w->blksize = blksize;
+	w->size = size;
+	w->count = 0;
+	w->first = 0;
+	w->base = 1;
+	w->eof = 0;
+	w->map = map;
+	w->mapsize = mapsize;
+	w->len = calloc(size, sizeof(*w->len));
+	w->data = calloc(size, sizeof(*w->data));
+	w->pkts = malloc(size * slot);
+	if (w->len == NULL || w->data == NULL || w->pkts == NULL) {
+		win_free(w);
+		return -1;
+	}
+	return 0;
 }
 
-/* read-ahead */
-struct tftphdr *r_init()
+void win_free(struct window *w)
 {
-	return rw_init(1);
+	free(w->len);
+	free(w->data);
+	free(w->pkts);
+	w->len = NULL;
+	w->data = NULL;
+	w->pkts = NULL;
 }
 
-/* init for either read-ahead or write-behind */
-/* x is zero for write-behind, one for read-head */
-struct tftphdr *rw_init(int x)
+/*
+ * The i-th block of the window, oldest first, with its data length.  Only
+ * the header is there when the file is mapped.
+ */
+struct tftphdr *win_block(struct window *w, int i, int *len)
 {
-	newline = 0;			/* init crlf flag */
-	prevchar = -1;
-	bfs[0].counter = BF_ALLOC;	/* pass out the first buffer */
-	current = 0;
-	bfs[1].counter = BF_FREE;
-	nextone = x;			/* ahead or behind? */
-	return (struct tftphdr *)bfs[0].buf;
+	int slot = (w->first + i) % w->size;
+	size_t slotsize = w->map ? 4 : (size_t)w->blksize + 4;
+
+	*len = w->len[slot];
+	return (struct tftphdr *)(w->pkts + slot * slotsize);
 }
 
-/* Have emptied current buffer by sending to net and getting ack.  Free it and return
- * next buffer filled with data.
+/*
+ * Point 'iov' at the i-th block of the window, the header and the data in
+ * the map when the file is mapped.  Returns the number of iovecs used.
  */
-int readit(FILE *file, struct tftphdr **dpp, int convert)
+int win_iov(struct window *w, int i, struct iovec *iov)
 {
-	struct bf *b;
-
-	bfs[current].counter = BF_FREE;		/* free old one */
-	current = !current;			/* "incr" current */
-
-	b = &bfs[current];			/* look at new buffer */
-	if (b->counter == BF_FREE)		/* if it's empty */
-		read_ahead(file, convert);	/* fill it */
-#if 0
-	assert(b->counter != BF_FREE);		/* check */
-#endif
-	*dpp = (struct tftphdr *)b->buf;	/* set caller's ptr */
-	return b->counter;
+	int len;
+
+	iov[0].iov_base = win_block(w, i, &len);
+	if (w->map == NULL) {
+		iov[0].iov_len = len + 4;
+		return 1;
+	}
+	iov[0].iov_len = 4;
+	iov[1].iov_base = (void *)w->data[(w->first + i) % w->size];
+	iov[1].iov_len = len;
+	return 2;
 }
 
 /*
- * fill the input buffer, doing ascii conversions if requested conversions are lf ->
+ * fill one block, doing ascii conversions if requested conversions are lf ->
  * cr,lf and cr -> cr, nul
  */
-void read_ahead(FILE *file, int convert)
+static int read_block(struct window *w, int fd, FILE *file, char *p)
 {
+	char *start = p;
 	int i;
-	char *p;
 	int c;
-	struct bf *b;
-	struct tftphdr *dp;
 
-	b = &bfs[nextone];		/* look at "next" buffer */
-	if (b->counter != BF_FREE)	/* nop if not free */
-		return;
-	nextone = !nextone;		/* "incr" next buffer ptr */
+	if (w->map) {
+		off_t left = w->mapsize - w->offset;
+		int len = left < w->blksize ? (int)left : w->blksize;
 
-	dp = (struct tftphdr *)b->buf;
+		w->data[(w->first + w->count) % w->size] = w->map + w->offset;
+		w->offset += len;
+		return len;
+	}
+	if (file == NULL) {
+		ssize_t cc = pread(fd, p, w->blksize, w->offset);
 
-	if (convert == 0) {
-		b->counter = read(fileno(file), dp->th_data, SEGSIZE);
-		return;
+		if (cc > 0)
+			w->offset += cc;
+		return cc;
 	}
 
-	p = dp->th_data;
-	for (i = 0; i < SEGSIZE; i++) {
-		if (newline) {
-			if (prevchar == '\n')
+	for (i = 0; i < w->blksize; i++) {
+		if (w->newline) {
+			if (w->prevchar == '\n')
 				c = '\n';	/* lf to cr,lf */
 			else
 				c = '\0';	/* cr to cr,nul */
-			newline = 0;
+			w->newline = 0;
 		} else {
 			c = getc(file);
 			if (c == EOF)
 				break;
 			if (c == '\n' || c == '\r') {
-				prevchar = c;
+				w->prevchar = c;
 				c = '\r';
-				newline = 1;
+				w->newline = 1;
 			}
 		}
 		*p++ = c;
 	}
-	b->counter = (int)(p - dp->th_data);
+	return (int)(p - start);
 }
 
-/* Update count associated with the buffer, get new buffer from the queue.  Calls
- * write_behind only if next buffer not available.
+/*
+ * Read blocks until the window is full or the last, short, block is in.
+ * Blocks are taken from the map, converted to netascii from 'file', or read
+ * as they are from 'fd' when 'file' is NULL.  Returns -1 with errno set on
+ * read errors.
  */
-int writeit(FILE *file, struct tftphdr **dpp, int ct, int convert)
+int win_fill(struct window *w, int fd, FILE *file)
+{
+	struct tftphdr *dp;
+	int len;
+
+	while (w->count < w->size && !w->eof) {
+		dp = win_block(w, w->count, &len);
+		len = read_block(w, fd, file, dp->th_data);
+		if (len < 0)
+			return -1;
+		dp->th_opcode = htons((uint16_t)DATA);
+		dp->th_block = htons((uint16_t)(w->base + w->count));
+		w->len[(w->first + w->count) % w->size] = len;
+		w->count++;
+		if (len < w->blksize)
+			w->eof = 1;
+	}
+	return 0;
+}
+
+/* Drop the n oldest blocks, they were acknowledged. */
+void win_ack(struct window *w, int n)
 {
-	bfs[current].counter = ct;		/* set size of data to write */
-	current = !current;			/* switch to other buffer */
-	if (bfs[current].counter != BF_FREE)	/* if not free */
-		write_behind(file, convert);	/* flush it */
-	bfs[current].counter = BF_ALLOC;	/* mark as alloc'd */
-	*dpp = (struct tftphdr *)bfs[current].buf;
-	return ct;				/* this is a lie of course */
+	w->first = (w->first + n) % w->size;
+	w->count -= n;
+	w->base += n;
 }
 
 /*
- * Output a buffer to a file, converting from netascii if requested.  CR,NUL -> CR and
+ * Output a block to a file, converting from netascii if requested.  CR,NUL -> CR and
  * CR,LF => LF.  Note spec is undefined if we get CR as last byte of file or a CR
  * followed by anything else.  In this case we leave it alone.
  */
-int write_behind(FILE *file, int convert)
+int write_block(struct window *w, FILE *file, char *buf, int count, int convert)
 {
-	char *buf;
-	int count;
 	int ct;
 	char *p;
 	int c;			/* current character */
-	struct bf *b;
-	struct tftphdr *dp;
-
-	b = &bfs[nextone];
-	if (b->counter < -1)	/* anything to flush? */
-		return 0;	/* just nop if nothing to do */
-
-	count = b->counter;	/* remember byte count */
-	b->counter = BF_FREE;	/* reset flag */
-	dp = (struct tftphdr *)b->buf;
-	nextone = !nextone;	/* incr for next time */
-	buf = dp->th_data;
-
-	if (count <= 0)
-		return -1;	/* nak logic? */
 
 	if (convert == 0)
 		return write(fileno(file), buf, count);
@@ -207,7 +224,7 @@ int write_behind(FILE *file, int convert)
 	ct = count;
 	while (ct--) {				/* loop over the buffer */
 		c = *p++;			/* pick up a character */
-		if (prevchar == '\r') {		/* if prev char was cr */
+		if (w->prevchar == '\r') {	/* if prev char was cr */
 			if (c == '\n')		/* if have cr,lf then just */
 				fseek(file, -1, 1);	/* smash lf on top of the cr */
 			else if (c == '\0')	/* if have cr,nul then */
@@ -216,7 +233,7 @@ int write_behind(FILE *file, int convert)
 		}
 		putc(c, file);
  skipit:
-		prevchar = c;
+		w->prevchar = c;
 	}
 	return count;
 }
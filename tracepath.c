@@ -14,6 +14,7 @@
 #include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <resolv.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,7 +34,9 @@
 #include <linux/icmpv6.h>
 #include <linux/types.h>
 
+#include "doubletree.h"
 #include "iputils_common.h"
+#include "resolver.h"
 
 #ifdef USE_IDN
 # define getnameinfo_flags	NI_IDN
@@ -43,6 +46,7 @@
 
 enum {
 	MAX_PROBES = 10,
+	PROBE_TIMEOUT_MS = 1000,
 
 	MAX_HOPS_DEFAULT = 30,
 	MAX_HOPS_LIMIT = 255,
@@ -60,6 +64,12 @@ enum {
 	DEFAULT_BASEPORT = 44444,
 
 	ANCILLARY_DATA_LEN = 512,
+	ERRQ_BATCH = 16,
+
+	HOP_SAMPLES = 128,
+	HOP_ADDRS = 8,
+
+	DEFAULT_INTERVAL = 1,
 };
 
 struct hhistory {
@@ -72,9 +82,67 @@ struct probehdr {
 	struct timespec ts;
 };
 
+/* What recverr() needs to know about one message from the error queue. */
+struct errq_event {
+	union {
+		struct sockaddr sa;
+		struct sockaddr_in sin;
+		struct sockaddr_in6 sin6;
+	} offender;
+	struct timespec rtt;
+	int slot;
+	int sndhops;
+	int rethops;
+	int err;
+	uint32_t info;
+	uint8_t origin;
+	uint8_t type;
+	uint8_t code;
+	unsigned int
+		have_err:1,
+		have_rtt:1,
+		broken_router:1;
+};
+
+struct errq_batch {
+	struct mmsghdr msgs[ERRQ_BATCH];
+	struct iovec iov[ERRQ_BATCH];
+	struct probehdr data[ERRQ_BATCH];
+	struct sockaddr_storage addr[ERRQ_BATCH];
+	char cbuf[ERRQ_BATCH][ANCILLARY_DATA_LEN];
+	struct errq_event ev[ERRQ_BATCH];
+};
+
+struct hop_addr {
+	struct sockaddr_storage addr;
+	char name[HOST_COLUMN_SIZE];
+	unsigned long replies;
+	unsigned int
+		named:1;		/* name is final, not waiting for DNS */
+};
+
+/*
+ * Continuous mode statistics of one hop.  Everything is of fixed size, the
+ * RTT percentile is taken over a ring of the last HOP_SAMPLES replies, so
+ * memory use does not grow no matter how long tracepath runs.
+ */
+struct hop_stats {
+	unsigned long sent;
+	unsigned long received;
+	uint32_t min_us;
+	uint32_t max_us;
+	unsigned long long sum_us;
+	uint32_t samples[HOP_SAMPLES];
+	unsigned int sampleptr;
+	struct hop_addr addrs[HOP_ADDRS];
+	int naddrs;
+	unsigned long other_replies;
+};
+
 struct run_state {
 	struct hhistory his[HIS_ARRAY_SIZE];
 	int hisptr;
+	struct errq_batch errq;
 	struct sockaddr_storage target;
 	struct addrinfo *ai;
 	int socket_fd;
@@ -87,10 +155,16 @@ struct run_state {
 	void *pktbuf;
 	int hops_to;
 	int hops_from;
+	struct hop_stats *stats;
+	int nhops;
+	long rounds;
+	int interval;
 	unsigned int
 		no_resolve:1,
 		show_both:1,
-		mapped:1;
+		mapped:1,
+		continuous:1,
+		fast_pmtu:1;
 };
 
 /*
@@ -102,8 +176,8 @@ static void data_wait(struct run_state const *const ctl)
 {
 	fd_set fds;
 	struct timeval tv = {
-		.tv_sec = 1,
-		.tv_usec = 0
+		.tv_sec = PROBE_TIMEOUT_MS / 1000,
+		.tv_usec = (PROBE_TIMEOUT_MS % 1000) * 1000
 	};
 
 	FD_ZERO(&fds);
@@ -124,81 +198,106 @@ static void print_host(struct run_state const *const ctl, char const *const a,
 	printf("%*s", HOST_COLUMN_SIZE - plen, "");
 }
 
-static int recverr(struct run_state *const ctl)
+static void set_ttl(struct run_state const *const ctl, int ttl)
 {
-	ssize_t recv_size;
-	struct probehdr rcvbuf;
-	char cbuf[ANCILLARY_DATA_LEN];
-	struct cmsghdr *cmsg;
-	struct sock_extended_err *e;
-	struct sockaddr_storage addr;
-	struct timespec ts;
-	struct timespec *retts;
-	int slot = 0;
-	int rethops;
-	int sndhops;
-	int progress = -1;
-	int broken_router;
-	char hnamebuf[NI_MAXHOST] = "";
-	struct iovec iov = {
-		.iov_base = &rcvbuf,
-		.iov_len = sizeof(rcvbuf)
-	};
-	struct msghdr msg;
-	const struct msghdr reset = {
-		.msg_name = (uint8_t *)&addr,
-		.msg_namelen = sizeof(addr),
-		.msg_iov = &iov,
-		.msg_iovlen = 1,
-		.msg_control = cbuf,
-		.msg_controllen = sizeof(cbuf),
-		0
-	};
-
- restart:
-	memset(&rcvbuf, -1, sizeof(rcvbuf));
-	msg = reset;
-
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	recv_size = recvmsg(ctl->socket_fd, &msg, MSG_ERRQUEUE);
-	if (recv_size < 0) {
-		if (errno == EAGAIN)
-			return progress;
-		goto restart;
+	switch (ctl->ai->ai_family) {
+	case AF_INET6:
+		if (setsockopt(ctl->socket_fd, SOL_IPV6, IPV6_UNICAST_HOPS, &ttl, sizeof(ttl)))
+			error(1, errno, "IPV6_UNICAST_HOPS");
+		if (!ctl->mapped)
+			break;
+		/*FALLTHROUGH*/
+	case AF_INET:
+		if (setsockopt(ctl->socket_fd, SOL_IP, IP_TTL, &ttl, sizeof(ttl)))
+			error(1, errno, "IP_TTL");
 	}
+}
 
-	progress = ctl->mtu;
+/* The destination port of a probe selects its slot in the his[] array. */
+static void set_target_port(struct run_state *const ctl)
+{
+	switch (ctl->ai->ai_family) {
+	case AF_INET6:
+		((struct sockaddr_in6 *)&ctl->target)->sin6_port =
+		    htons(ctl->base_port + ctl->hisptr);
+		break;
+	case AF_INET:
+		((struct sockaddr_in *)&ctl->target)->sin_port =
+		    htons(ctl->base_port + ctl->hisptr);
+		break;
+	}
+}
 
-	rethops = -1;
-	sndhops = -1;
-	e = NULL;
-	retts = NULL;
-	broken_router = 0;
+static int his_slot(struct run_state const *const ctl,
+		    struct sockaddr_storage const *const addr)
+{
+	int slot = -ctl->base_port;
 
-	slot = -ctl->base_port;
 	switch (ctl->ai->ai_family) {
 	case AF_INET6:
-		slot += ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+		slot += ntohs(((struct sockaddr_in6 *)addr)->sin6_port);
 		break;
 	case AF_INET:
-		slot += ntohs(((struct sockaddr_in *)&addr)->sin_port);
+		slot += ntohs(((struct sockaddr_in *)addr)->sin_port);
 		break;
 	}
-	if (slot >= 0 && slot < (HIS_ARRAY_SIZE - 1) && ctl->his[slot].hops) {
-		sndhops = ctl->his[slot].hops;
+	if (slot < 0 || slot >= HIS_ARRAY_SIZE || !ctl->his[slot].hops)
+		return -1;
+	return slot;
+}
+
+static void errq_init(struct run_state *const ctl)
+{
+	struct errq_batch *const b = &ctl->errq;
+	int i;
+
+	for (i = 0; i < ERRQ_BATCH; i++) {
+		b->iov[i].iov_base = &b->data[i];
+		b->iov[i].iov_len = sizeof(b->data[i]);
+		b->msgs[i].msg_hdr.msg_name = &b->addr[i];
+		b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+		b->msgs[i].msg_hdr.msg_control = b->cbuf[i];
+	}
+}
+
+/* Turn one error queue message into an event, consuming its his[] slot. */
+static void errq_parse(struct run_state *const ctl, int idx,
+		       struct timespec const *const ts, struct errq_event *const ev)
+{
+	struct errq_batch *const b = &ctl->errq;
+	struct msghdr *const msg = &b->msgs[idx].msg_hdr;
+	struct probehdr const *const rcvbuf = &b->data[idx];
+	struct timespec const *retts = NULL;
+	struct sock_extended_err *e = NULL;
+	struct cmsghdr *cmsg;
+	int slot;
+
+	memset(ev, 0, sizeof(*ev));
+	ev->sndhops = -1;
+	ev->rethops = -1;
+
+	slot = his_slot(ctl, &b->addr[idx]);
+	ev->slot = slot;
+	if (slot >= 0) {
+		ev->sndhops = ctl->his[slot].hops;
 		retts = &ctl->his[slot].sendtime;
 		ctl->his[slot].hops = 0;
 	}
-	if (recv_size == sizeof(rcvbuf)) {
-		if (rcvbuf.ttl == 0 || rcvbuf.ts.tv_sec == 0)
-			broken_router = 1;
+	if (b->msgs[idx].msg_len == sizeof(*rcvbuf)) {
+		if (rcvbuf->ttl == 0 || rcvbuf->ts.tv_sec == 0)
+			ev->broken_router = 1;
 		else {
-			sndhops = rcvbuf.ttl;
-			retts = &rcvbuf.ts;
+			ev->sndhops = rcvbuf->ttl;
+			retts = &rcvbuf->ts;
 		}
 	}
+	if (retts) {
+		timespecsub((struct timespec *)ts, (struct timespec *)retts, &ev->rtt);
+		ev->have_rtt = 1;
+	}
 
-	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
 		switch (cmsg->cmsg_level) {
 		case SOL_IPV6:
 			switch (cmsg->cmsg_type) {
@@ -209,7 +308,7 @@ static int recverr(struct run_state *const ctl)
 #ifdef IPV6_2292HOPLIMIT
 			case IPV6_2292HOPLIMIT:
 #endif
-				memcpy(&rethops, CMSG_DATA(cmsg), sizeof(rethops));
+				memcpy(&ev->rethops, CMSG_DATA(cmsg), sizeof(ev->rethops));
 				break;
 			default:
 				printf(_("cmsg6:%d\n "), cmsg->cmsg_type);
@@ -221,27 +320,110 @@ static int recverr(struct run_state *const ctl)
 				e = (struct sock_extended_err *)CMSG_DATA(cmsg);
 				break;
 			case IP_TTL:
-				rethops = *(uint8_t *)CMSG_DATA(cmsg);
+				ev->rethops = *(uint8_t *)CMSG_DATA(cmsg);
 				break;
 			default:
 				printf(_("cmsg4:%d\n "), cmsg->cmsg_type);
 			}
 		}
 	}
-	if (e == NULL) {
+	if (e == NULL)
+		return;
+
+	ev->have_err = 1;
+	ev->err = e->ee_errno;
+	ev->origin = e->ee_origin;
+	ev->type = e->ee_type;
+	ev->code = e->ee_code;
+	ev->info = e->ee_info;
+	if (e->ee_origin == SO_EE_ORIGIN_ICMP6 || e->ee_origin == SO_EE_ORIGIN_ICMP) {
+		struct sockaddr *sa = (struct sockaddr *)(e + 1);
+
+		switch (sa->sa_family) {
+		case AF_INET6:
+			memcpy(&ev->offender.sin6, sa, sizeof(ev->offender.sin6));
+			break;
+		case AF_INET:
+			memcpy(&ev->offender.sin, sa, sizeof(ev->offender.sin));
+			break;
+		}
+	}
+}
+
+/*
+ * Drain up to ERRQ_BATCH queued errors with a single recvmmsg() into the
+ * preallocated buffers and parse them into ctl->errq.ev[].  Returns the
+ * number of events, 0 when the queue is empty.
+ */
+static int errq_read(struct run_state *const ctl)
+{
+	struct errq_batch *const b = &ctl->errq;
+	struct timespec ts;
+	int n;
+	int i;
+
+	for (i = 0; i < ERRQ_BATCH; i++) {
+		b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addr[i]);
+		b->msgs[i].msg_hdr.msg_controllen = sizeof(b->cbuf[i]);
+		b->msgs[i].msg_hdr.msg_flags = 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	do
+		n = recvmmsg(ctl->socket_fd, b->msgs, ERRQ_BATCH, MSG_ERRQUEUE, NULL);
+	while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return 0;
+
+	for (i = 0; i < n; i++)
+		errq_parse(ctl, i, &ts, &b->ev[i]);
+	return n;
+}
+
+/*
+ * Look up the name of a hop, holding its line until the name arrives for
+ * at most the probe timeout.  The numeric address is printed after that.
+ */
+static int hop_lookup(struct sockaddr const *const sa, socklen_t salen,
+		      char *const buf, size_t const len)
+{
+	struct timespec start, now, waited;
+	long left;
+	int state;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while ((state = resolver_lookup(sa, salen, buf, len)) == RESOLVER_PENDING) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timespecsub(&now, &start, &waited);
+		left = PROBE_TIMEOUT_MS - waited.tv_sec * 1000 -
+		       waited.tv_nsec / 1000000;
+		if (left <= 0)
+			break;
+		resolver_wait(left);
+	}
+	return state;
+}
+
+/* Print one hop line; returns 0 when the trace is finished. */
+static int print_event(struct run_state *const ctl, struct errq_event const *const ev)
+{
+	char hnamebuf[NI_MAXHOST] = "";
+	int rethops = ev->rethops;
+
+	if (!ev->have_err) {
 		printf(_("no info\n"));
 		return 0;
 	}
-	if (e->ee_origin == SO_EE_ORIGIN_LOCAL)
+	if (ev->origin == SO_EE_ORIGIN_LOCAL)
 		printf("%2d?: %-32s ", ctl->ttl, _("[LOCALHOST]"));
-	else if (e->ee_origin == SO_EE_ORIGIN_ICMP6 ||
-		 e->ee_origin == SO_EE_ORIGIN_ICMP) {
+	else if (ev->origin == SO_EE_ORIGIN_ICMP6 ||
+		 ev->origin == SO_EE_ORIGIN_ICMP) {
 		char abuf[NI_MAXHOST];
-		struct sockaddr *sa = (struct sockaddr *)(e + 1);
+		struct sockaddr const *sa = &ev->offender.sa;
 		socklen_t salen;
 
-		if (sndhops > 0)
-			printf("%2d:  ", sndhops);
+		if (ev->sndhops > 0)
+			printf("%2d:  ", ev->sndhops);
 		else
 			printf("%2d?: ", ctl->ttl);
 
@@ -264,9 +446,8 @@ static int recverr(struct run_state *const ctl)
 			abuf[0] = 0;
 
 		if (!ctl->no_resolve || ctl->show_both) {
-			fflush(stdout);
-			if (getnameinfo(sa, salen, hnamebuf, sizeof hnamebuf, NULL, 0,
-					getnameinfo_flags))
+			if (hop_lookup(sa, salen, hnamebuf, sizeof hnamebuf) ==
+			    RESOLVER_FAILED)
 				strcpy(hnamebuf, "???");
 		} else
 			hnamebuf[0] = 0;
@@ -277,13 +458,10 @@ static int recverr(struct run_state *const ctl)
 			print_host(ctl, hnamebuf, abuf);
 	}
 
-	if (retts) {
-		struct timespec res;
-
-		timespecsub(&ts, retts, &res);
-		printf(_("%3ld.%03ldms "), res.tv_sec * 1000 + res.tv_nsec / 1000000,
-					   (res.tv_nsec % 1000000) / 1000);
-		if (broken_router)
+	if (ev->have_rtt) {
+		printf(_("%3ld.%03ldms "), ev->rtt.tv_sec * 1000 + ev->rtt.tv_nsec / 1000000,
+					   (ev->rtt.tv_nsec % 1000000) / 1000);
+		if (ev->broken_router)
 			printf(_("(This broken router returned corrupted payload) "));
 	}
 
@@ -294,35 +472,34 @@ static int recverr(struct run_state *const ctl)
 	else
 		rethops = 256 - rethops;
 
-	switch (e->ee_errno) {
+	switch (ev->err) {
 	case ETIMEDOUT:
 		printf("\n");
 		break;
 	case EMSGSIZE:
-		printf(_("pmtu %d\n"), e->ee_info);
-		ctl->mtu = e->ee_info;
-		progress = ctl->mtu;
+		printf(_("pmtu %d\n"), ev->info);
+		ctl->mtu = ev->info;
 		break;
 	case ECONNREFUSED:
 		printf(_("reached\n"));
-		ctl->hops_to = sndhops < 0 ? ctl->ttl : sndhops;
+		ctl->hops_to = ev->sndhops < 0 ? ctl->ttl : ev->sndhops;
 		ctl->hops_from = rethops;
 		return 0;
 	case EPROTO:
 		printf("!P\n");
 		return 0;
 	case EHOSTUNREACH:
-		if ((e->ee_origin == SO_EE_ORIGIN_ICMP &&
-		     e->ee_type == ICMP_TIME_EXCEEDED &&
-		     e->ee_code == ICMP_EXC_TTL) ||
-		    (e->ee_origin == SO_EE_ORIGIN_ICMP6 &&
-		     e->ee_type == ICMPV6_TIME_EXCEED &&
-		     e->ee_code == ICMPV6_EXC_HOPLIMIT)) {
+		if ((ev->origin == SO_EE_ORIGIN_ICMP &&
+		     ev->type == ICMP_TIME_EXCEEDED &&
+		     ev->code == ICMP_EXC_TTL) ||
+		    (ev->origin == SO_EE_ORIGIN_ICMP6 &&
+		     ev->type == ICMPV6_TIME_EXCEED &&
+		     ev->code == ICMPV6_EXC_HOPLIMIT)) {
 			if (rethops >= 0) {
-				if (sndhops >= 0 && rethops != sndhops)
+				if (ev->sndhops >= 0 && rethops != ev->sndhops)
 					printf(_("asymm %2d "), rethops);
 
-				if (sndhops < 0 && rethops != ctl->ttl)
+				if (ev->sndhops < 0 && rethops != ctl->ttl)
 					printf(_("asymm %2d "), rethops);
 			}
 			printf("\n");
@@ -338,10 +515,26 @@ static int recverr(struct run_state *const ctl)
 		return 0;
 	default:
 		printf("\n");
-		error(0, e->ee_errno, _("NET ERROR"));
+		error(0, ev->err, _("NET ERROR"));
 		return 0;
 	}
-	goto restart;
+	return 1;
+}
+
+static int recverr(struct run_state *const ctl)
+{
+	int progress = -1;
+	int n;
+	int i;
+
+	while ((n = errq_read(ctl)) > 0) {
+		for (i = 0; i < n; i++) {
+			if (!print_event(ctl, &ctl->errq.ev[i]))
+				return 0;
+		}
+		progress = ctl->mtu;
+	}
+	return progress;
 }
 
 static int probe_ttl(struct run_state *const ctl)
@@ -355,16 +548,7 @@ static int probe_ttl(struct run_state *const ctl)
 		int res;
 
 		hdr->ttl = ctl->ttl;
-		switch (ctl->ai->ai_family) {
-		case AF_INET6:
-			((struct sockaddr_in6 *)&ctl->target)->sin6_port =
-			    htons(ctl->base_port + ctl->hisptr);
-			break;
-		case AF_INET:
-			((struct sockaddr_in *)&ctl->target)->sin_port =
-			    htons(ctl->base_port + ctl->hisptr);
-			break;
-		}
+		set_target_port(ctl);
 		clock_gettime(CLOCK_MONOTONIC, &hdr->ts);
 		ctl->his[ctl->hisptr].hops = ctl->ttl;
 		ctl->his[ctl->hisptr].sendtime = hdr->ts;
@@ -393,18 +577,775 @@ static int probe_ttl(struct run_state *const ctl)
 	return 0;
 }
 
+static int sockaddr_addr_equal(struct sockaddr const *const a,
+			       struct sockaddr const *const b)
+{
+	if (a->sa_family != b->sa_family)
+		return 0;
+	switch (a->sa_family) {
+	case AF_INET6:
+		return !memcmp(&((struct sockaddr_in6 *)a)->sin6_addr,
+			       &((struct sockaddr_in6 *)b)->sin6_addr,
+			       sizeof(struct in6_addr));
+	case AF_INET:
+		return ((struct sockaddr_in *)a)->sin_addr.s_addr ==
+		       ((struct sockaddr_in *)b)->sin_addr.s_addr;
+	}
+	return 0;
+}
+
+/*
+ * Returns 0 if the name is still being looked up and the numeric address
+ * was used in its place.
+ */
+static int hop_name(struct run_state const *const ctl, struct sockaddr const *const sa,
+		    char *const buf, size_t const len)
+{
+	char abuf[NI_MAXHOST];
+	char hnamebuf[NI_MAXHOST];
+	socklen_t salen;
+	int state;
+
+	salen = sa->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) :
+					    sizeof(struct sockaddr_in);
+	if (getnameinfo(sa, salen, abuf, sizeof(abuf), NULL, 0, NI_NUMERICHOST))
+		strcpy(abuf, "???");
+	if (ctl->no_resolve && !ctl->show_both) {
+		snprintf(buf, len, "%s", abuf);
+		return 1;
+	}
+	state = resolver_lookup(sa, salen, hnamebuf, sizeof(hnamebuf));
+	if (state == RESOLVER_FAILED)
+		strcpy(hnamebuf, "???");
+	if (!ctl->show_both)
+		snprintf(buf, len, "%s", hnamebuf);
+	else if (ctl->no_resolve)
+		snprintf(buf, len, "%s (%s)", abuf, hnamebuf);
+	else
+		snprintf(buf, len, "%s (%s)", hnamebuf, abuf);
+	return state != RESOLVER_PENDING;
+}
+
+static void hop_stats_update(struct run_state const *const ctl, int hop,
+			     struct sockaddr const *const sa,
+			     struct timespec const *const rtt)
+{
+	struct hop_stats *hs = &ctl->stats[hop];
+	uint32_t us;
+	int i;
+
+	us = rtt->tv_sec * 1000000 + rtt->tv_nsec / 1000;
+	if (!hs->received || us < hs->min_us)
+		hs->min_us = us;
+	if (us > hs->max_us)
+		hs->max_us = us;
+	hs->sum_us += us;
+	hs->received++;
+	hs->samples[hs->sampleptr++ % HOP_SAMPLES] = us;
+	if (hs->sampleptr == 2 * HOP_SAMPLES)
+		hs->sampleptr = HOP_SAMPLES;
+
+	for (i = 0; i < hs->naddrs; i++) {
+		if (sockaddr_addr_equal(sa, (struct sockaddr *)&hs->addrs[i].addr)) {
+			hs->addrs[i].replies++;
+			return;
+		}
+	}
+	if (hs->naddrs == HOP_ADDRS) {
+		hs->other_replies++;
+		return;
+	}
+	memcpy(&hs->addrs[i].addr, sa, sa->sa_family == AF_INET6 ?
+	       sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+	hs->addrs[i].named = hop_name(ctl, sa, hs->addrs[i].name, sizeof(hs->addrs[i].name));
+	hs->addrs[i].replies = 1;
+	hs->naddrs++;
+}
+
+static void stats_event(struct run_state *const ctl, struct errq_event const *const ev)
+{
+	if (!ev->have_err)
+		return;
+	if (ev->err == EMSGSIZE) {
+		/* The probe was dropped on the way, shrink the next ones. */
+		ctl->mtu = ev->info;
+		return;
+	}
+	if (ev->origin != SO_EE_ORIGIN_ICMP6 && ev->origin != SO_EE_ORIGIN_ICMP)
+		return;
+	/* Replies to an earlier round were counted as lost there. */
+	if (ev->slot < 0)
+		return;
+	if (ev->sndhops < 1 || ev->sndhops > ctl->nhops || !ev->have_rtt)
+		return;
+	hop_stats_update(ctl, ev->sndhops, &ev->offender.sa, &ev->rtt);
+}
+
+/* Drain the error queue and account each ICMP error to the probed hop. */
+static void stats_recverr(struct run_state *const ctl)
+{
+	int n;
+	int i;
+
+	while ((n = errq_read(ctl)) > 0) {
+		for (i = 0; i < n; i++)
+			stats_event(ctl, &ctl->errq.ev[i]);
+	}
+}
+
+static void stats_probe(struct run_state *const ctl, int hop)
+{
+	struct probehdr *hdr = ctl->pktbuf;
+	int i;
+
+	set_ttl(ctl, hop);
+	for (i = 0; i < MAX_PROBES; i++) {
+		hdr->ttl = hop;
+		set_target_port(ctl);
+		clock_gettime(CLOCK_MONOTONIC, &hdr->ts);
+		ctl->his[ctl->hisptr].hops = hop;
+		ctl->his[ctl->hisptr].sendtime = hdr->ts;
+		if (sendto(ctl->socket_fd, ctl->pktbuf, ctl->mtu - ctl->overhead, 0,
+			   (struct sockaddr *)&ctl->target, ctl->targetlen) > 0)
+			break;
+		ctl->his[ctl->hisptr].hops = 0;
+		stats_recverr(ctl);
+	}
+	ctl->hisptr = (ctl->hisptr + 1) & (HIS_ARRAY_SIZE - 1);
+	if (i < MAX_PROBES)
+		ctl->stats[hop].sent++;
+}
+
+static int cmp_uint32(const void *a, const void *b)
+{
+	uint32_t const x = *(uint32_t const *)a;
+	uint32_t const y = *(uint32_t const *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Pick up the names that arrived since the addresses were first seen. */
+static void stats_names(struct run_state *const ctl)
+{
+	int hop;
+	int i;
+
+	for (hop = 1; hop <= ctl->nhops; hop++) {
+		struct hop_stats *hs = &ctl->stats[hop];
+
+		for (i = 0; i < hs->naddrs; i++) {
+			struct hop_addr *ha = &hs->addrs[i];
+
+			if (!ha->named)
+				ha->named = hop_name(ctl, (struct sockaddr *)&ha->addr,
+						     ha->name, sizeof(ha->name));
+		}
+	}
+}
+
+static void stats_print(struct run_state const *const ctl, long round)
+{
+	uint32_t sorted[HOP_SAMPLES];
+	int hop;
+	int i;
+
+	if (isatty(STDOUT_FILENO))
+		printf("\033[H\033[J");
+	printf(_("Round %ld, pmtu %d\n"), round, ctl->mtu);
+	printf("%-*s %6s %6s %6s %8s %8s %8s %8s\n", HOST_COLUMN_SIZE + 5, _(" Hop"),
+	       _("Loss%"), _("Snt"), _("Rcv"), _("Min"), _("Avg"), _("P95"), _("Max"));
+	for (hop = 1; hop <= ctl->nhops; hop++) {
+		struct hop_stats const *hs = &ctl->stats[hop];
+		unsigned int n;
+
+		printf("%3d:  ", hop);
+		if (!hs->received) {
+			printf("%-*s %5.1f%% %6lu %6lu\n", HOST_COLUMN_SIZE - 1, _("no reply"),
+			       hs->sent ? 100.0 : 0.0, hs->sent, hs->received);
+			continue;
+		}
+		n = hs->sampleptr < HOP_SAMPLES ? hs->sampleptr : HOP_SAMPLES;
+		memcpy(sorted, hs->samples, n * sizeof(sorted[0]));
+		qsort(sorted, n, sizeof(sorted[0]), cmp_uint32);
+		printf("%-*.*s %5.1f%% %6lu %6lu %8.3f %8.3f %8.3f %8.3f\n",
+		       HOST_COLUMN_SIZE - 1, HOST_COLUMN_SIZE - 1, hs->addrs[0].name,
+		       hs->sent > hs->received ?
+				100.0 * (hs->sent - hs->received) / hs->sent : 0.0,
+		       hs->sent, hs->received,
+		       hs->min_us / 1000.0,
+		       (double)hs->sum_us / hs->received / 1000.0,
+		       sorted[(n * 95 + 99) / 100 - 1] / 1000.0,
+		       hs->max_us / 1000.0);
+		/* Further responders of the same hop reveal ECMP. */
+		for (i = 1; i < hs->naddrs; i++)
+			printf("      %-*.*s %lu\n", HOST_COLUMN_SIZE - 1, HOST_COLUMN_SIZE - 1,
+			       hs->addrs[i].name, hs->addrs[i].replies);
+		if (hs->other_replies)
+			printf(_("      %-*s %lu\n"), HOST_COLUMN_SIZE - 1, _("[other addresses]"),
+			       hs->other_replies);
+	}
+	fflush(stdout);
+}
+
+/*
+ * Probe every hop up to ctl->nhops once per round and refresh the summary
+ * table at the end of each round, forever when ctl->rounds is zero.
+ */
+static void run_continuous(struct run_state *const ctl)
+{
+	struct timespec now;
+	struct timespec deadline;
+	struct timespec left;
+	struct timeval tv;
+	fd_set fds;
+	long round;
+	int hop;
+
+	ctl->stats = calloc(ctl->nhops + 1, sizeof(*ctl->stats));
+	if (!ctl->stats)
+		error(1, errno, "calloc");
+
+	for (round = 1; !ctl->rounds || round <= ctl->rounds; round++) {
+		/*
+		 * Rounds use alternate halves of his[], so that a late reply
+		 * to the previous round finds its slot cleared, rather than
+		 * armed again for another hop.
+		 */
+		memset(ctl->his, 0, sizeof(ctl->his));
+		ctl->hisptr = (round & 1) * (HIS_ARRAY_SIZE / 2);
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += ctl->interval;
+
+		for (hop = 1; hop <= ctl->nhops; hop++)
+			stats_probe(ctl, hop);
+
+		for (;;) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			timespecsub(&deadline, &now, &left);
+			if (left.tv_sec < 0)
+				break;
+			tv.tv_sec = left.tv_sec;
+			tv.tv_usec = left.tv_nsec / 1000;
+			FD_ZERO(&fds);
+			FD_SET(ctl->socket_fd, &fds);
+			if (select(ctl->socket_fd + 1, &fds, NULL, NULL, &tv) <= 0)
+				continue;
+			stats_recverr(ctl);
+			while (recv(ctl->socket_fd, ctl->pktbuf, ctl->mtu, MSG_DONTWAIT) > 0)
+				;
+		}
+		stats_names(ctl);
+		stats_print(ctl, round);
+	}
+	free(ctl->stats);
+}
+
+static int setup_socket(struct run_state *const ctl)
+{
+	int on;
+
+	switch (ctl->ai->ai_family) {
+	case AF_INET6:
+		ctl->overhead = DEFAULT_OVERHEAD_IPV6;
+		if (!ctl->mtu)
+			ctl->mtu = DEFAULT_MTU_IPV6;
+		if (ctl->mtu <= ctl->overhead)
+			return -1;
+
+		on = IPV6_PMTUDISC_DO;
+		if (setsockopt(ctl->socket_fd, SOL_IPV6, IPV6_MTU_DISCOVER, &on, sizeof(on)) &&
+		    (on = IPV6_PMTUDISC_DO, setsockopt(ctl->socket_fd, SOL_IPV6,
+		     IPV6_MTU_DISCOVER, &on, sizeof(on))))
+			error(1, errno, "IPV6_MTU_DISCOVER");
+		on = 1;
+		if (setsockopt(ctl->socket_fd, SOL_IPV6, IPV6_RECVERR, &on, sizeof(on)))
+			error(1, errno, "IPV6_RECVERR");
+		if (setsockopt(ctl->socket_fd, SOL_IPV6, IPV6_HOPLIMIT, &on, sizeof(on))
+#ifdef IPV6_RECVHOPLIMIT
+		    && setsockopt(ctl->socket_fd, SOL_IPV6, IPV6_2292HOPLIMIT, &on, sizeof(on))
+#endif
+		    )
+			error(1, errno, "IPV6_HOPLIMIT");
+		if (!IN6_IS_ADDR_V4MAPPED(&(((struct sockaddr_in6 *)&ctl->target)->sin6_addr)))
+			break;
+		ctl->mapped = 1;
+		/*FALLTHROUGH*/
+	case AF_INET:
+		ctl->overhead = DEFAULT_OVERHEAD_IPV4;
+		if (!ctl->mtu)
+			ctl->mtu = DEFAULT_MTU_IPV4;
+		if (ctl->mtu <= ctl->overhead)
+			return -1;
+
+		on = IP_PMTUDISC_DO;
+		if (setsockopt(ctl->socket_fd, SOL_IP, IP_MTU_DISCOVER, &on, sizeof(on)))
+			error(1, errno, "IP_MTU_DISCOVER");
+		on = 1;
+		if (setsockopt(ctl->socket_fd, SOL_IP, IP_RECVERR, &on, sizeof(on)))
+			error(1, errno, "IP_RECVERR");
+		if (setsockopt(ctl->socket_fd, SOL_IP, IP_RECVTTL, &on, sizeof(on)))
+			error(1, errno, "IP_RECVTTL");
+	}
+	return 0;
+}
+
+struct dt_dest {
+	struct run_state ctl;
+	struct addrinfo *result;
+	struct dt_trace trace;
+	struct probehdr probe;
+	struct timespec deadline;
+	char name[NI_MAXHOST];
+	unsigned int active:1;
+};
+
+static int dt_open(struct dt_dest *const d, struct run_state const *const proto,
+		   struct addrinfo const *const hints, char const *const name, int midpoint)
+{
+	struct run_state *const ctl = &d->ctl;
+	char pbuf[NI_MAXSERV];
+	int status;
+
+	memset(ctl, 0, sizeof(*ctl));
+	ctl->base_port = proto->base_port;
+	ctl->max_hops = proto->max_hops;
+	ctl->socket_fd = -1;
+	sprintf(pbuf, "%u", ctl->base_port);
+	status = getaddrinfo(name, pbuf, hints, &d->result);
+	if (status || !d->result) {
+		error(0, 0, "%s: %s", name, gai_strerror(status));
+		return -1;
+	}
+	for (ctl->ai = d->result; ctl->ai; ctl->ai = ctl->ai->ai_next) {
+		if (ctl->ai->ai_family != AF_INET6 && ctl->ai->ai_family != AF_INET)
+			continue;
+		ctl->socket_fd = socket(ctl->ai->ai_family, ctl->ai->ai_socktype,
+					ctl->ai->ai_protocol);
+		if (ctl->socket_fd < 0)
+			continue;
+		memcpy(&ctl->target, ctl->ai->ai_addr, ctl->ai->ai_addrlen);
+		ctl->targetlen = ctl->ai->ai_addrlen;
+		break;
+	}
+	if (ctl->socket_fd < 0) {
+		error(0, errno, "%s: socket", name);
+		freeaddrinfo(d->result);
+		return -1;
+	}
+	setup_socket(ctl);
+	/* Topology discovery does not care about PMTU, keep probes small. */
+	ctl->mtu = ctl->overhead + sizeof(d->probe);
+	ctl->pktbuf = &d->probe;
+	errq_init(ctl);
+
+	snprintf(d->name, sizeof(d->name), "%s", name);
+	dt_start(&d->trace, (struct sockaddr *)&ctl->target, midpoint, ctl->max_hops);
+	d->active = 1;
+	return 0;
+}
+
+static void dt_send(struct dt_dest *const d)
+{
+	struct run_state *const ctl = &d->ctl;
+
+	set_ttl(ctl, d->trace.ttl);
+	d->probe.ttl = d->trace.ttl;
+	set_target_port(ctl);
+	clock_gettime(CLOCK_MONOTONIC, &d->probe.ts);
+	ctl->his[ctl->hisptr].hops = d->trace.ttl;
+	ctl->his[ctl->hisptr].sendtime = d->probe.ts;
+	ctl->hisptr = (ctl->hisptr + 1) & (HIS_ARRAY_SIZE - 1);
+	d->trace.probes++;
+
+	/* A failed send is retried like a lost probe. */
+	sendto(ctl->socket_fd, ctl->pktbuf, ctl->mtu - ctl->overhead, 0,
+	       (struct sockaddr *)&ctl->target, ctl->targetlen);
+
+	d->deadline = d->probe.ts;
+	d->deadline.tv_sec += DT_TIMEOUT_MS / 1000;
+	d->deadline.tv_nsec += (DT_TIMEOUT_MS % 1000) * 1000000L;
+	if (d->deadline.tv_nsec >= 1000000000L) {
+		d->deadline.tv_sec++;
+		d->deadline.tv_nsec -= 1000000000L;
+	}
+}
+
+static void dt_close(struct dt_dest *const d, struct doubletree *const dt)
+{
+	dt_finish(dt, &d->trace);
+	printf("%s: ", d->name);
+	if (d->trace.reached)
+		printf(_("hops %d "), d->trace.reached);
+	else if (!d->trace.stopped)
+		printf(_("not reached "));
+	if (d->trace.merged)
+		printf(_("merged %d "), d->trace.merged);
+	if (d->trace.stopped)
+		printf(_("stopped %d "), d->trace.stopped);
+	printf(_("probes %d\n"), d->trace.probes);
+
+	close(d->ctl.socket_fd);
+	freeaddrinfo(d->result);
+	d->active = 0;
+}
+
+static int dt_hop_kind(struct errq_event const *const ev)
+{
+	switch (ev->err) {
+	case ECONNREFUSED:
+		return DT_HOP_REACHED;
+	case EHOSTUNREACH:
+		if ((ev->origin == SO_EE_ORIGIN_ICMP &&
+		     ev->type == ICMP_TIME_EXCEEDED &&
+		     ev->code == ICMP_EXC_TTL) ||
+		    (ev->origin == SO_EE_ORIGIN_ICMP6 &&
+		     ev->type == ICMPV6_TIME_EXCEED &&
+		     ev->code == ICMPV6_EXC_HOPLIMIT))
+			return DT_HOP_TRANSIT;
+		/* fall through */
+	default:
+		return DT_HOP_UNREACH;
+	}
+}
+
+static void dt_input(struct dt_dest *const d, struct doubletree *const dt)
+{
+	struct run_state *const ctl = &d->ctl;
+	struct errq_event const *ev;
+	int n;
+	int i;
+
+	while (recv(ctl->socket_fd, &d->probe, sizeof(d->probe), MSG_DONTWAIT) > 0)
+		;
+	while ((n = errq_read(ctl)) > 0) {
+		for (i = 0; i < n; i++) {
+			ev = &ctl->errq.ev[i];
+			if (!ev->have_err || ev->sndhops != d->trace.ttl ||
+			    (ev->origin != SO_EE_ORIGIN_ICMP6 &&
+			     ev->origin != SO_EE_ORIGIN_ICMP) ||
+			    ev->err == EMSGSIZE || ev->err == ETIMEDOUT)
+				continue;
+			if (dt_reply(dt, &d->trace, &ev->offender.sa, ev->sndhops,
+				     dt_hop_kind(ev)))
+				dt_send(d);
+			else {
+				dt_close(d, dt);
+				return;
+			}
+		}
+	}
+}
+
+/*
+ * Batch mode: trace every destination listed in 'in', DT_WINDOW of them
+ * at a time, each over a socket of its own, sharing one Doubletree stop set.
+ */
+static void run_doubletree(struct run_state const *const proto,
+			   struct addrinfo const *const hints, FILE *in, int midpoint)
+{
+	struct doubletree dt;
+	struct dt_dest *dests;
+	struct pollfd pfd[DT_WINDOW];
+	struct timespec now;
+	struct timespec left;
+	char line[NI_MAXHOST];
+	int more = 1;
+	int active;
+	int timeout;
+	int i;
+
+	doubletree_init(&dt);
+	dests = calloc(DT_WINDOW, sizeof(*dests));
+	if (!dests)
+		error(1, errno, "calloc");
+
+	for (;;) {
+		active = 0;
+		for (i = 0; i < DT_WINDOW; i++) {
+			while (!dests[i].active && more) {
+				if (!fgets(line, sizeof(line), in)) {
+					more = 0;
+					break;
+				}
+				line[strcspn(line, " \t\r\n#")] = '\0';
+				if (line[0] && !dt_open(&dests[i], proto, hints, line, midpoint))
+					dt_send(&dests[i]);
+			}
+			pfd[i].fd = dests[i].active ? dests[i].ctl.socket_fd : -1;
+			pfd[i].events = POLLIN;
+			active += dests[i].active;
+		}
+		if (!active)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timeout = DT_TIMEOUT_MS;
+		for (i = 0; i < DT_WINDOW; i++) {
+			if (!dests[i].active)
+				continue;
+			timespecsub(&dests[i].deadline, &now, &left);
+			if (left.tv_sec < 0)
+				timeout = 0;
+			else if (left.tv_sec * 1000 + left.tv_nsec / 1000000 < timeout)
+				timeout = left.tv_sec * 1000 + left.tv_nsec / 1000000;
+		}
+		if (poll(pfd, DT_WINDOW, timeout) < 0 && errno != EINTR)
+			error(1, errno, "poll");
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (i = 0; i < DT_WINDOW; i++) {
+			struct dt_dest *const d = &dests[i];
+
+			if (d->active && pfd[i].revents)
+				dt_input(d, &dt);
+			if (!d->active)
+				continue;
+			timespecsub(&d->deadline, &now, &left);
+			if (left.tv_sec >= 0)
+				continue;
+			if (dt_timeout(&d->trace))
+				dt_send(d);
+			else
+				dt_close(d, &dt);
+		}
+	}
+
+	doubletree_print(&dt);
+	doubletree_free(&dt);
+	free(dests);
+}
+
+/* Common link MTUs probed at once by -P, largest first. */
+static const int pmtu_ladder[] = {
+	9000, 4352, 1500, 1492, 1480, 1460, 1400, 1280, 1006, 576
+};
+
+struct pmtu_probe {
+	int size;
+	int ttl;
+	struct errq_event ev;
+	unsigned int
+		ladder:1,
+		answered:1;
+};
+
+/* The MTU of the route to the target as cached by the kernel. */
+static int route_mtu(struct run_state const *const ctl)
+{
+	int mtu = ctl->mtu;
+	socklen_t len = sizeof(mtu);
+	int fd;
+
+	fd = socket(ctl->ai->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+	if (fd < 0)
+		return ctl->mtu;
+	if (!connect(fd, (struct sockaddr *)&ctl->target, ctl->targetlen)) {
+		if (ctl->ai->ai_family == AF_INET6)
+			getsockopt(fd, SOL_IPV6, IPV6_MTU, &mtu, &len);
+		else
+			getsockopt(fd, SOL_IP, IP_MTU, &mtu, &len);
+	}
+	close(fd);
+	return mtu < ctl->mtu ? mtu : ctl->mtu;
+}
+
+static void pmtu_send(struct run_state *const ctl, struct pmtu_probe *const probes,
+		      int ttl, int size, int ladder)
+{
+	struct probehdr *hdr = ctl->pktbuf;
+	struct pmtu_probe *p = &probes[ctl->hisptr];
+
+	set_ttl(ctl, ttl);
+	hdr->ttl = ttl;
+	set_target_port(ctl);
+	clock_gettime(CLOCK_MONOTONIC, &hdr->ts);
+	ctl->his[ctl->hisptr].hops = ttl;
+	ctl->his[ctl->hisptr].sendtime = hdr->ts;
+	memset(p, 0, sizeof(*p));
+	p->size = size;
+	p->ttl = ttl;
+	p->ladder = ladder;
+	/* Oversized probes fail with a local error which is read as a reply. */
+	sendto(ctl->socket_fd, ctl->pktbuf, size - ctl->overhead, 0,
+	       (struct sockaddr *)&ctl->target, ctl->targetlen);
+	ctl->hisptr = (ctl->hisptr + 1) & (HIS_ARRAY_SIZE - 1);
+}
+
+/*
+ * Accelerated Path MTU discovery.  Instead of shrinking the probe one RTT
+ * at a time, send probes of all ladder sizes up to the cached route MTU at
+ * full TTL, and small probes for every TTL, all at once.  The smallest MTU
+ * reported in the resulting "fragmentation needed" errors is the PMTU, and
+ * the small probes map the routers reporting it to their hops.
+ */
+static void fast_pmtu(struct run_state *const ctl)
+{
+	struct pmtu_probe probes[HIS_ARRAY_SIZE];
+	int sizes[ARRAY_SIZE(pmtu_ladder) + 1];
+	struct timespec deadline;
+	struct timespec now;
+	struct timespec left;
+	struct timeval tv;
+	fd_set fds;
+	int nsizes = 0;
+	int nprobes = 0;
+	int answered = 0;
+	int reached = 0;
+	int hops = 0;
+	int last_transit = 0;
+	int pmtu;
+	int ttl;
+	int slot;
+	size_t i;
+
+	pmtu = route_mtu(ctl);
+	printf("%2d?: %-32s ", 1, _("[LOCALHOST]"));
+	printf(_("pmtu %d\n"), pmtu);
+
+	sizes[nsizes++] = pmtu;
+	for (i = 0; i < ARRAY_SIZE(pmtu_ladder); i++) {
+		if (pmtu_ladder[i] < pmtu &&
+		    pmtu_ladder[i] > ctl->overhead + (int)sizeof(struct probehdr))
+			sizes[nsizes++] = pmtu_ladder[i];
+	}
+
+	/*
+	 * The small TTL sweep goes first, so that its time exceeded errors
+	 * are not eaten by ICMP rate limits after the ladder hits a router.
+	 */
+	memset(ctl->his, 0, sizeof(ctl->his));
+	ctl->hisptr = 0;
+	for (ttl = 1; ttl <= ctl->max_hops && ttl + nsizes <= HIS_ARRAY_SIZE; ttl++, nprobes++)
+		pmtu_send(ctl, probes, ttl, ctl->overhead + sizeof(struct probehdr), 0);
+	for (i = 0; i < (size_t)nsizes; i++, nprobes++)
+		pmtu_send(ctl, probes, ctl->max_hops, sizes[i], 1);
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += DEFAULT_INTERVAL;
+	while (answered < nprobes) {
+		int n;
+		int j;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timespecsub(&deadline, &now, &left);
+		if (left.tv_sec < 0)
+			break;
+		tv.tv_sec = left.tv_sec;
+		tv.tv_usec = left.tv_nsec / 1000;
+		FD_ZERO(&fds);
+		FD_SET(ctl->socket_fd, &fds);
+		if (select(ctl->socket_fd + 1, &fds, NULL, NULL, &tv) <= 0)
+			continue;
+		while (recv(ctl->socket_fd, ctl->pktbuf, ctl->mtu, MSG_DONTWAIT) > 0)
+			;
+		while ((n = errq_read(ctl)) > 0) {
+			for (j = 0; j < n; j++) {
+				struct errq_event const *ev = &ctl->errq.ev[j];
+				struct pmtu_probe *p;
+
+				/*
+				 * Local errors of probes that became too big
+				 * while the ladder was sent carry no port.
+				 */
+				if (!ev->have_err || ev->slot < 0)
+					continue;
+				p = &probes[ev->slot];
+				p->answered = 1;
+				p->ev = *ev;
+				answered++;
+				if (ev->err != ECONNREFUSED || reached)
+					continue;
+				/*
+				 * Everything closer than the destination has
+				 * answered by now or will in one more RTT.
+				 */
+				reached = 1;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				timespecsub(&now, &ctl->his[0].sendtime, &left);
+				deadline.tv_sec = now.tv_sec + left.tv_sec;
+				deadline.tv_nsec = now.tv_nsec + left.tv_nsec;
+				if (deadline.tv_nsec >= 1000000000L) {
+					deadline.tv_sec++;
+					deadline.tv_nsec -= 1000000000L;
+				}
+			}
+		}
+	}
+
+	/* The destination rate limits its port unreachables, use both ends. */
+	for (slot = 0; slot < nprobes; slot++) {
+		struct pmtu_probe const *p = &probes[slot];
+
+		if (!p->answered || p->ladder)
+			continue;
+		if (p->ev.err == ECONNREFUSED && (!hops || p->ttl < hops))
+			hops = p->ttl;
+		else if (p->ev.err == EHOSTUNREACH && p->ttl > last_transit)
+			last_transit = p->ttl;
+	}
+	if (last_transit && (!hops || last_transit + 1 < hops))
+		hops = last_transit + 1;
+	if (hops && reached)
+		ctl->hops_to = hops;
+
+	/* Report every bottleneck, from the largest MTU down. */
+	for (;;) {
+		struct errq_event const *worst = NULL;
+		int hop = -1;
+		char name[HOST_COLUMN_SIZE];
+
+		for (slot = 0; slot < nprobes; slot++) {
+			struct errq_event const *ev = &probes[slot].ev;
+
+			if (probes[slot].answered && probes[slot].ladder &&
+			    ev->err == EMSGSIZE && (int)ev->info < pmtu &&
+			    (!worst || ev->info > worst->info))
+				worst = ev;
+		}
+		if (!worst)
+			break;
+		pmtu = worst->info;
+		if (worst->origin == SO_EE_ORIGIN_LOCAL) {
+			printf("%2d?: %-32s ", 1, _("[LOCALHOST]"));
+			printf(_("pmtu %d\n"), pmtu);
+			continue;
+		}
+		for (slot = 0; slot < nprobes; slot++) {
+			struct pmtu_probe const *p = &probes[slot];
+
+			if (p->answered && !p->ladder && (hop < 0 || p->ttl < hop) &&
+			    sockaddr_addr_equal(&p->ev.offender.sa, &worst->offender.sa))
+				hop = p->ttl;
+		}
+		if (hop > 0)
+			printf("%2d:  ", hop);
+		else
+			printf(" ?:  ");
+		hop_name(ctl, &worst->offender.sa, name, sizeof(name));
+		printf("%-*s", HOST_COLUMN_SIZE, name);
+		printf(_("pmtu %d\n"), pmtu);
+	}
+	ctl->mtu = pmtu;
+}
+
 static void usage(void)
 {
 	fprintf(stderr, _(
 		"\nUsage\n"
 		"  tracepath [options] <destination>\n"
+		"  tracepath [options] -F <file>\n"
 		"\nOptions:\n"
 		"  -4             use IPv4\n"
 		"  -6             use IPv6\n"
 		"  -b             print both name and ip\n"
+		"  -F <file>      trace all destinations listed in <file>\n"
+		"  -H <hop>       first hop probed in -F mode\n"
+		"  -c <count>     keep probing all hops for <count> rounds, 0 for ever\n"
+		"  -i <interval>  seconds between rounds of continuous mode\n"
 		"  -l <length>    use packet <length>\n"
 		"  -m <hops>      use maximum <hops>\n"
 		"  -n             no dns name resolution\n"
+		"  -P             discover pmtu with concurrent probes of common sizes\n"
 		"  -p <port>      use destination <port>\n"
 		"  -V             print version and exit\n"
 		"  <destination>  dns name or ip address\n"
@@ -418,6 +1359,7 @@ int main(int argc, char **argv)
 		.max_hops = MAX_HOPS_DEFAULT,
 		.hops_to = -1,
 		.hops_from = -1,
+		.interval = DEFAULT_INTERVAL,
 		0
 	};
 	struct addrinfo hints = {
@@ -431,9 +1373,10 @@ int main(int argc, char **argv)
 	struct addrinfo *result;
 	int ch;
 	int status;
-	int on;
 	char *p;
 	char pbuf[NI_MAXSERV];
+	char *batch = NULL;
+	int midpoint = DT_MIDPOINT_DEFAULT;
 
 	atexit(close_stdout);
 #if defined(USE_IDN) || defined(ENABLE_NLS)
@@ -450,7 +1393,7 @@ int main(int argc, char **argv)
 	else if (argv[0][strlen(argv[0]) - 1] == '6')
 		hints.ai_family = AF_INET6;
 
-	while ((ch = getopt(argc, argv, "46nbh?l:m:p:V")) != EOF) {
+	while ((ch = getopt(argc, argv, "46nbc:F:h?H:i:l:m:p:PV")) != EOF) {
 		switch (ch) {
 		case '4':
 			if (hints.ai_family == AF_INET6)
@@ -468,6 +1411,19 @@ int main(int argc, char **argv)
 		case 'b':
 			ctl.show_both = 1;
 			break;
+		case 'c':
+			ctl.continuous = 1;
+			ctl.rounds = strtol_or_err(optarg, _("invalid argument"), 0, LONG_MAX);
+			break;
+		case 'F':
+			batch = optarg;
+			break;
+		case 'H':
+			midpoint = strtol_or_err(optarg, _("invalid argument"), 1, MAX_HOPS_LIMIT);
+			break;
+		case 'i':
+			ctl.interval = strtol_or_err(optarg, _("invalid argument"), 1, INT_MAX);
+			break;
 		case 'l':
 			ctl.mtu = strtol_or_err(optarg, _("invalid argument"), ctl.overhead, INT_MAX);
 			break;
@@ -477,6 +1433,9 @@ int main(int argc, char **argv)
 		case 'p':
 			ctl.base_port = strtol_or_err(optarg, _("invalid argument"), 0, UINT16_MAX);
 			break;
+		case 'P':
+			ctl.fast_pmtu = 1;
+			break;
 		case 'V':
 			printf(IPUTILS_VERSION("tracepath"));
 			return 0;
@@ -488,6 +1447,22 @@ int main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
+	if (batch) {
+		FILE *in = stdin;
+
+		if (argc != 0)
+			usage();
+		if (ctl.continuous || ctl.fast_pmtu)
+			error(2, 0, _("-F cannot be combined with -c or -P"));
+		if (!ctl.base_port)
+			ctl.base_port = DEFAULT_BASEPORT;
+		if (strcmp(batch, "-") && !(in = fopen(batch, "r")))
+			error(1, errno, "%s", batch);
+		run_doubletree(&ctl, &hints, in, midpoint);
+		if (in != stdin)
+			fclose(in);
+		exit(0);
+	}
 	if (argc != 1)
 		usage();
 
@@ -521,69 +1496,27 @@ int main(int argc, char **argv)
 	if (ctl.socket_fd < 0)
 		error(1, errno, "socket/connect");
 
-	switch (ctl.ai->ai_family) {
-	case AF_INET6:
-		ctl.overhead = DEFAULT_OVERHEAD_IPV6;
-		if (!ctl.mtu)
-			ctl.mtu = DEFAULT_MTU_IPV6;
-		if (ctl.mtu <= ctl.overhead)
-			goto pktlen_error;
-
-		on = IPV6_PMTUDISC_DO;
-		if (setsockopt(ctl.socket_fd, SOL_IPV6, IPV6_MTU_DISCOVER, &on, sizeof(on)) &&
-		    (on = IPV6_PMTUDISC_DO, setsockopt(ctl.socket_fd, SOL_IPV6,
-		     IPV6_MTU_DISCOVER, &on, sizeof(on))))
-			error(1, errno, "IPV6_MTU_DISCOVER");
-		on = 1;
-		if (setsockopt(ctl.socket_fd, SOL_IPV6, IPV6_RECVERR, &on, sizeof(on)))
-			error(1, errno, "IPV6_RECVERR");
-		if (setsockopt(ctl.socket_fd, SOL_IPV6, IPV6_HOPLIMIT, &on, sizeof(on))
-#ifdef IPV6_RECVHOPLIMIT
-		    && setsockopt(ctl.socket_fd, SOL_IPV6, IPV6_2292HOPLIMIT, &on, sizeof(on))
-#endif
-		    )
-			error(1, errno, "IPV6_HOPLIMIT");
-		if (!IN6_IS_ADDR_V4MAPPED(&(((struct sockaddr_in6 *)&ctl.target)->sin6_addr)))
-			break;
-		ctl.mapped = 1;
-		/*FALLTHROUGH*/
-	case AF_INET:
-		ctl.overhead = DEFAULT_OVERHEAD_IPV4;
-		if (!ctl.mtu)
-			ctl.mtu = DEFAULT_MTU_IPV4;
-		if (ctl.mtu <= ctl.overhead)
-			goto pktlen_error;
+	if (setup_socket(&ctl))
+		goto pktlen_error;
 
-		on = IP_PMTUDISC_DO;
-		if (setsockopt(ctl.socket_fd, SOL_IP, IP_MTU_DISCOVER, &on, sizeof(on)))
-			error(1, errno, "IP_MTU_DISCOVER");
-		on = 1;
-		if (setsockopt(ctl.socket_fd, SOL_IP, IP_RECVERR, &on, sizeof(on)))
-			error(1, errno, "IP_RECVERR");
-		if (setsockopt(ctl.socket_fd, SOL_IP, IP_RECVTTL, &on, sizeof(on)))
-			error(1, errno, "IP_RECVTTL");
-	}
+	errq_init(&ctl);
+	if (!ctl.no_resolve || ctl.show_both)
+		resolver_init(getnameinfo_flags);
 
-	ctl.pktbuf = malloc(ctl.mtu);
+	ctl.pktbuf = calloc(1, ctl.mtu);
 	if (!ctl.pktbuf)
-		error(1, errno, "malloc");
+		error(1, errno, "calloc");
+
+	if (ctl.fast_pmtu) {
+		fast_pmtu(&ctl);
+		goto done;
+	}
 
 	for (ctl.ttl = 1; ctl.ttl <= ctl.max_hops; ctl.ttl++) {
 		int res = -1;
 		int i;
 
-		on = ctl.ttl;
-		switch (ctl.ai->ai_family) {
-		case AF_INET6:
-			if (setsockopt(ctl.socket_fd, SOL_IPV6, IPV6_UNICAST_HOPS, &on, sizeof(on)))
-				error(1, errno, "IPV6_UNICAST_HOPS");
-			if (!ctl.mapped)
-				break;
-			/*FALLTHROUGH*/
-		case AF_INET:
-			if (setsockopt(ctl.socket_fd, SOL_IP, IP_TTL, &on, sizeof(on)))
-				error(1, errno, "IP_TTL");
-		}
+		set_ttl(&ctl, ctl.ttl);
 
  restart:
 		for (i = 0; i < 3; i++) {
@@ -605,14 +1538,24 @@ int main(int argc, char **argv)
 	printf("     Too many hops: pmtu %d\n", ctl.mtu);
 
  done:
-	freeaddrinfo(result);
-
 	printf(_("     Resume: pmtu %d "), ctl.mtu);
 	if (ctl.hops_to >= 0)
 		printf(_("hops %d "), ctl.hops_to);
 	if (ctl.hops_from >= 0)
 		printf(_("back %d "), ctl.hops_from);
 	printf("\n");
+
+	if (ctl.continuous) {
+		ctl.nhops = ctl.hops_to >= 0 ? ctl.hops_to : ctl.ttl;
+		if (ctl.nhops > ctl.max_hops)
+			ctl.nhops = ctl.max_hops;
+		/* Every hop of a round needs a slot in its half of his[]. */
+		if (ctl.nhops > HIS_ARRAY_SIZE / 2)
+			ctl.nhops = HIS_ARRAY_SIZE / 2;
+		run_continuous(&ctl);
+	}
+	resolver_report();
+	freeaddrinfo(result);
 	exit(0);
 
  pktlen_error:
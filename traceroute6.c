@@ -223,6 +223,8 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <linux/filter.h>
 #include <linux/types.h>
 #include <netdb.h>
 #include <net/if.h>
@@ -233,6 +235,7 @@
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
 #include <netinet/udp.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -252,7 +255,9 @@
 # include <sys/capability.h>
 #endif
 
+#include "doubletree.h"
 #include "iputils_common.h"
+#include "resolver.h"
 
 #ifdef USE_IDN
 # define ADDRINFO_IDN_FLAGS	AI_IDN
@@ -269,6 +274,8 @@ enum {
 	DEFAULT_WAIT = 5,
 	PACKET_SIZE = 512,
 	MAXPACKET = 65535,
+	MAX_INFLIGHT = 512,
+	SEND_BATCH = 64,
 
 	/*
 	 * The following are copy from linux/icmpv6.h that cannot be
@@ -304,14 +311,37 @@ enum {
 	NDISC_REDIRECT = 137,
 };
 
-#ifndef FD_SET
-# define NFDBITS         (8 * sizeof(fd_set))
-# define FD_SETSIZE      NFDBITS
-# define FD_SET(n, p)    ((p)->fds_bits[(n) / NFDBITS] |= (1 << ((n) % NFDBITS)))
-# define FD_CLR(n, p)    ((p)->fds_bits[(n) / NFDBITS] &= ~(1 << ((n) % NFDBITS)))
-# define FD_ISSET(n, p)  ((p)->fds_bits[(n) / NFDBITS] & (1 << ((n) % NFDBITS)))
-# define FD_ZERO(p)      memset((char *)(p), 0, sizeof(*(p)))
-#endif
+struct pkt_format {
+	uint32_t ident;
+	uint32_t seq;
+	struct timespec ts;
+};
+
+/*
+ * Probes queued for one sendmmsg() call.  The hop limit travels with each
+ * packet as ancillary data, and the payload after the header is shared.
+ */
+struct probe_batch {
+	struct mmsghdr msg[SEND_BATCH];
+	struct iovec iov[SEND_BATCH][2];
+	struct pkt_format pkt[SEND_BATCH];
+	struct sockaddr_in6 addr[SEND_BATCH];
+	char cbuf[SEND_BATCH][CMSG_SPACE(sizeof(int))];
+	int count;
+};
+
+/* A probe in flight, found by its sequence number modulo nslots. */
+struct probe_slot {
+	uint32_t seq;
+	int ttl;
+	int code;			/* packet_ok() result, 0 if no reply */
+	struct timespec sent;		/* CLOCK_MONOTONIC, for the deadline */
+	struct timespec ts;		/* send time echoed back in the reply */
+	struct timespec rcvd;		/* kernel receive time, CLOCK_REALTIME */
+	struct sockaddr_in6 from;
+	unsigned int
+		answered:1;
+};
 
 struct run_state {
 	unsigned char packet[PACKET_SIZE];	/* last inbound (icmp) packet */
@@ -330,16 +360,14 @@ struct run_state {
 	pid_t ident;
 	uint16_t port;			/* start udp dest port # for probe packets */
 	int options;			/* socket options */
-	int waittime;			/* time to wait for response (in seconds) */
+	struct timespec waittime;	/* time to wait for response */
+	struct probe_slot *slots;	/* probes in flight */
+	int nslots;
+	int resolver_fd;		/* readable when a name lookup is done */
 	unsigned int
 		nflag:1,		/* print addresses numerically */
 		verbose:1;
-};
-
-struct pkt_format {
-	uint32_t ident;
-	uint32_t seq;
-	struct timespec ts;
+	struct probe_batch batch;	/* probes not sent yet */
 };
 
 /*
@@ -347,34 +375,50 @@ struct pkt_format {
  * above.  After this comment all you can find is functions.
  */
 
+static void timespecadd(struct timespec const *a, struct timespec const *b,
+			struct timespec *res)
+{
+	res->tv_sec = a->tv_sec + b->tv_sec;
+	res->tv_nsec = a->tv_nsec + b->tv_nsec;
+	if (res->tv_nsec >= 1000000000L) {
+		res->tv_sec++;
+		res->tv_nsec -= 1000000000L;
+	}
+}
+
+static int timespec_before(struct timespec const *a, struct timespec const *b)
+{
+	return a->tv_sec < b->tv_sec ||
+	       (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * Wait until the absolute CLOCK_MONOTONIC 'deadline' for one ICMPv6 packet.
+ * The caller computes it from the probes in flight, so foreign ICMPv6
+ * traffic waking us up cannot extend the wait.  The kernel receive time is
+ * stored in 'rcvd'.
+ */
 static int wait_for_reply(struct run_state *ctl, struct sockaddr_in6 *from,
-			  struct in6_addr *to, const uint8_t reset_timer)
+			  struct in6_addr *to, struct timespec const *deadline,
+			  struct timespec *rcvd)
 {
-	fd_set fds;
-	static struct timeval wait;
+	struct pollfd pfd[2] = {
+		{ .fd = ctl->icmp_sock, .events = POLLIN },
+		{ .fd = ctl->resolver_fd, .events = POLLIN }
+	};
+	struct timespec now, timeout = { 0, 0 };
 	ssize_t cc = 0;
 	char cbuf[PACKET_SIZE];
 
-	FD_ZERO(&fds);
-	FD_SET(ctl->icmp_sock, &fds);
-	if (reset_timer) {
-		/*
-		 * traceroute could hang if someone else has a ping
-		 * running and our ICMP reply gets dropped but we don't
-		 * realize it because we keep waking up to handle those
-		 * other ICMP packets that keep coming in.  To fix this,
-		 * "reset_timer" will only be true if the last packet that
-		 * came in was for us or if this is the first time we're
-		 * waiting for a reply since sending out a probe.  Note
-		 * that this takes advantage of the select() feature on
-		 * Linux where the remaining timeout is written to the
-		 * struct timeval area.
-		 */
-		wait.tv_sec = ctl->waittime;
-		wait.tv_usec = 0;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timespec_before(&now, deadline))
+		timespecsub((struct timespec *)deadline, &now, &timeout);
 
-	if (select(ctl->icmp_sock + 1, &fds, NULL, NULL, &wait) > 0) {
+	if (ppoll(pfd, 2, &timeout, NULL) <= 0)
+		return 0;
+	if (pfd[1].revents & POLLIN)
+		resolver_ack();
+	if (pfd[0].revents & POLLIN) {
 		struct iovec iov = {
 			.iov_base = ctl->packet,
 			.iov_len = sizeof(ctl->packet)
@@ -394,7 +438,13 @@ static int wait_for_reply(struct run_state *ctl, struct sockaddr_in6 *from,
 			struct cmsghdr *cmsg;
 			struct in6_pktinfo *ipi;
 
+			clock_gettime(CLOCK_REALTIME, rcvd);
 			for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+				if (cmsg->cmsg_level == SOL_SOCKET &&
+				    cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+					memcpy(rcvd, CMSG_DATA(cmsg), sizeof(*rcvd));
+					continue;
+				}
 				if (cmsg->cmsg_level != SOL_IPV6)
 					continue;
 				switch (cmsg->cmsg_type) {
@@ -413,30 +463,76 @@ static int wait_for_reply(struct run_state *ctl, struct sockaddr_in6 *from,
 	return (cc);
 }
 
-static void send_probe(struct run_state *ctl, uint32_t seq, int ttl)
+static void flush_probes(struct run_state *ctl)
 {
-	struct pkt_format *pkt = (struct pkt_format *)ctl->sendbuff;
+	struct probe_batch *b = &ctl->batch;
+	int sent = 0;
 	int i;
 
-	pkt->ident = htonl(ctl->ident);
-	pkt->seq = htonl(seq);
-	clock_gettime(CLOCK_MONOTONIC, &pkt->ts);
-
-	i = setsockopt(ctl->sndsock, SOL_IPV6, IPV6_UNICAST_HOPS, &ttl, sizeof(ttl));
-	if (i < 0)
-		error(1, errno, "setsockopt");
+	while (sent < b->count) {
+		i = sendmmsg(ctl->sndsock, b->msg + sent, b->count - sent, 0);
+		if (i < 0) {
+			if (errno == ECONNREFUSED)
+				continue;
+			error(0, errno, "sendmmsg");
+			printf(_("traceroute: wrote %s %d chars, ret=%d\n"), ctl->hostname, ctl->datalen, i);
+			fflush(stdout);
+			sent++;
+			continue;
+		}
+		for (; i > 0; i--, sent++) {
+			if ((int)b->msg[sent].msg_len != ctl->datalen) {
+				printf(_("traceroute: wrote %s %d chars, ret=%u\n"), ctl->hostname,
+				       ctl->datalen, b->msg[sent].msg_len);
+				fflush(stdout);
+			}
+		}
+	}
+	b->count = 0;
+}
 
-	do {
-		i = sendto(ctl->sndsock, ctl->sendbuff, ctl->datalen, 0,
-			   (struct sockaddr *)&ctl->whereto, sizeof(ctl->whereto));
-	} while (i < 0 && errno == ECONNREFUSED);
+static void queue_probe(struct run_state *ctl, uint32_t seq, int ttl)
+{
+	struct probe_batch *b = &ctl->batch;
+	struct msghdr *msg;
+	struct cmsghdr *cmsg;
+	int n;
+
+	if (b->count == SEND_BATCH)
+		flush_probes(ctl);
+	n = b->count++;
+
+	b->pkt[n].ident = htonl(ctl->ident);
+	b->pkt[n].seq = htonl(seq);
+	/* Same clock as the SO_TIMESTAMPNS receive time. */
+	clock_gettime(CLOCK_REALTIME, &b->pkt[n].ts);
+	b->addr[n] = ctl->whereto;
+
+	b->iov[n][0].iov_base = &b->pkt[n];
+	b->iov[n][0].iov_len = sizeof(struct pkt_format);
+	b->iov[n][1].iov_base = ctl->sendbuff + sizeof(struct pkt_format);
+	b->iov[n][1].iov_len = ctl->datalen - sizeof(struct pkt_format);
+
+	msg = &b->msg[n].msg_hdr;
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_name = &b->addr[n];
+	msg->msg_namelen = sizeof(b->addr[n]);
+	msg->msg_iov = b->iov[n];
+	msg->msg_iovlen = 2;
+	msg->msg_control = b->cbuf[n];
+	msg->msg_controllen = sizeof(b->cbuf[n]);
+
+	cmsg = CMSG_FIRSTHDR(msg);
+	cmsg->cmsg_level = SOL_IPV6;
+	cmsg->cmsg_type = IPV6_HOPLIMIT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &ttl, sizeof(int));
+}
 
-	if (i < 0 || i != ctl->datalen) {
-		if (i < 0)
-			error(0, errno, "sendto");
-		printf(_("traceroute: wrote %s %d chars, ret=%d\n"), ctl->hostname, ctl->datalen, i);
-		fflush(stdout);
-	}
+static void send_probe(struct run_state *ctl, uint32_t seq, int ttl)
+{
+	queue_probe(ctl, seq, ttl);
+	flush_probes(ctl);
 }
 
 static double deltaT(struct timespec *a, struct timespec *b)
@@ -512,8 +608,11 @@ static char const *pr_type(const uint8_t t)
 	abort();
 }
 
-static int packet_ok(struct run_state *ctl, int cc, struct sockaddr_in6 *from,
-		     struct in6_addr *to, uint32_t seq, struct timespec *ts)
+/*
+ * Return our probe quoted in the ICMPv6 error held in ctl->packet, or NULL
+ * if the packet is something else.
+ */
+static struct pkt_format *quoted_probe(struct run_state *ctl)
 {
 	struct icmp6_hdr *icp = (struct icmp6_hdr *)ctl->packet;
 	uint8_t type, code;
@@ -540,13 +639,39 @@ static int packet_ok(struct run_state *ctl, int cc, struct sockaddr_in6 *from,
 
 			pkt = (struct pkt_format *)(up + 1);
 
-			if (ntohl(pkt->ident) == (uint32_t) ctl->ident && ntohl(pkt->seq) == seq) {
-				*ts = pkt->ts;
-				return (type == ICMP6_TIME_EXCEEDED ? -1 : code + 1);
-			}
+			if (ntohl(pkt->ident) == (uint32_t) ctl->ident)
+				return pkt;
 		}
 
 	}
+	return NULL;
+}
+
+/*
+ * Match a reply against the in-flight table.  Returns -1 for time exceeded,
+ * the unreachable code + 1, or 0 if the packet does not answer a probe
+ * still waited for.
+ */
+static int packet_ok(struct run_state *ctl, int cc, struct sockaddr_in6 *from,
+		     struct in6_addr *to, struct probe_slot **slot)
+{
+	struct icmp6_hdr *icp = (struct icmp6_hdr *)ctl->packet;
+	struct pkt_format *pkt;
+	uint8_t type, code;
+
+	type = icp->icmp6_type;
+	code = icp->icmp6_code;
+
+	pkt = quoted_probe(ctl);
+	if (pkt) {
+		struct probe_slot *s = &ctl->slots[ntohl(pkt->seq) % ctl->nslots];
+
+		if (s->seq == ntohl(pkt->seq) && !s->answered) {
+			s->ts = pkt->ts;
+			*slot = s;
+			return (type == ICMP6_TIME_EXCEEDED ? -1 : code + 1);
+		}
+	}
 
 	if (ctl->verbose) {
 		unsigned char *p;
@@ -587,20 +712,432 @@ static void print(struct run_state *ctl, struct sockaddr_in6 *from)
 		printf(" %s", inet_ntop(AF_INET6, &from->sin6_addr, pa, sizeof(pa)));
 	else {
 		inet_ntop(AF_INET6, &from->sin6_addr, pa, sizeof(pa));
-		getnameinfo((struct sockaddr *)from, sizeof *from, hnamebuf,
-			    sizeof hnamebuf, NULL, 0, getnameinfo_flags);
+		resolver_lookup((struct sockaddr *)from, sizeof *from, hnamebuf,
+				sizeof hnamebuf);
 
 		printf(" %s (%s)", hnamebuf[0] ? hnamebuf : pa, pa);
 	}
 }
 
+static int slot_expired(struct run_state *ctl, struct probe_slot *s,
+			struct timespec *now, struct timespec *deadline)
+{
+	timespecadd(&s->sent, &ctl->waittime, deadline);
+	return !timespec_before(now, deadline);
+}
+
+/* Hop being printed, its probes come out one at a time. */
+struct hop_print {
+	struct in6_addr lastaddr;
+	uint8_t got_there;
+	long unreachable;
+};
+
+/*
+ * Print the probe 'seq' once it is answered or timed out, with the hop
+ * number before the first probe of a hop.  Returns 1 if the trace ends at
+ * the hop it completes, 0 if it does not and -1 if the probe is not done
+ * yet, in which case 'wait' is lowered to its deadline.
+ */
+static int print_probe(struct run_state *ctl, uint32_t seq, struct hop_print *hp,
+		       struct timespec *now, struct timespec *wait)
+{
+	struct probe_slot *s = &ctl->slots[seq % ctl->nslots];
+	long probe = (seq - 1) % ctl->nprobes;
+	struct timespec deadline;
+	char name[NI_MAXHOST];
+
+	if (!s->answered && !slot_expired(ctl, s, now, &deadline)) {
+		if (timespec_before(&deadline, wait))
+			*wait = deadline;
+		return -1;
+	}
+	/* Give the name as long as the probe to arrive. */
+	if (!ctl->nflag && s->answered && !slot_expired(ctl, s, now, &deadline) &&
+	    resolver_lookup((struct sockaddr *)&s->from, sizeof(s->from),
+			    name, sizeof(name)) == RESOLVER_PENDING) {
+		if (timespec_before(&deadline, wait))
+			*wait = deadline;
+		return -1;
+	}
+
+	if (probe == 0) {
+		memset(hp, 0, sizeof(*hp));
+		printf("%2d ", s->ttl);
+	}
+	if (!s->answered)
+		printf(" *");
+	else {
+		if (memcmp(&s->from.sin6_addr, &hp->lastaddr, sizeof(hp->lastaddr))) {
+			print(ctl, &s->from);
+			memcpy(&hp->lastaddr, &s->from.sin6_addr, sizeof(hp->lastaddr));
+		}
+		printf(_("  %.4f ms"), deltaT(&s->ts, &s->rcvd));
+		switch (s->code - 1) {
+		case ICMP6_DST_UNREACH_NOPORT:
+			hp->got_there = 1;
+			break;
+
+		case ICMP6_DST_UNREACH_NOROUTE:
+			++hp->unreachable;
+			printf(" !N");
+			break;
+		case ICMP6_DST_UNREACH_ADDR:
+			++hp->unreachable;
+			printf(" !H");
+			break;
+
+		case ICMP6_DST_UNREACH_ADMIN:
+			++hp->unreachable;
+			printf(" !X");
+			break;
+		}
+	}
+	if (probe < ctl->nprobes - 1)
+		return 0;
+	putchar('\n');
+	fflush(stdout);
+	return hp->got_there || (hp->unreachable > 0 && hp->unreachable >= ctl->nprobes - 1);
+}
+
+/*
+ * Probe a window of hops at once instead of one probe at a time.  Replies
+ * are matched to probes by sequence number through the slot table, and
+ * probes are printed in order as soon as they are done, so a trace takes
+ * about one round trip plus one timeout rather than one timeout per silent
+ * probe.  The window holds MAX_INFLIGHT probes at most, a hop with more
+ * probes than that is sent in pieces.
+ */
+static void trace(struct run_state *ctl)
+{
+	uint32_t last_seq = ctl->max_ttl * ctl->nprobes;
+	uint32_t sent_seq = 0;
+	uint32_t printed = 0;
+	struct hop_print hp = { .got_there = 0 };
+
+	if (ctl->nprobes <= MAX_INFLIGHT) {
+		int window = MAX_INFLIGHT / ctl->nprobes;
+
+		if (window > ctl->max_ttl)
+			window = ctl->max_ttl;
+		ctl->nslots = window * ctl->nprobes;
+	} else
+		ctl->nslots = MAX_INFLIGHT;
+	ctl->slots = calloc(ctl->nslots, sizeof(*ctl->slots));
+	if (!ctl->slots)
+		error(1, errno, "calloc");
+
+	for (;;) {
+		struct timespec now, wait, rcvd;
+		struct sockaddr_in6 from;
+		struct in6_addr to_addr;
+		struct probe_slot *s;
+		ssize_t cc;
+		int ret;
+		uint32_t seq = sent_seq;
+
+		while (sent_seq < last_seq && sent_seq < printed + ctl->nslots) {
+			int ttl = sent_seq / ctl->nprobes + 1;
+
+			sent_seq++;
+			s = &ctl->slots[sent_seq % ctl->nslots];
+			memset(s, 0, sizeof(*s));
+			s->seq = sent_seq;
+			s->ttl = ttl;
+			queue_probe(ctl, sent_seq, ttl);
+		}
+		flush_probes(ctl);
+
+		/* Start the clock once the whole batch is out. */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		while (seq < sent_seq)
+			ctl->slots[++seq % ctl->nslots].sent = now;
+		timespecadd(&now, &ctl->waittime, &wait);
+		while (printed < sent_seq && printed < last_seq &&
+		       (ret = print_probe(ctl, printed + 1, &hp, &now, &wait)) >= 0) {
+			printed++;
+			if (ret)
+				last_seq = printed;
+		}
+		if (printed >= last_seq)
+			break;
+		if (sent_seq < last_seq && sent_seq < printed + ctl->nslots)
+			continue;
+
+		cc = wait_for_reply(ctl, &from, &to_addr, &wait, &rcvd);
+		if (cc <= 0)
+			continue;
+		ret = packet_ok(ctl, cc, &from, &to_addr, &s);
+		if (!ret)
+			continue;
+		s->rcvd = rcvd;
+		s->answered = 1;
+		s->code = ret;
+		s->from = from;
+		if (ret - 1 == ICMP6_DST_UNREACH_NOPORT &&
+		    (uint32_t)s->ttl * ctl->nprobes < last_seq)
+			last_seq = s->ttl * ctl->nprobes;
+	}
+	free(ctl->slots);
+	ctl->slots = NULL;
+}
+
+struct dt_dest {
+	struct sockaddr_in6 addr;
+	struct dt_trace trace;
+	struct timespec deadline;
+	uint32_t seq;
+	char name[NI_MAXHOST];
+	unsigned int active:1;
+};
+
+static int dt_open(struct run_state *ctl, struct dt_dest *d, char const *name, int midpoint)
+{
+	struct addrinfo hints6 = {
+		.ai_family = AF_INET6,
+		.ai_socktype = SOCK_RAW,
+		.ai_flags = ADDRINFO_IDN_FLAGS
+	};
+	struct addrinfo *result;
+	int status;
+
+	memset(&d->addr, 0, sizeof(d->addr));
+	d->addr.sin6_family = AF_INET6;
+	if (inet_pton(AF_INET6, name, &d->addr.sin6_addr) <= 0) {
+		status = getaddrinfo(name, NULL, &hints6, &result);
+		if (status) {
+			error(0, 0, "%s: %s", name, gai_strerror(status));
+			return -1;
+		}
+		memcpy(&d->addr, result->ai_addr, sizeof(d->addr));
+		freeaddrinfo(result);
+	}
+	d->addr.sin6_port = htons(ctl->port);
+	snprintf(d->name, sizeof(d->name), "%s", name);
+	dt_start(&d->trace, (struct sockaddr *)&d->addr, midpoint, ctl->max_ttl);
+	d->active = 1;
+	return 0;
+}
+
+static void dt_send(struct run_state *ctl, struct dt_dest *d, uint32_t seq)
+{
+	d->seq = seq;
+	d->trace.probes++;
+	ctl->whereto = d->addr;
+	ctl->hostname = d->name;
+	send_probe(ctl, seq, d->trace.ttl);
+
+	clock_gettime(CLOCK_MONOTONIC, &d->deadline);
+	d->deadline.tv_sec += DT_TIMEOUT_MS / 1000;
+	d->deadline.tv_nsec += (DT_TIMEOUT_MS % 1000) * 1000000L;
+	if (d->deadline.tv_nsec >= 1000000000L) {
+		d->deadline.tv_sec++;
+		d->deadline.tv_nsec -= 1000000000L;
+	}
+}
+
+static void dt_close(struct doubletree *dt, struct dt_dest *d)
+{
+	dt_finish(dt, &d->trace);
+	printf("%s: ", d->name);
+	if (d->trace.reached)
+		printf(_("hops %d "), d->trace.reached);
+	else if (!d->trace.stopped)
+		printf(_("not reached "));
+	if (d->trace.merged)
+		printf(_("merged %d "), d->trace.merged);
+	if (d->trace.stopped)
+		printf(_("stopped %d "), d->trace.stopped);
+	printf(_("probes %d\n"), d->trace.probes);
+	d->active = 0;
+}
+
+/*
+ * Batch mode: trace every destination listed in 'in', DT_WINDOW of them at
+ * a time, sharing one Doubletree stop set.  The slot of a destination is
+ * encoded in the low bits of the probe sequence number.
+ */
+static void run_doubletree(struct run_state *ctl, FILE *in, int midpoint)
+{
+	struct doubletree dt;
+	struct dt_dest *dests;
+	struct pollfd pfd = {
+		.fd = ctl->icmp_sock,
+		.events = POLLIN
+	};
+	struct sockaddr_in6 from;
+	socklen_t fromlen;
+	struct timespec now;
+	struct timespec left;
+	struct pkt_format *pkt;
+	char line[NI_MAXHOST];
+	uint32_t seq = 0;
+	int more = 1;
+	int active;
+	int timeout;
+	int i;
+
+	doubletree_init(&dt);
+	dests = calloc(DT_WINDOW, sizeof(*dests));
+	if (!dests)
+		error(1, errno, "cannot allocate memory");
+
+	for (;;) {
+		active = 0;
+		timeout = DT_TIMEOUT_MS;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (i = 0; i < DT_WINDOW; i++) {
+			struct dt_dest *const d = &dests[i];
+
+			while (!d->active && more) {
+				if (!fgets(line, sizeof(line), in)) {
+					more = 0;
+					break;
+				}
+				line[strcspn(line, " \t\r\n#")] = '\0';
+				if (line[0] && !dt_open(ctl, d, line, midpoint))
+					dt_send(ctl, d, ++seq * DT_WINDOW + i);
+			}
+			if (!d->active)
+				continue;
+			active++;
+			timespecsub(&d->deadline, &now, &left);
+			if (left.tv_sec < 0)
+				timeout = 0;
+			else if (left.tv_sec * 1000 + left.tv_nsec / 1000000 < timeout)
+				timeout = left.tv_sec * 1000 + left.tv_nsec / 1000000;
+		}
+		if (!active)
+			break;
+
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+			error(1, errno, "poll");
+
+		fromlen = sizeof(from);
+		while (recvfrom(ctl->icmp_sock, ctl->packet, sizeof(ctl->packet), MSG_DONTWAIT,
+				(struct sockaddr *)&from, &fromlen) >= 0) {
+			struct icmp6_hdr *icp = (struct icmp6_hdr *)ctl->packet;
+			struct dt_dest *d;
+			int kind;
+
+			fromlen = sizeof(from);
+			pkt = quoted_probe(ctl);
+			if (!pkt)
+				continue;
+			i = ntohl(pkt->seq) % DT_WINDOW;
+			d = &dests[i];
+			if (!d->active || d->seq != ntohl(pkt->seq))
+				continue;
+			if (icp->icmp6_type == ICMP6_TIME_EXCEEDED)
+				kind = DT_HOP_TRANSIT;
+			else if (icp->icmp6_code == ICMP6_DST_UNREACH_NOPORT)
+				kind = DT_HOP_REACHED;
+			else
+				kind = DT_HOP_UNREACH;
+			if (dt_reply(&dt, &d->trace, (struct sockaddr *)&from, d->trace.ttl, kind))
+				dt_send(ctl, d, ++seq * DT_WINDOW + i);
+			else
+				dt_close(&dt, d);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (i = 0; i < DT_WINDOW; i++) {
+			struct dt_dest *const d = &dests[i];
+
+			if (!d->active)
+				continue;
+			timespecsub(&d->deadline, &now, &left);
+			if (left.tv_sec >= 0)
+				continue;
+			if (dt_timeout(&d->trace))
+				dt_send(ctl, d, ++seq * DT_WINDOW + i);
+			else
+				dt_close(&dt, d);
+		}
+	}
+
+	doubletree_print(&dt);
+	doubletree_free(&dt);
+	free(dests);
+}
+
+/*
+ * Only errors quoting one of our probes are passed up: hop limit exceeded
+ * and destination unreachable, carrying a UDP packet, optionally behind a
+ * fragment header, to our port with our ident.
+ */
+static void install_filter(struct run_state *ctl)
+{
+	static struct sock_filter insns[] = {
+		BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, 14),	/* Load quoted next header */
+		BPF_STMT(BPF_LDX | BPF_W   | BPF_IMM, 48),	/* UDP header offset */
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 4, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_FRAGMENT, 0, 8),
+		BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, 48),	/* Next header after fragment */
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 6),
+		BPF_STMT(BPF_LDX | BPF_W   | BPF_IMM, 56),
+		BPF_STMT(BPF_LD  | BPF_H   | BPF_IND, 2),	/* Load destination port */
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0xAAAA, 0, 3), /* Ours? */
+		BPF_STMT(BPF_LD  | BPF_W   | BPF_IND, 8),	/* Load probe ident */
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0xAAAAAAAA, 0, 1), /* Ours? */
+		BPF_STMT(BPF_RET | BPF_K, ~0U),			/* Yes, it passes. */
+		BPF_STMT(BPF_RET | BPF_K, 0)			/* Not ours. Reject. */
+	};
+	static struct sock_fprog prog = {
+		sizeof insns / sizeof(insns[0]),
+		insns
+	};
+	struct icmp6_filter filter;
+
+	ICMP6_FILTER_SETBLOCKALL(&filter);
+	ICMP6_FILTER_SETPASS(ICMP6_TIME_EXCEEDED, &filter);
+	ICMP6_FILTER_SETPASS(ICMP6_DST_UNREACH, &filter);
+	if (setsockopt(ctl->icmp_sock, IPPROTO_ICMPV6, ICMP6_FILTER, &filter, sizeof(filter)) < 0)
+		error(2, errno, "setsockopt(ICMP6_FILTER)");
+
+	/* Patch bpflet for current port and identifier. */
+	insns[8] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ctl->port, 0, 3);
+	insns[10] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)ctl->ident, 0, 1);
+
+	if (setsockopt(ctl->icmp_sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)))
+		error(0, errno, _("WARNING: failed to install socket filter"));
+}
+
+/*
+ * Parse a wait time in seconds, which may be fractional or carry an
+ * "s", "ms" or "us" suffix.
+ */
+static void parse_wait(struct timespec *wait, char const *str)
+{
+	char *end;
+	double sec;
+
+	errno = 0;
+	sec = strtod(str, &end);
+	if (errno || end == str)
+		error(1, 0, _("invalid wait time: %s"), str);
+	if (!strcmp(end, "ms"))
+		sec /= 1000;
+	else if (!strcmp(end, "us"))
+		sec /= 1000000;
+	else if (*end && strcmp(end, "s"))
+		error(1, 0, _("invalid wait time: %s"), str);
+	if (sec < 0.000001 || sec > INT_MAX)
+		error(1, 0, _("wait time out of range: %s"), str);
+	wait->tv_sec = (time_t)sec;
+	wait->tv_nsec = (long)((sec - wait->tv_sec) * 1000000000L);
+}
+
 static __attribute__((noreturn)) void usage(void)
 {
 	fprintf(stderr, _(
 		"\nUsage:\n"
 		"  traceroute6 [options] <destination>\n"
+		"  traceroute6 [options] -F <file>\n"
 		"\nOptions:\n"
 		"  -d            use SO_DEBUG socket option\n"
+		"  -F <file>     trace all destinations listed in <file>\n"
+		"  -H <hop>      first hop probed in -F mode\n"
 		"  -i <device>   bind to <device>\n"
 		"  -m <hops>     use maximum <hops>\n"
 		"  -n            no dns name resolution\n"
@@ -609,7 +1146,7 @@ static __attribute__((noreturn)) void usage(void)
 		"  -r            use SO_DONTROUTE socket option\n"
 		"  -s <address>  use source <address>\n"
 		"  -v            verbose output\n"
-		"  -w <timeout>  time to wait for response\n"
+		"  -w <timeout>  time to wait for response, in s, ms or us\n"
 		"\nFor more details see traceroute6(8).\n"));
 	exit(1);
 }
@@ -634,7 +1171,8 @@ int main(int argc, char **argv)
 		.nprobes = DEFAULT_PROBES,
 		.max_ttl = DEFAULT_HOPS,
 		.port = DEFAULT_PORT,
-		.waittime = DEFAULT_WAIT,
+		.waittime = { DEFAULT_WAIT, 0 },
+		.resolver_fd = -1,
 		0
 	};
 	char pa[NI_MAXHOST];
@@ -647,12 +1185,11 @@ int main(int argc, char **argv)
 	};
 	struct addrinfo *result;
 	int status;
-	struct sockaddr_in6 from;
 	struct sockaddr_in6 *to = (struct sockaddr_in6 *)&ctl.whereto;
-	int ch, i, ttl, on = 1;
-	long probe;
-	uint32_t seq = 0;
+	int ch, on = 1;
 	char *resolved_hostname = NULL;
+	char *batch = NULL;
+	int midpoint = DT_MIDPOINT_DEFAULT;
 
 	atexit(close_stdout);
 	ctl.datalen = sizeof(struct pkt_format);
@@ -679,11 +1216,17 @@ int main(int argc, char **argv)
 	textdomain (PACKAGE_NAME);
 #endif
 #endif
-	while ((ch = getopt(argc, argv, "dm:np:q:rs:w:vi:V")) != EOF) {
+	while ((ch = getopt(argc, argv, "dF:H:m:np:q:rs:w:vi:V")) != EOF) {
 		switch (ch) {
 		case 'd':
 			ctl.options |= SO_DEBUG;
 			break;
+		case 'F':
+			batch = optarg;
+			break;
+		case 'H':
+			midpoint = strtol_or_err(optarg, _("invalid argument"), 1, DT_MAX_TTL);
+			break;
 		case 'm':
 			ctl.max_ttl = strtol_or_err(optarg, _("invalid argument"), 2, INT_MAX);
 			break;
@@ -713,9 +1256,7 @@ int main(int argc, char **argv)
 			ctl.verbose = 1;
 			break;
 		case 'w':
-			ctl.waittime = atoi(optarg);
-			if (ctl.waittime <= 1)
-				error(1, 0, _("wait must be >1 sec"));
+			parse_wait(&ctl.waittime, optarg);
 			break;
 		case 'V':
 			printf(IPUTILS_VERSION("traceroute6"));
@@ -727,12 +1268,17 @@ int main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
-	if (argc < 1)
+	if (batch ? argc != 0 : argc < 1)
 		usage();
+	/* Probes are numbered with 32 bits over the whole trace. */
+	if (ctl.nprobes > UINT32_MAX / ctl.max_ttl)
+		error(2, 0, _("too many probes for %d hops"), ctl.max_ttl);
 
 	setlinebuf(stdout);
 
 	memset((char *)&ctl.whereto, 0, sizeof(ctl.whereto));
+	if (batch)
+		goto setup;
 
 	to->sin6_family = AF_INET6;
 
@@ -767,7 +1313,11 @@ int main(int argc, char **argv)
 				    sizeof(struct pkt_format), MAXPACKET);
 	}
 
+ setup:
 	ctl.ident = getpid();
+	/* Keep the filters off to let -v show foreign packets. */
+	if (!ctl.verbose)
+		install_filter(&ctl);
 
 	ctl.sendbuff = malloc(ctl.datalen);
 	if (ctl.sendbuff == NULL)
@@ -779,6 +1329,7 @@ int main(int argc, char **argv)
 #else
 	setsockopt(ctl.icmp_sock, SOL_IPV6, IPV6_PKTINFO, &on, sizeof(on));
 #endif
+	setsockopt(ctl.icmp_sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
 
 	if (ctl.options & SO_DEBUG)
 		setsockopt(ctl.icmp_sock, SOL_SOCKET, SO_DEBUG, (char *)&on, sizeof(on));
@@ -809,7 +1360,11 @@ int main(int argc, char **argv)
 	if (ctl.options & SO_DONTROUTE)
 		setsockopt(ctl.sndsock, SOL_SOCKET, SO_DONTROUTE, (char *)&on, sizeof(on));
 
-	if (ctl.source == NULL) {
+	if (batch && ctl.source == NULL) {
+		/* Probes go to many destinations, let the kernel pick the source. */
+		memset((char *)&ctl.saddr, 0, sizeof(ctl.saddr));
+		ctl.saddr.sin6_family = AF_INET6;
+	} else if (ctl.source == NULL) {
 		socklen_t alen;
 		int probe_fd = socket(AF_INET6, SOCK_DGRAM, 0);
 
@@ -842,6 +1397,17 @@ int main(int argc, char **argv)
 	if (bind(ctl.icmp_sock, (struct sockaddr *)&ctl.saddr, sizeof(ctl.saddr)) < 0)
 		error(1, errno, "bind icmp6 socket");
 
+	if (batch) {
+		FILE *in = stdin;
+
+		if (strcmp(batch, "-") && !(in = fopen(batch, "r")))
+			error(1, errno, "%s", batch);
+		run_doubletree(&ctl, in, midpoint);
+		if (in != stdin)
+			fclose(in);
+		return 0;
+	}
+
 	fprintf(stderr, _("traceroute to %s (%s)"), ctl.hostname,
 		inet_ntop(AF_INET6, &to->sin6_addr, pa, sizeof(pa)));
 
@@ -849,61 +1415,10 @@ int main(int argc, char **argv)
 	fprintf(stderr, _(", %d hops max, %d byte packets\n"), ctl.max_ttl, ctl.datalen);
 	fflush(stderr);
 
-	for (ttl = 1; ttl <= ctl.max_ttl; ++ttl) {
-		struct in6_addr lastaddr = { {{0,}} };
-		uint8_t got_there = 0;
-		long unreachable = 0;
-
-		printf("%2d ", ttl);
-		for (probe = 0; probe < ctl.nprobes; ++probe) {
-			ssize_t cc;
-			uint8_t reset_timer = 1;
-			struct timespec t1, t2;
-			struct in6_addr to_addr;
-
-			clock_gettime(CLOCK_MONOTONIC, &t1);
-			send_probe(&ctl, ++seq, ttl);
-			while ((cc = wait_for_reply(&ctl, &from, &to_addr, reset_timer)) != 0) {
-				clock_gettime(CLOCK_MONOTONIC, &t2);
-				if ((i = packet_ok(&ctl, cc, &from, &to_addr, seq, &t1))) {
-					if (memcmp(&from.sin6_addr, &lastaddr,
-						   sizeof(from.sin6_addr))) {
-						print(&ctl, &from);
-						memcpy(&lastaddr,
-						       &from.sin6_addr, sizeof(lastaddr));
-					}
-					printf(_("  %.4f ms"), deltaT(&t1, &t2));
-					switch (i - 1) {
-					case ICMP6_DST_UNREACH_NOPORT:
-						got_there = 1;
-						break;
-
-					case ICMP6_DST_UNREACH_NOROUTE:
-						++unreachable;
-						printf(" !N");
-						break;
-					case ICMP6_DST_UNREACH_ADDR:
-						++unreachable;
-						printf(" !H");
-						break;
-
-					case ICMP6_DST_UNREACH_ADMIN:
-						++unreachable;
-						printf(" !X");
-						break;
-					}
-					break;
-				} else
-					reset_timer = 0;
-			}
-			if (cc <= 0)
-				printf(" *");
-			fflush(stdout);
-		}
-		putchar('\n');
-		if (got_there || (unreachable > 0 && unreachable >= ctl.nprobes - 1))
-			break;
-	}
+	if (!ctl.nflag)
+		ctl.resolver_fd = resolver_init(getnameinfo_flags);
+	trace(&ctl);
+	resolver_report();
 	free(resolved_hostname);
 	return 0;
 }